@@ -1,25 +1,49 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
-#include <signal.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "em6502.h"
+
+#if defined(__GNUC__) && !defined(EM6502_SWITCH_DISPATCH)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
 
-/************************************
-* Memory contents 
-************************************/
-static uint8_t ram[1024*16];
-static uint8_t rom1[1024*8];
-static uint8_t rom2[1024*8];
-static uint8_t rom3[1024*4];
-static uint8_t vic[16];
-static uint8_t colour[1024];
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(EM6502_NO_JIT)
+#define EM6502_JIT 1
+#else
+#define EM6502_JIT 0
+#endif
+
+#ifndef EM6502_NO_HISTORY
+#define EM6502_HISTORY 1
+#else
+#define EM6502_HISTORY 0
+#endif
+
+#if defined(__SSE2__) && !defined(EM6502_NO_SIMD)
+#define EM6502_SIMD 1
+#include <emmintrin.h>
+#else
+#define EM6502_SIMD 0
+#endif
 
 static uint8_t mem_read(uint16_t addr);
 static uint8_t mem_fetch(uint16_t addr);
 static void mem_write(uint16_t addr, uint8_t data);
 static void zeropage_dump(void);
+static void history_dump(void);
 /************************************
 * CPU state
 ************************************/
@@ -28,1756 +52,2345 @@ static void zeropage_dump(void);
 #define FLAG_I 0x04
 #define FLAG_D 0x08
 #define FLAG_B 0x10
+#define FLAG_U 0x20
 #define FLAG_V 0x40
 #define FLAG_N 0x80
-static struct cpu_state {
-  uint8_t  flags;
+struct cpu_state {
+  uint8_t  flags;      // I, D and B - the rest are kept lazily below
+  uint8_t  n_res;      // N is bit 7 of the last result
+  uint8_t  z_res;      // Z is set when the last result was zero
+  uint8_t  carry;      // C as 0 or 1
+  uint8_t  overflow;   // V is bit 7
   uint8_t  a;
   uint8_t  x;
   uint8_t  y;
   uint8_t  sp;
   uint16_t pc;
-  uint32_t cycle;
-} state;
-uint32_t last_display = 0;
+  uint64_t cycle;
+  uint64_t instructions;
+};
+
+/*****************************************************************
+* The machine
+*
+* Everything that changes while a VIC-20 runs lives in one struct
+* em6502, so any number of them can run at once, each on its own
+* thread. 'em' is the machine the calling thread is working on; each
+* of the em6502.h entry points sets it before doing anything else, so
+* the rest of the emulator reaches its machine without passing it
+* around. ROM images are only pointed to and never written, so one
+* copy can be shared by every machine that loads it.
+*****************************************************************/
+#define ROM_C000_SIZE  8192
+#define ROM_E000_SIZE  8192
+#define ROM_8000_SIZE  4096
+
+/* The PAL VIC-I, see vic_catch_up() */
+#define VIC_LINE_CYCLES  71
+#define VIC_LINES        (EM6502_FRAME_CYCLES/VIC_LINE_CYCLES)
+#define VIC_LINE_PIXELS  (VIC_LINE_CYCLES*4)
+#define VIC_FIRST_X      36        // of the raster in the framebuffer
+#define VIC_FIRST_LINE   38
+#define VIC_SHOWN        0xC02F    // the registers the picture depends on
+
+/* A 6522 VIA, see via_read(). Saved as it is, in struct saved_state. */
+struct via {
+  uint8_t  ora, orb, ddra, ddrb;
+  uint8_t  sr, acr, pcr, ifr, ier;
+  uint8_t  t2_latch;                     // the low byte, until T2 is started
+  uint16_t t1_latch;
+  uint16_t t1_start, t2_start;           // the counters at t1_base and t2_base
+  uint8_t  t1_armed, t2_armed;           // to interrupt when they next run out
+  uint64_t t1_base, t2_base;
+};
+
+/* The last instructions run, see history_dump() */
+#define HISTORY_SIZE  256
+enum { HISTORY_INSN, HISTORY_BLOCK, HISTORY_JIT, HISTORY_IRQ, HISTORY_NMI };
+
+/* The registers before it ran, as PACK_REGS() packs them, then the
+   PC, operand, opcode and kind. A block's operand is its length in
+   instructions. */
+struct history {
+  uint64_t cycle;
+  uint64_t regs;
+  uint64_t insn;
+};
+
+/* Things that happen at a given cycle, see event_run() */
+enum { EV_VIA1_T1, EV_VIA1_T2, EV_VIA2_T1, EV_VIA2_T2, EV_FRAME, EV_COUNT };
+
+struct event {
+  uint64_t cycle;
+  int      kind;
+};
+
+typedef uint8_t (*page_read_fn)(uint16_t addr);
+typedef void    (*page_write_fn)(uint16_t addr, uint8_t data);
+
+struct em6502 {
+  struct cpu_state state;
+  uint64_t         cpu_deadline;
+  const char      *cpu_stopped;          // why emulation stopped, or NULL
+  int            (*cpu_run_cycles)(uint32_t cycles);
+  uint8_t          irq;                  // VIA2's interrupt line
+  uint8_t          nmi;                  // and VIA1's
+  uint8_t          nmi_pending;          // it has gone active, and not been taken
+
+  /* Pending events, a min-heap on cycle */
+  struct event     events[EV_COUNT];
+  int              event_count;
+  int              event_slot[EV_COUNT]; // 1 + where each kind is, 0 for not pending
+  void           (*frame_fn)(void *ctx); // see em6502_on_frame()
+  void            *frame_ctx;
+
+  /* Memory contents */
+  uint8_t        ram[1024*16];
+  uint8_t        vic[16];
+  struct via     via[2];                 // VIA1 at $9110, VIA2 at $9120
+  uint8_t        colour[1024];
+  const uint8_t *rom1;                   // 8K at $C000, or NULL
+  const uint8_t *rom2;                   // 8K at $E000
+  const uint8_t *rom3;                   // 4K at $8000
+  uint32_t       rom_crc[3];             // of each of them, 0 for none
+
+  /* The memory map */
+  const uint8_t *page_read[256];
+  uint8_t       *page_write[256];
+  page_read_fn   page_io_read[256];
+  page_write_fn  page_io_write[256];
+
+  /* Tracing */
+  int      trace_level;
+  uint16_t trace_addr;
+  uint8_t  trace_opcode;
+  int32_t  trace_num;
+  uint8_t  trace_fetch_len;
+  struct tracefile *tracefile;           // see em6502_trace_file(), or NULL
+  uint8_t  dispatched[256];
+  uint8_t  dispatched1[256];
+
+  /* Stopping points, see em6502_stop_at() and em6502_stop_on_write() */
+  int32_t        run_exit_pc;            // -1 for none
+  int32_t        run_match_addr;         // -1 for none
+  uint8_t        run_match_value;
+  uint8_t       *run_saved_write;
+  page_write_fn  run_saved_io_write;
+
+  /* Breakpoints and watchpoints */
+  struct breakpoint *breakpoints;        // MAX_BREAKPOINTS of them
+  int                breakpoint_count;
+  uint8_t            bp_page[256];       // BP_* kinds set anywhere in each page
+  uint8_t            bp_pc_bits[8192];
+  uint8_t            bp_read_bits[8192];
+  uint8_t            bp_write_bits[8192];
+  const uint8_t     *watch_saved_read[256];
+  uint8_t           *watch_saved_write[256];
+  page_read_fn       watch_saved_io_read[256];
+  page_write_fn      watch_saved_io_write[256];
+
+  /* The block cache */
+  struct block  *block_cache;            // BLOCK_CACHE of them
+  struct block  *block_current;          // the block being run
+  uint64_t       idle_cycles;            // skipped in idle loops
+  uint32_t       page_gen[256];
+  uint8_t        code_page[256];
+  uint8_t        code_bits[65536/8];
+  uint8_t       *code_saved_write[256];
+  page_write_fn  code_saved_io_write[256];
+
+  /* The history ring, HISTORY_SIZE of them */
+  struct history *history;
+  uint32_t        history_next;          // entries since the last reset
+
+  /* Profiling, with em6502_profile() */
+  const char     *profile_file;
+  struct profile *profile;               // PROFILE_SIZE of them, once profiling
+  uint64_t        profile_insns;
+  uint32_t        profile_seq;           // the last four opcodes, newest in the low byte
+  int             profile_run;           // how many of them are in the current block
+  int             profile_used;
+
+  /* The VIC's picture, see vic_catch_up() */
+  struct em6502_display *vic_live;       // being drawn, a line at a time
+  struct em6502_display *vic_done;       // the last whole frame
+  uint64_t       vic_frame;              // of the next line to draw
+  int            vic_line;
+  int            vic_drawn;              // any lines this frame
+  uint64_t       vic_gen;                // bumped by each change to the picture
+  uint64_t       vic_all_gen;            // the last change to every line
+  uint64_t       vic_row_gen[64];        // and to each row of characters
+  uint64_t       vic_line_gen[VIC_LINES]; // vic_gen when each line was drawn
+  uint32_t       vic_serial;             // bumped when vic_done changes
+  uint32_t       vic_taken;              // as em6502_get_frame() last saw it
+  uint8_t        vic_page[256];          // the pages of memory shown
+  uint8_t       *vic_saved_write[256];
+  uint64_t       io_until;               // when I/O read since the last idle check changes
+
+#if EM6502_JIT
+  int               jit_enabled;
+  uint8_t          *jit_buffer;
+  uint8_t          *jit_ptr;
+  struct jit_stats *jit_stats;
+#endif
+};
+
+static _Thread_local struct em6502 *em;
+
+static uint8_t cpu_flags(void) {
+  return (em->state.flags & ~(FLAG_N|FLAG_V|FLAG_Z|FLAG_C)) | (em->state.n_res & FLAG_N) |
+         ((em->state.overflow & 0x80) >> 1) | (em->state.z_res ? 0 : FLAG_Z) | em->state.carry;
+}
+
+static void cpu_set_flags(uint8_t flags) {
+  em->state.flags    = flags;
+  em->state.n_res    = flags;
+  em->state.z_res    = ~flags & FLAG_Z;
+  em->state.carry    = flags & FLAG_C;
+  em->state.overflow = flags << 1;
+}
 static void cpu_dump(void);
 /**************************************
 * For tracing execution
 ***************************************/
 static void trace(char *msg);
-static uint16_t trace_addr;
-static uint8_t trace_opcode;
-static int32_t trace_num;
-static uint8_t trace_fetch_len;
 #define TRACE_OFF 0
 #define TRACE_OP  1
 #define TRACE_RD  2
 #define TRACE_WR  4
 #define TRACE_FETCH  8
+static void tracefile_access(int kind, uint16_t addr, uint8_t data);
 
 //static int trace_level = TRACE_OP|TRACE_RD|TRACE_WR|TRACE_FETCH;
 //static int trace_level = TRACE_OP|TRACE_RD;
 //static int trace_level = TRACE_OP|TRACE_WR|TRACE_RD;
 //static int trace_level = TRACE_OP;
-static int trace_level = TRACE_OFF;
-
 
-/********************************************************************************/
-/*************** START OF ALL THE OPCODE IMPLEMENTATOINS ************************/
-/********************************************************************************/
 
-static uint16_t addr_absolute(void) {
-  uint16_t rtn = mem_fetch(state.pc) | (mem_fetch(state.pc)<<8);
-  trace_num = rtn;
-  return rtn;
+static void logger_16_8(char *message, uint16_t data16, uint8_t data8) {
+  printf("%s %04X %02X\n", message, data16, data8);
 }
 
-static uint16_t addr_absolute_x(void) {
-  uint16_t rtn = mem_fetch(state.pc) | (mem_fetch(state.pc)<<8);
-  trace_num = rtn;
-  return rtn+state.x;
-}
+static void cpu_dump(void) {
+   uint8_t flags = cpu_flags();
+   printf("\n");
+   printf("Fault at cycle %llu\n",(unsigned long long)em->state.cycle);
+   printf("PC:    %04x\n",em->state.pc);
+   printf("flags: %02X ",flags);
+   putchar(flags & FLAG_N ? 'N' : ' '); 
+   putchar(flags & FLAG_V ? 'V' : ' '); 
+   putchar(' '); 
+   putchar(flags & FLAG_D ? 'D' : ' '); 
+   putchar(flags & FLAG_I ? 'I' : ' '); 
+   putchar(flags & FLAG_Z ? 'Z' : ' '); 
+   putchar(flags & FLAG_C ? 'C' : ' '); 
+   putchar('\n'); 
 
-static uint16_t addr_absolute_y(void) {
-  uint16_t rtn = mem_fetch(state.pc) | (mem_fetch(state.pc)<<8);
-  trace_num = rtn;
-  return rtn+state.y;
+   printf("A:     %02X\n",em->state.a);
+   printf("X:     %02X\n",em->state.x);
+   printf("Y:     %02X\n",em->state.y);
+   printf("SP:    %02X\n",em->state.sp);
 }
 
-static uint16_t addr_zpg(void) {
-  uint16_t rtn = mem_fetch(state.pc);
-  trace_num = rtn;
-  return rtn;
-}
+#if 0
+DETAILS OF THE VIC CHIP FROM
+http://www.zimmers.net/cbmpics/cbm/vic/memorymap.txt
 
-static uint16_t addr_zpg_ind_y(void) {
-  uint16_t z = mem_fetch(state.pc);
-  trace_num = z;
-  uint16_t rtn = mem_read(z) | (mem_read(z+1)<<8);
-  return rtn+state.y;
-}
+HEX       DECIMAL       DESCRIPTION
 
-static uint8_t immediate(void) {
-  uint8_t rtn = mem_fetch(state.pc);
-  trace_num = rtn;
-  return rtn;
-}
+9000-900F    36864-36879   Address of VIC chip registers
+9000     36864   bits 0-6 horizontal centering
+                           bit 7 sets interlace scan
+9001     36865   vertical centering
+9002     36866   bits 0-6 set # of columns
+                           bit 7 is part of video matrix address
+9003     36867   bits 1-6 set # of rows
+                           bit 0 sets 8x8 or 16x8 chars
+9004     36868   TV raster beam line
+9005     36869   bits 0-3 start of character memory
+                           (default = 0)
+                           bits 4-7 is rest of video address
+                           (default= F)
+                           BITS 3,2,1,0 CM startinq address
+                                        HEX   DEC
+                           0000   ROM   8000  32768
+                           0001         8400  33792
+                           0010         8800  34816
+                           0011         8C00  35840
+                           1000   RAM   0000  0000
+                           1001 xxxx
+                           1010 xxxx  unavail.
+                           1011 xxxx
+                           1100         1000  4096
+                           1101         1400  5120
+                           1110         1800  6144
+                           1111         1C00  7168
 
-static int8_t relative(void) {
-  uint8_t rtn = mem_fetch(state.pc);
-  trace_num = (int8_t)rtn;
-  return (int8_t)rtn;
-}
+9006     36870    horizontal position of light pen
+9007     36871    vertical position of light pen
+9008     36872    Digitized value of paddle X
+9009     36873    Digitized value of paddle Y
+900A     36874    Frequency for oscillator 1 (low)
+                  (on: 128-255)
+900B     36875    Frequency for oscillator 2 (medium)
+                  (on: 128-255)
+900C     36876    Frequency for oscillator 3 (high)
+                  (on: 128-255)
+900D     36877    Frequency of noise source
+900E     36878    bit 0-3 sets volume of all sound
+                  bits 4-7 are auxiliary color information
+900F     36879    Screen and border color register
+                   bits 4-7 select background color
+                   bits 0-2 select border color
+                   bit 3 selects inverted or normal mode
 
-static uint8_t addr_zpg_x(void) {
-  uint8_t  rtn = mem_fetch(state.pc);
-  trace_num = rtn;
-  rtn += state.x;
-  return rtn & 0xFF;
-}
+#endif
+static void vic_catch_up(void);
+static void vic_remap(void);
 
-static uint8_t addr_zpg_y(void) {
-  uint8_t  rtn = mem_fetch(state.pc);
-  trace_num = rtn;
-  rtn += state.y;
-  return rtn & 0xFF;
+/* The raster line is worked out from the cycle count. Reading it says
+   when the value will next change, so a loop waiting on it is only
+   skipped as far as that, see block_idle. */
+static void io_changes_at(uint64_t cycle) {
+   if(cycle < em->io_until)
+      em->io_until = cycle;
 }
 
-static uint8_t addr_zpg_x_ind(void) {
-  uint8_t  z = mem_fetch(state.pc);
-  trace_num = z;
-  z += state.x;
-  return mem_read(z) | (mem_read((z+1)&0xFF)<<8);
+static uint8_t vic_read(uint16_t addr) {
+   uint64_t frame = em->state.cycle - em->state.cycle % EM6502_FRAME_CYCLES;
+   unsigned line  = em->state.cycle % EM6502_FRAME_CYCLES / VIC_LINE_CYCLES;
+   assert(addr < 0x10);
+   switch(addr) {
+      case 3:
+         io_changes_at(frame + (line+1)*VIC_LINE_CYCLES);
+         return (em->vic[3]&0x7F) | (line&1)<<7;
+      case 4:
+         io_changes_at(frame + ((line|1)+1)*VIC_LINE_CYCLES);
+         return line>>1;
+      default:
+         return em->vic[addr];
+   }
 }
-
-/******************************************************************************/
-static void op00(void) {  // BRK     
-   trace("BRK");
-   mem_write(0x100+state.sp,   state.pc>>8);
-   mem_write(0x100+state.sp-1, state.pc&0xFF);
-   mem_write(0x100+state.sp-2, state.flags);    // TODO: SET THE BREAK BITS appropriately
-   state.sp    -= 3; 
-   state.pc     = mem_read(0xFFFC);
-   state.pc    |= mem_read(0xFFFD)<<8;   
-   state.flags |= FLAG_I;
-   trace("BRK");
+static void vic_write(uint16_t addr, uint8_t data) {
+   assert(addr < 0x10);
+   if(em->vic[addr] == data)
+      return;
+   if(VIC_SHOWN & (1<<addr)) {
+      vic_catch_up();
+      em->vic_all_gen = ++em->vic_gen;
+   }
+   em->vic[addr] = data;
+   if(addr == 2 || addr == 3 || addr == 5)
+      vic_remap();
+}
+
+/*****************************************************************
+* Events
+*
+* Anything that happens at a given cycle rather than when the CPU
+* touches it - a VIA timer running out, the end of a frame - is an
+* event, kept in a min-heap on its cycle. em6502_run() only runs the
+* CPU as far as the first of them, so the interpreter has nothing to
+* check but cpu_deadline, and event_run() handles them between
+* batches. Each kind is pending at most once, and setting one that is
+* already pending moves it.
+*****************************************************************/
+static void cpu_break(void);
+
+static void event_place(int i, struct event e) {
+   em->events[i] = e;
+   em->event_slot[e.kind] = i+1;
+}
+
+/* Moves the event at 'i' up or down the heap to where it belongs */
+static void event_fix(int i) {
+   struct event e = em->events[i];
+   while(i > 0 && em->events[(i-1)/2].cycle > e.cycle) {
+      event_place(i, em->events[(i-1)/2]);
+      i = (i-1)/2;
+   }
+   for(;;) {
+      int child = 2*i+1;
+      if(child >= em->event_count)
+         break;
+      if(child+1 < em->event_count && em->events[child+1].cycle < em->events[child].cycle)
+         child++;
+      if(em->events[child].cycle >= e.cycle)
+         break;
+      event_place(i, em->events[child]);
+      i = child;
+   }
+   event_place(i, e);
 }
 
-static void op01(void) {  // ORA (zpg, X)
-  state.a  |= mem_read(addr_zpg_x_ind());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6;
-  trace("ORA (zeropage %02X, X)");
+static void event_set(int kind, uint64_t cycle) {
+   int i = em->event_slot[kind] - 1;
+   if(i < 0)
+      i = em->event_count++;
+   em->events[i].kind  = kind;
+   em->events[i].cycle = cycle;
+   event_fix(i);
+   /* The batch being run has to end in time for it */
+   if(cycle < em->cpu_deadline)
+      em->cpu_deadline = cycle;
 }
 
-static void op05(void) {  // ORA zpg
-  state.a |= mem_read(addr_zpg());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 3;
-  trace("ORA zeropage %02X");
+static void event_cancel(int kind) {
+   int i = em->event_slot[kind] - 1;
+   if(i < 0)
+      return;
+   em->event_slot[kind] = 0;
+   if(i == --em->event_count)
+      return;
+   em->events[i] = em->events[em->event_count];
+   event_fix(i);
+}
+
+static uint64_t event_next(void) {
+   return em->event_count ? em->events[0].cycle : UINT64_MAX;
+}
+
+/*****************************************************************
+* The VIAs
+*
+* Two 6522s: VIA1 at $9110, whose interrupt is the NMI, and VIA2 at
+* $9120, whose interrupt is the IRQ and whose T1 is the KERNAL's
+* jiffy clock. A timer isn't counted down cycle by cycle but kept as
+* the value it had at a given cycle, so reading one works out its
+* value, and its running out is an event. Loaded with N, a timer runs
+* out N+1 cycles later, as it goes from 0 to $FFFF, and T1 in free
+* running mode is loaded from its latch the cycle after that. Nothing
+* is wired to the ports, so their inputs read as ones, and the
+* handshakes, the shift register and T2 counting pulses on PB6 never
+* do anything.
+*****************************************************************/
+#define VIA_T2        0x20       // in IFR and IER
+#define VIA_T1        0x40
+#define VIA_PULSES    0x20       // in ACR
+#define VIA_FREE_RUN  0x40
+
+static uint16_t via_counter(uint64_t base, uint16_t start) {
+   uint64_t now = em->state.cycle;
+   return now < base ? start : (uint16_t)(start - (now - base));
+}
+
+static uint16_t via_t1(struct via *v) {
+   return via_counter(v->t1_base, v->t1_start);
+}
+
+static uint16_t via_t2(struct via *v) {
+   return v->acr & VIA_PULSES ? v->t2_start : via_counter(v->t2_base, v->t2_start);
+}
+
+/* The next cycle at which a counter goes from 0 to $FFFF */
+static uint64_t via_runs_out(uint64_t base, uint16_t start) {
+   uint64_t now = em->state.cycle;
+   return now < base ? base + start + 1 : now + via_counter(base, start) + 1;
+}
+
+/* Drives the interrupt lines from the flags. The CPU takes an
+   interrupt between batches, so a line going active ends the batch. */
+static void via_irq(struct via *v) {
+   int line = (v->ifr & v->ier) != 0;
+   if(v == &em->via[1]) {
+      if(line && !em->irq)
+         cpu_break();
+      em->irq = line;
+   } else {
+      if(line && !em->nmi) {
+         em->nmi_pending = 1;
+         cpu_break();
+      }
+      em->nmi = line;
+   }
 }
 
-static void op06(void) {  // ASL zpg
-  uint16_t a = addr_zpg();
-  uint16_t t = mem_read(a);
-  if(t&0x80) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  t = t<<1;
-  if((t & 0xFF) == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-
-  state.cycle += 5; 
-  trace("ASL zeropage %02X");
-  mem_write(a,t);
+/* Sets the events for when the timers next run out */
+static void via_schedule(struct via *v) {
+   int kind = v == &em->via[0] ? EV_VIA1_T1 : EV_VIA2_T1;
+   if(v->t1_armed || v->acr & VIA_FREE_RUN)
+      event_set(kind, via_runs_out(v->t1_base, v->t1_start));
+   else
+      event_cancel(kind);
+   if(v->t2_armed && !(v->acr & VIA_PULSES))
+      event_set(kind+1, via_runs_out(v->t2_base, v->t2_start));
+   else
+      event_cancel(kind+1);
+}
+
+static void via_t1_out(struct via *v, int kind, uint64_t at) {
+   if(v->acr & VIA_FREE_RUN) {
+      v->ifr     |= VIA_T1;
+      v->t1_base  = at + 1;
+      v->t1_start = v->t1_latch;
+      v->t1_armed = 1;
+      event_set(kind, at + 2 + v->t1_latch);
+   } else if(v->t1_armed) {
+      v->ifr     |= VIA_T1;
+      v->t1_armed = 0;
+   }
+   via_irq(v);
+}
+
+static void via_t2_out(struct via *v) {
+   v->ifr     |= VIA_T2;
+   v->t2_armed = 0;
+   via_irq(v);
+}
+
+static void via_reset(struct via *v) {
+   memset(v, 0, sizeof(*v));
+   v->t1_base = v->t2_base = em->state.cycle;
+}
+
+/* Reading a counter marks the I/O as changing every cycle, so a loop
+   reading one is never skipped as idle */
+static uint8_t via_read(struct via *v, uint16_t reg) {
+   switch(reg) {
+      case 0x0: return v->orb | ~v->ddrb;
+      case 0x1:
+      case 0xF: return v->ora | ~v->ddra;
+      case 0x2: return v->ddrb;
+      case 0x3: return v->ddra;
+      case 0x4:
+         v->ifr &= ~VIA_T1;
+         via_irq(v);
+         io_changes_at(em->state.cycle + 1);
+         return via_t1(v);
+      case 0x5:
+         io_changes_at(em->state.cycle + 1);
+         return via_t1(v) >> 8;
+      case 0x6: return v->t1_latch;
+      case 0x7: return v->t1_latch >> 8;
+      case 0x8:
+         v->ifr &= ~VIA_T2;
+         via_irq(v);
+         io_changes_at(em->state.cycle + 1);
+         return via_t2(v);
+      case 0x9:
+         io_changes_at(em->state.cycle + 1);
+         return via_t2(v) >> 8;
+      case 0xA: return v->sr;
+      case 0xB: return v->acr;
+      case 0xC: return v->pcr;
+      case 0xD: return v->ifr | (v->ifr & v->ier ? 0x80 : 0);
+      default:  return v->ier | 0x80;
+   }
 }
 
-static void op08(void) {  // PHP
-  mem_write(0x100+state.sp,   state.flags);
-  state.sp    -= 1; 
-  state.cycle += 3; 
-  trace("PHP");
+static void via_write(struct via *v, uint16_t reg, uint8_t data) {
+   uint16_t t2;
+   switch(reg) {
+      case 0x0: v->orb  = data; return;
+      case 0x1:
+      case 0xF: v->ora  = data; return;
+      case 0x2: v->ddrb = data; return;
+      case 0x3: v->ddra = data; return;
+      case 0x4:
+      case 0x6: v->t1_latch = (v->t1_latch & 0xFF00) | data; return;
+      case 0x5:
+         v->t1_latch = (v->t1_latch & 0x00FF) | data << 8;
+         v->t1_start = v->t1_latch;
+         v->t1_base  = em->state.cycle + 1;
+         v->t1_armed = 1;
+         v->ifr     &= ~VIA_T1;
+         break;
+      case 0x7:
+         v->t1_latch = (v->t1_latch & 0x00FF) | data << 8;
+         v->ifr     &= ~VIA_T1;
+         break;
+      case 0x8: v->t2_latch = data; return;
+      case 0x9:
+         v->t2_start = v->t2_latch | data << 8;
+         v->t2_base  = em->state.cycle + 1;
+         v->t2_armed = 1;
+         v->ifr     &= ~VIA_T2;
+         break;
+      case 0xA: v->sr  = data; return;
+      case 0xB:
+         /* T2 stops or starts counting from where it is */
+         t2 = via_t2(v);
+         v->acr      = data;
+         v->t2_start = t2;
+         v->t2_base  = em->state.cycle;
+         break;
+      case 0xC: v->pcr = data; return;
+      case 0xD: v->ifr &= ~data; break;
+      default:
+         if(data & 0x80)
+            v->ier |= data & 0x7F;
+         else
+            v->ier &= ~data;
+         break;
+   }
+   via_schedule(v);
+   via_irq(v);
 }
 
-static void op09(void) {  // ORA #
-  state.a |= immediate();
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2;
-  trace("ORA #%02X");
+static uint8_t via1_read(uint16_t addr) {
+   assert(addr < 0x10);
+   return via_read(&em->via[0], addr);
 }
-
-static void op0A(void) {  // ASL A
-  uint16_t t = state.a;
-  if(t&0x80) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  state.a <<=  1;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-
-  state.cycle += 2; 
-  trace("ASL A");
+static void via1_write(uint16_t addr, uint8_t data) {
+   assert(addr < 0x10);
+   via_write(&em->via[0], addr, data);
 }
-
-static void op0D(void) {  // ORA abs
-  state.a      |= mem_read(addr_absolute());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("LDA #%04X");
+static uint8_t via2_read(uint16_t addr) {
+   assert(addr >= 0x10 && addr < 0x20);
+   return via_read(&em->via[1], addr & 0x0F);
 }
-
-static void op10(void) {  // BPL rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_N) {
-    state.cycle += 2; 
-  } else {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
-  }
-  trace("BPL %02i");
+static void via2_write(uint16_t addr, uint8_t data) {
+   assert(addr >= 0x10 && addr < 0x20);
+   via_write(&em->via[1], addr & 0x0F, data);
+}
+
+/* Handles the events that are due. Each is handled as of the cycle it
+   was due, however far past it the last instruction of the batch went. */
+static void event_run(void) {
+   while(em->event_count && em->events[0].cycle <= em->state.cycle) {
+      struct event e = em->events[0];
+      event_cancel(e.kind);
+      switch(e.kind) {
+         case EV_VIA1_T1:
+         case EV_VIA2_T1:
+            via_t1_out(&em->via[e.kind/2], e.kind, e.cycle);
+            break;
+         case EV_VIA1_T2:
+         case EV_VIA2_T2:
+            via_t2_out(&em->via[e.kind/2]);
+            break;
+         case EV_FRAME:
+            vic_catch_up();
+            event_set(EV_FRAME, e.cycle + EM6502_FRAME_CYCLES);
+            em->frame_fn(em->frame_ctx);
+            break;
+      }
+   }
 }
 
-static void op11(void) {  // ORA (zpg), Y
-  state.a  |= mem_read(addr_zpg_ind_y());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6;
-  trace("ORA (zeropage %02X), Y");
+/* Sets up the events afresh from the machine, after a reset or restore */
+static void event_reset(void) {
+   em->event_count = 0;
+   memset(em->event_slot, 0, sizeof(em->event_slot));
+   via_schedule(&em->via[0]);
+   via_schedule(&em->via[1]);
+   if(em->frame_fn)
+      event_set(EV_FRAME, (em->state.cycle / EM6502_FRAME_CYCLES + 1) * EM6502_FRAME_CYCLES);
+   em->irq      = (em->via[1].ifr & em->via[1].ier) != 0;
+   em->nmi      = (em->via[0].ifr & em->via[0].ier) != 0;
+   em->io_until = UINT64_MAX;
 }
 
-static void op15(void) {  // ORA zpg, X
-  state.a |= mem_read(addr_zpg_x());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;
-  trace("ORA zeropage %02X, X");
+/*****************************************************************
+* Memory map
+*
+* The 64K address space is split into 256 pages of 256 bytes. RAM
+* and ROM pages have a direct pointer, so an access is one indexed
+* load. Pages without a direct pointer go through a handler, which
+* is where the I/O chips and unmapped addresses live.
+*****************************************************************/
+static uint8_t unmapped_read(uint16_t addr) {
+  return 0;
 }
 
-static void op16(void) {  // ASL zpg, X   /// FIXED
-  uint16_t a = addr_zpg_x();
-  uint16_t t = mem_read(a);
-  if(t&0x80) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  t = t<<1;
-  if((t & 0xFF) == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-
-  state.cycle += 5; 
-  trace("ASL zeropage %02X, X");
-  mem_write(a,t);
+static void unmapped_write(uint16_t addr, uint8_t data) {
+  logger_16_8("Write to unmapped address", addr, data);
 }
 
-static void op18(void) {  // CLC
-  state.flags &= ~FLAG_C;
-  state.cycle += 2; 
-  trace("CLC");
+static uint8_t io90_read(uint16_t addr) {
+  if(addr < 0x9010)
+    return vic_read(addr-0x9000);
+  return 0;
 }
 
-static void op20(void) {  // JSR
-  uint16_t a = addr_absolute();
-  mem_write(0x100+state.sp,   (state.pc-1)>>8);
-  mem_write(0x100+state.sp-1, (state.pc-1)&0xFF);
-  state.sp    -= 2; 
-  state.pc     = a;
-  state.cycle += 6; 
-  trace("JSR #%04X");
+static void io90_write(uint16_t addr, uint8_t data) {
+  if(addr < 0x9010)
+    vic_write(addr-0x9000, data);
+  else
+    unmapped_write(addr, data);
 }
 
-static void op21(void) {  // AND (zpg, X)
-  state.a  &= mem_read(addr_zpg_x_ind());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6;
-  trace("AND (zeropage %02X, X)");
+static uint8_t io91_read(uint16_t addr) {
+  if(addr >= 0x9110 && addr < 0x9120)
+    return via1_read(addr-0x9110);
+  if(addr >= 0x9120 && addr < 0x9130)
+    return via2_read(addr-0x9110);
+  return 0;
 }
 
-static void op24(void) {  // BIT zeropage
-  uint8_t t = mem_read(addr_zpg());
-  if((t & state.a) == 0) state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80)            state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(t &0x40)            state.flags |= FLAG_V;  else state.flags &= ~FLAG_V;
-  state.cycle += 3; 
-  trace("BIT zeropage %02X");
+static void io91_write(uint16_t addr, uint8_t data) {
+  if(addr >= 0x9110 && addr < 0x9120)
+    via1_write(addr-0x9110, data);
+  else if(addr >= 0x9120 && addr < 0x9130)
+    via2_write(addr-0x9110, data);
+  else
+    unmapped_write(addr, data);
 }
 
-static void op25(void) {  // AND zpg
-  state.a &= mem_read(addr_zpg());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;
-  trace("AND zeropage %02X");
+static void mem_map(uint16_t base, size_t len, const uint8_t *rd, uint8_t *wr) {
+  size_t i;
+  for(i = 0; i < len; i += 256) {
+    em->page_read[(base+i)>>8]  = rd ? rd+i : NULL;
+    em->page_write[(base+i)>>8] = wr ? wr+i : NULL;
+  }
 }
 
-static void op26(void) {  // ROL zpg
-  uint16_t a = addr_zpg();
-  uint16_t t = mem_read(a);
+static void mem_map_io(uint8_t page, page_read_fn rd, page_write_fn wr) {
+  em->page_read[page]     = NULL;
+  em->page_write[page]    = NULL;
+  em->page_io_read[page]  = rd;
+  em->page_io_write[page] = wr;
+}
 
-  t = (t<<1);
-  if(state.flags & FLAG_C) 
-    t |= 0x1;
-  if(t&0x100) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  if((t&0xFF) == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
+static void mem_map_init(void) {
+  int i;
+  for(i = 0; i < 256; i++)
+    mem_map_io(i, unmapped_read, unmapped_write);
 
-  state.cycle += 5; 
-  mem_write(a,t);
-  trace("ROL zeropage %02X");
+  mem_map(0x0000, sizeof(em->ram),    em->ram,    em->ram);
+  mem_map(0x8000, ROM_8000_SIZE,      em->rom3,   NULL);
+  mem_map_io(0x90, io90_read, io90_write);
+  mem_map_io(0x91, io91_read, io91_write);
+  mem_map(0x9400, sizeof(em->colour), em->colour, em->colour);
+  mem_map(0xC000, ROM_C000_SIZE,      em->rom1,   NULL);
+  mem_map(0xE000, ROM_E000_SIZE,      em->rom2,   NULL);
 }
 
-static void op28(void) {  // PLP
-  state.sp    += 1; 
-  state.flags = mem_read(0x100+state.sp);
-  state.cycle += 3;   // TODO: Fix up debug flags
-  trace("PLP");
+static uint8_t mem_read_nolog(uint16_t addr) {
+  const uint8_t *p = em->page_read[addr>>8];
+  if(p)
+    return p[addr&0xFF];
+  return em->page_io_read[addr>>8](addr);
 }
 
+static uint8_t mem_read(uint16_t addr) {
+  uint8_t rtn = 0;
+  rtn = mem_read_nolog(addr);
+  if(em->trace_level & TRACE_RD)
+    logger_16_8("  Read ",addr, rtn);
+  if(em->tracefile)
+    tracefile_access(TRACE_RD, addr, rtn);
+  return rtn;
+}
 
-static void op29(void) {  // AND #
-  state.a &= immediate();
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;
-  trace("AND #%02X");
+static uint8_t mem_fetch(uint16_t addr) {
+  uint8_t rtn = 0;
+  rtn = mem_read_nolog(addr);
+  em->state.pc++;
+  em->trace_fetch_len++;
+  if(em->trace_level & TRACE_FETCH)
+    logger_16_8("  Fetch",addr, rtn);
+  return rtn;
 }
 
-static void op2A(void) {  // ROL A
-  uint16_t t = state.a;
-  t = (t<<1);
-  if(state.flags & FLAG_C) 
-    t |= 0x1;
-  if(t&0x100) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("ROL A");
-}
-
-static void op2C(void) {  // BIT abs
-  uint8_t t = mem_read(addr_absolute());
-  if((t & state.a) == 0) state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80)            state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(t &0x40)            state.flags |= FLAG_V;  else state.flags &= ~FLAG_V;
-  state.cycle += 3; 
-  trace("BIT zeropage %02X");
-}
-
-static void op30(void) {  // BMI rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_N) {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
-  } else {
-    state.cycle += 2; 
+static void mem_write_nolog(uint16_t addr, uint8_t data) {
+  uint8_t *p = em->page_write[addr>>8];
+  if(p) {
+    p[addr&0xFF] = data;
+    return;
   }
-  trace("BMI %02i");
+  em->page_io_write[addr>>8](addr, data);
 }
 
-static void op31(void) {  // AND (zpg), Y
-  state.a  &= mem_read(addr_zpg_ind_y());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6;
-  trace("AND (zeropage %02X), Y");
+static void mem_write(uint16_t addr, uint8_t data) {
+  if(em->trace_level & TRACE_WR)
+    logger_16_8("  Write", addr, data);
+  if(em->tracefile)
+    tracefile_access(TRACE_WR, addr, data);
+  mem_write_nolog(addr, data);
 }
 
-static void op35(void) {  // AND zpg, X
-  state.a &= mem_read(addr_zpg_x());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;
-  trace("AND zeropage %02X, X");
-}
+static void trace(char *msg) {
+  int i;
+  uint8_t inst, flags;
+  if(!(em->trace_level & TRACE_OP))
+     return;
 
-static void op36(void) {  // ROL zpg, X
-  uint16_t a = addr_zpg_x();
-  uint16_t t = mem_read(a);
+  inst = mem_read_nolog(em->trace_addr);
+  printf("%10llu %04X: %02X ", (unsigned long long)em->state.cycle, em->trace_addr, inst);
 
-  t = t<<1;
-  if(state.flags & FLAG_C) 
-    t |= 0x1;
-  if(t&0x100) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
+  for(i = 1; i < em->trace_fetch_len; i++) {
+    printf("%02X ", mem_read_nolog(em->trace_addr+i));
   }
-  if((t&0xFF) == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
 
-  state.cycle += 5; 
-  trace("ROL zeropage %02X, X");
-  mem_write(a,t);
-}
+  while(i < 4) {
+    printf("   ");
+    i++;
+  }
+#if 1
+  printf("%02X %02X %02X ",em->state.a, em->state.x, em->state.y);
+  flags = cpu_flags();
+  if(flags & FLAG_N) 
+    printf("N");
+  else
+    printf(" ");
 
-static void op38(void) {  // SEC
-  state.flags |= FLAG_C;
-  state.cycle += 2; 
-  trace("SEC");
-}
+  if(flags & FLAG_Z) 
+    printf("Z");
+  else
+    printf(" ");
 
-static void op40(void) {  // RTI
-  uint16_t o;
-  state.flags = mem_read(0x100+state.sp+1);
-  o = mem_read(0x100+state.sp+2) | (mem_read(0x100+state.sp+3)<<8);
-  state.sp    += 3; 
-  state.pc     = o;
-  state.cycle += 6; 
-  trace("RTI");
-}
+  if(flags & FLAG_C) 
+    printf("C ");
+  else
+    printf("  ");
+#endif
 
-static void op41(void) {  // EOR (zpg, X)
-  state.a  ^= mem_read(addr_zpg_x_ind());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6;
-  trace("EOR (zeropage %02X, X)");
+  printf(msg, em->trace_num);
+  printf("\n");
 }
 
-static void op45(void) {  // EOR zpg
-  state.a ^= mem_read(addr_zpg());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;
-  trace("EOR zeropage %02X");
-} 
-
-static void op46(void) {  // LSR zpg
-  uint16_t a = addr_zpg();
-  uint16_t t = mem_read(a);
+static const uint8_t colours[16][3] = {
+   {  0,  0,  0},   //BLACK            000
+   {255,255,255},   //WHITE            001
+   {255,  0,  0},   //RED              010
+   {  0,255,255},   //CYAN             011
+   {255,  0,255},   //PURPLE           100
+   {  0,255,  0},   //GREEN            101
+   {  0,  0,255},   //BLUE             110
+   {255,255,  0},   //YELLOW           111
+   {255,128,  0},   //    8 - 1000   Orange
+   {255,192, 64},   //    9 - 1001   Light orange
+   {255,128,128},   //    10 - 1010   Pink
+   {128,255,255},   //    11 - 1011   Light cyan
+   {255,128,255},   //    12 - 1100   Light purple
+   {128,255,128},   //    13 - 1101   Light green
+   {128,128,255},   //    14 - 1110   Light blue
+   {255,255,128},   //    15 - 1111   Light yellow
+};
 
-  if(t&0x1) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  t = t>>1;
-  if(t == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
+/*****************************************************************
+* The VIC's picture
+*
+* The VIC draws 312 lines of 71 cycles, 4 pixels a cycle, and the
+* framebuffer is the 200x260 of them a TV shows. Drawing catches up
+* a line at a time, and only when something the picture depends on
+* is about to change - a VIC register, or a byte of screen, colour
+* or character memory - or when a frame is asked for. Everything
+* before the raster was drawn with what was there before the change,
+* so mid-frame effects come out as they would on the real thing.
+*
+* The pages of memory the VIC is showing are hooked with
+* vic_mem_write(), which only catches up if the byte changes. Lines
+* are only drawn again if something has changed since they were last
+* drawn: each change bumps vic_gen, and marks the character row it is
+* in, or every line for a change to the registers or the characters.
+* The finished frame is copied to vic_done if any line of it changed.
+*****************************************************************/
+
+/* Where the VIC's 14-bit addresses are in the CPU's memory map */
+static uint16_t vic_to_cpu(uint16_t addr) {
+   addr &= 0x3FFF;
+   return addr & 0x2000 ? addr & 0x1FFF : addr | 0x8000;
+}
+
+/* What the VIC sees, which never has side effects */
+static uint8_t vic_fetch(uint16_t addr) {
+   addr = vic_to_cpu(addr);
+   if(addr < 0x2000)
+      return em->ram[addr];
+   if(addr < 0x8000 + ROM_8000_SIZE)
+      return em->rom3 ? em->rom3[addr & (ROM_8000_SIZE-1)] : 0xFF;
+   if(addr >= 0x9400 && addr < 0x9800)
+      return em->colour[addr & 0x3FF];
+   return 0xFF;
+}
+
+/* The layout set by the registers */
+struct vic_layout {
+   int      top;                   // the first line of characters
+   int      left;                  // and their first pixel
+   int      rows;
+   int      cols;
+   int      height;                // of a character, 8 or 16
+   uint16_t screen;                // VIC address of the video matrix
+   uint16_t colour;                // offset of its colours in colour RAM
+   uint16_t chars;                 // VIC address of the characters
+};
 
-  state.cycle += 5; 
-  trace("LSR zeropage %02X");
-  mem_write(a,t);
+static void vic_layout(struct vic_layout *l) {
+   l->top    = em->vic[1]*2;
+   l->left   = (em->vic[0]&0x7F)*4;
+   l->rows   = (em->vic[3]>>1)&0x3F;
+   l->cols   = em->vic[2]&0x7F;
+   l->height = em->vic[3]&1 ? 16 : 8;
+   l->screen = (em->vic[5]&0xF0)<<6 | (em->vic[2]&0x80)<<2;
+   l->colour = (em->vic[2]&0x80)<<2;
+   l->chars  = (em->vic[5]&0x0F)<<10;
+}
+
+/* Expands a byte of a glyph into 8 RGB pixels at once. With SSE2,
+   the byte is spread over the 24 bytes of the pixels, and bytes
+   whose pixel's bit is set take the foreground colour. */
+#if EM6502_SIMD
+static void vic_glyph_row(uint8_t *p, uint8_t byte, const uint8_t *fg, const uint8_t *bg) {
+   const __m128i bits0 = _mm_setr_epi8((char)0x80,(char)0x80,(char)0x80, 0x40,0x40,0x40,
+                                       0x20,0x20,0x20, 0x10,0x10,0x10, 0x08,0x08,0x08, 0x04);
+   const __m128i bits1 = _mm_setr_epi8(0x04,0x04, 0x02,0x02,0x02, 0x01,0x01,0x01,
+                                       0,0,0,0,0,0,0,0);
+   const __m128i fg0 = _mm_setr_epi8(fg[0],fg[1],fg[2], fg[0],fg[1],fg[2], fg[0],fg[1],fg[2],
+                                     fg[0],fg[1],fg[2], fg[0],fg[1],fg[2], fg[0]);
+   const __m128i fg1 = _mm_setr_epi8(fg[1],fg[2], fg[0],fg[1],fg[2], fg[0],fg[1],fg[2],
+                                     0,0,0,0,0,0,0,0);
+   const __m128i bg0 = _mm_setr_epi8(bg[0],bg[1],bg[2], bg[0],bg[1],bg[2], bg[0],bg[1],bg[2],
+                                     bg[0],bg[1],bg[2], bg[0],bg[1],bg[2], bg[0]);
+   const __m128i bg1 = _mm_setr_epi8(bg[1],bg[2], bg[0],bg[1],bg[2], bg[0],bg[1],bg[2],
+                                     0,0,0,0,0,0,0,0);
+   __m128i spread = _mm_set1_epi8(byte);
+   __m128i m0 = _mm_cmpeq_epi8(_mm_and_si128(spread, bits0), bits0);
+   __m128i m1 = _mm_cmpeq_epi8(_mm_and_si128(spread, bits1), bits1);
+   _mm_storeu_si128((__m128i *)p,
+                    _mm_or_si128(_mm_and_si128(m0, fg0), _mm_andnot_si128(m0, bg0)));
+   _mm_storel_epi64((__m128i *)(p+16),
+                    _mm_or_si128(_mm_and_si128(m1, fg1), _mm_andnot_si128(m1, bg1)));
+}
+#else
+static void vic_glyph_row(uint8_t *p, uint8_t byte, const uint8_t *fg, const uint8_t *bg) {
+   int col;
+   for(col = 0; col < 8; col++) {
+      const uint8_t *c = (byte & (0x80>>col)) ? fg : bg;
+      p[col*3+0] = c[0];
+      p[col*3+1] = c[1];
+      p[col*3+2] = c[2];
+   }
 }
+#endif
 
-static void op48(void) {  // PHA
-  mem_write(0x100+state.sp,   state.a);
-  state.sp    -= 1; 
-  state.cycle += 3; 
-  trace("PHA");
+/* Multicolour characters have 4 double width pixels, of background,
+   border, foreground and auxiliary colours */
+static void vic_multi_row(uint8_t *p, uint8_t byte, const uint8_t *const c[4]) {
+   int col;
+   for(col = 0; col < 4; col++, p += 6) {
+      const uint8_t *pair = c[(byte >> (6-col*2)) & 3];
+      memcpy(p, pair, 3);
+      memcpy(p+3, pair, 3);
+   }
 }
 
-static void op49(void) {  // EOR #
-  state.a ^= immediate();
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;
-  trace("EOR #%02X");
+static void vic_draw_line(const struct vic_layout *l, int line) {
+   uint8_t pixels[VIC_LINE_PIXELS+8][3];
+   const uint8_t *bd = colours[em->vic[15]&0x7];
+   int x, col, row, glyph_line;
+
+   for(x = 0; x < VIC_LINE_PIXELS; x++)
+      memcpy(pixels[x], bd, 3);
+   if(line >= l->top && line < l->top + l->rows*l->height) {
+      const uint8_t *bg = colours[em->vic[15]>>4];
+      const uint8_t *multi[4] = { bg, bd, NULL, colours[em->vic[14]>>4] };
+      int reverse = !(em->vic[15] & 0x08);
+
+      row        = (line - l->top) / l->height;
+      glyph_line = (line - l->top) % l->height;
+      for(col = 0, x = l->left; col < l->cols && x < VIC_LINE_PIXELS; col++, x += 8) {
+         uint16_t cell   = row*l->cols + col;
+         uint8_t  glyph  = vic_fetch(l->screen + cell);
+         uint8_t  colour = em->colour[(l->colour + cell) & 0x3FF];
+         uint8_t  byte   = vic_fetch(l->chars + glyph*l->height + glyph_line);
+         const uint8_t *fg = colours[colour & 0x7];
+         if(colour & 0x08) {
+            multi[2] = fg;
+            vic_multi_row(pixels[x], byte, multi);
+         } else if(reverse) {
+            vic_glyph_row(pixels[x], byte, bg, fg);
+         } else {
+            vic_glyph_row(pixels[x], byte, fg, bg);
+         }
+      }
+   }
+   memcpy(em->vic_live->rgb[line - VIC_FIRST_LINE], pixels[VIC_FIRST_X],
+          sizeof(em->vic_live->rgb[0]));
 }
 
-static void op4A(void) {  // LSR A
-  uint16_t t = state.a;
-  if(t&0x1) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  t = t>>1;
-  if(t == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.a = t;
+/* Draws the lines from 'first' up to 'last' that have changed */
+static void vic_draw(int first, int last) {
+   struct vic_layout l;
+   int line;
 
-  state.cycle += 2; 
-  trace("LSR A");
+   if(first < VIC_FIRST_LINE)
+      first = VIC_FIRST_LINE;
+   if(last > VIC_FIRST_LINE + EM6502_DISPLAY_HEIGHT)
+      last = VIC_FIRST_LINE + EM6502_DISPLAY_HEIGHT;
+   if(first >= last)
+      return;
+   vic_layout(&l);
+   for(line = first; line < last; line++) {
+      uint64_t changed = em->vic_all_gen;
+      if(line >= l.top && line < l.top + l.rows*l.height &&
+         em->vic_row_gen[(line - l.top) / l.height] > changed)
+         changed = em->vic_row_gen[(line - l.top) / l.height];
+      if(em->vic_line_gen[line] >= changed)
+         continue;
+      vic_draw_line(&l, line);
+      em->vic_line_gen[line] = em->vic_gen;
+      em->vic_drawn = 1;
+   }
 }
 
-static void op4C(void) {  // JMP
-  uint16_t o = addr_absolute();
-  state.pc     = o;
-  state.cycle += 3; 
-  trace("JMP #%04X");
+/* Lines drawn again can come out the same, as they do every frame
+   with a raster split, so the frame is compared before it counts as
+   changed */
+static void vic_frame_done(void) {
+   if(!em->vic_drawn)
+      return;
+   em->vic_drawn = 0;
+   if(memcmp(em->vic_done, em->vic_live, sizeof(*em->vic_done)) == 0)
+      return;
+   memcpy(em->vic_done, em->vic_live, sizeof(*em->vic_done));
+   em->vic_serial++;
+}
+
+/* Draws everything the raster has passed since the last time */
+static void vic_catch_up(void) {
+   uint64_t frame = em->state.cycle / EM6502_FRAME_CYCLES;
+   int      line  = em->state.cycle % EM6502_FRAME_CYCLES / VIC_LINE_CYCLES;
+
+   if(frame > em->vic_frame) {
+      vic_draw(em->vic_line, VIC_LINES);
+      vic_frame_done();
+      /* Any frames in between are all the same */
+      if(frame > em->vic_frame + 1) {
+         vic_draw(0, VIC_LINES);
+         vic_frame_done();
+      }
+      em->vic_frame = frame;
+      em->vic_line  = 0;
+   }
+   vic_draw(em->vic_line, line);
+   em->vic_line = line;
+}
+
+/* Marks what a change to the byte at 'addr' shows up in */
+static void vic_changed(uint16_t addr) {
+   struct vic_layout l;
+   uint16_t vic_addr = addr < 0x2000 ? addr | 0x2000 : addr - 0x8000;
+   unsigned size, offset;
+
+   vic_layout(&l);
+   size = l.rows*l.cols;
+   em->vic_gen++;
+   if(addr >= 0x9400 && addr < 0x9800)
+      offset = (addr - 0x9400 - l.colour) & 0x3FF;
+   else
+      offset = (vic_addr - l.screen) & 0x3FFF;
+   if(offset < size)
+      em->vic_row_gen[offset / l.cols] = em->vic_gen;
+   if(((vic_addr - l.chars) & 0x3FFF) < 256u*l.height && addr < 0x9400)
+      em->vic_all_gen = em->vic_gen;
+}
+
+static void vic_mem_write(uint16_t addr, uint8_t data) {
+   uint8_t *p = &em->vic_saved_write[addr>>8][addr&0xFF];
+   if(*p == data)
+      return;
+   vic_catch_up();
+   *p = data;
+   vic_changed(addr);
+}
+
+/* Finds the pages of memory the VIC shows, returning 1 if they have changed */
+static int vic_pages(void) {
+   uint8_t pages[256];
+   struct vic_layout l;
+   unsigned size, i;
+
+   vic_layout(&l);
+   size = l.rows*l.cols;
+   memset(pages, 0, sizeof(pages));
+   for(i = 0; size && i < size + 0xFF; i += 0x100) {
+      unsigned offset = i < size ? i : size-1;
+      pages[vic_to_cpu(l.screen + offset)>>8] = 1;
+      pages[(0x9400 + ((l.colour + offset) & 0x3FF))>>8] = 1;
+   }
+   for(i = 0; i < 256u*l.height; i += 0x100)
+      pages[vic_to_cpu(l.chars + i)>>8] = 1;
+   if(memcmp(pages, em->vic_page, sizeof(pages)) == 0)
+      return 0;
+   memcpy(em->vic_page, pages, sizeof(pages));
+   return 1;
 }
 
-static void op50(void) {  // BVC rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_V) {
-    state.cycle += 2; 
-  } else {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
-  }
-  trace("BVC %02i");
-}
-
-static void op51(void) {  // EOR (zpg), Y
-  state.a  ^= mem_read(addr_zpg_ind_y());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6;
-  trace("EOR (zeropage %02X), Y");
-}
-
-static void op55(void) {  // EOR zpg, X
-  state.a ^= mem_read(addr_zpg_x());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;
-  trace("EOR zeropage %02X, X");
-} 
-
-static void op56(void) {  // LSR zpg, X
-  uint16_t a = addr_zpg_x();
-  uint16_t t = mem_read(a);
-  if(t&0x1) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  t = (t>>1);
-  if(t == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-
-  state.cycle += 5; 
-  mem_write(a,t);
-  trace("LSR zeropage %02X, X");
-}
-
-static void op58(void) {  // CLI
-  state.flags &= ~FLAG_I;
-  state.cycle += 2; 
-  trace("CLI");
-}
-
-static void op60(void) {  // RTS
-  uint16_t o = mem_read(0x100+state.sp+1) | (mem_read(0x100+state.sp+2)<<8);
-  state.sp    += 2; 
-  state.pc     = o+1;
-  state.cycle += 6; 
-  trace("RTS");
-}
-
-static void op61(void) {  // ADC (ind, X)
-  uint16_t t = state.a;
-  t += mem_read(addr_zpg_x_ind());
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  // TODO - OVERFLOW FLAGS
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("ADC (%02X, X)");
-}
-
-static void op65(void) {  // ADC zpg
-  uint16_t t = state.a;
-  t += mem_read(addr_zpg());
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  // TODO - OVERFLOW FLAGS
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("ADC zeropage %02X");
-}
-
-static void op66(void) {  // ROR zpg
-  uint16_t a = addr_zpg();
-  uint16_t t = mem_read(a);
-  if(state.flags & FLAG_C)
-      t |= 0x100;
-  if(t&1) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  t = t>>1;
-  if((t&&0xFF) == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  mem_write(a,t);
-  state.cycle += 5; 
-  trace("ROR zpg %02X");
-}
-
-static void op68(void) {  // PLA
-  state.sp    += 1; 
-  state.a = mem_read(0x100+state.sp);
-  state.cycle += 3; 
-  trace("PLA");
-}
-
-static void op69(void) {  // ADC #
-  uint16_t t = state.a;
-  t += immediate();
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  // TODO - OVERFLOW FLAGS
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("ADC #%02X");
-}
-
-static void op6A(void) {  // ROR A
-  uint16_t t = state.a;
-  if(state.flags & FLAG_C)
-      t |= 0x100;
-  if(t&1) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  state.a = t>>1;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-
-  state.cycle += 2; 
-  trace("ROR A");
+/* Called once the memory map is set up, to hook the pages the VIC shows */
+static void vic_map_pages(void) {
+   int page;
+   for(page = 0; page < 256; page++) {
+      if(!em->vic_page[page] || !em->page_write[page])
+         continue;
+      em->vic_saved_write[page] = em->page_write[page];
+      em->page_write[page]      = NULL;
+      em->page_io_write[page]   = vic_mem_write;
+   }
 }
 
-static void op6C(void) {  // JMP (ind)
-  uint16_t a = addr_absolute();
-  if((a & 0xFF) == 0xFF) {
-      a = mem_read(a) | (mem_read(a-0xFF)<<8);
-  } else {
-      a = mem_read(a) | (mem_read(a+1)<<8);
-  } 
-  state.pc = a;
-  state.cycle += 5; 
-  trace("JMP (%04X)");
-}
-
-static void op70(void) {  // BVS rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_V) {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
-  } else {
-    state.cycle += 2; 
-  }
-  trace("BVS %02i");
-}
-
-static void op71(void) {  // ADC (ind), Y
-  uint16_t t = state.a;
-  t += mem_read(addr_zpg_ind_y());
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  // TODO - OVERFLOW FLAGS
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("ADC (%02X), Y");
-}
-
-static void op75(void) {  // ADC zpg, X
-  uint16_t t = state.a;
-  t += mem_read(addr_zpg_x());
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  // TODO - OVERFLOW FLAGS
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("ADC zeropage %02X, X");
-}
-
-static void op76(void) {  // ROR zpg, X
-  uint16_t a = addr_zpg_x();
-  uint16_t t = mem_read(a);
-  if(state.flags & FLAG_C)
-      t |= 0x100;
-  if(t&1) { 
-    state.flags |= FLAG_C;
-  } else {
-    state.flags &= ~FLAG_C;
-  }
-  t = t>>1;
-  if((t&0xFF) == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  mem_write(a,t);
-  state.cycle += 5; 
-  trace("ROR zpg %02X, X");
+/* Starts drawing afresh from the current cycle, after a reset or restore */
+static void vic_reset(void) {
+   em->vic_frame   = em->state.cycle / EM6502_FRAME_CYCLES;
+   em->vic_line    = em->state.cycle % EM6502_FRAME_CYCLES / VIC_LINE_CYCLES;
+   em->vic_all_gen = ++em->vic_gen;
+   em->vic_drawn   = 0;
+   vic_draw(0, VIC_LINES);
+   vic_frame_done();
 }
 
-static void op78(void) {  // SEI
-  state.flags |= FLAG_I;
-  state.cycle += 2; 
-  trace("SEI");
+static int show_display(const char *filename) {
+   FILE *f;
+   vic_catch_up();
+   f = fopen(filename, "wb");
+   if(f == NULL)
+     return 0;
+   fprintf(f,"P6\n%i %i\n255\n", EM6502_DISPLAY_WIDTH, EM6502_DISPLAY_HEIGHT);
+   fwrite(em->vic_done->rgb, sizeof(em->vic_done->rgb), 1, f);
+   fclose(f);
+   return 1;
 }
 
-static void op79(void) {  // ADC abs, Y
-  uint16_t t = state.a;
-  t += mem_read(addr_absolute_y());
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  // TODO - OVERFLOW FLAGS
-  if(t & 0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 3;   // TODO Decimal mode
-  trace("ADC %04X, Y");
+static void print_dispatched(void) {
+  printf("  0 1 2 3 4 5 6 7 8 9 A B C D E F\n");
+  for(int i = 0; i <256; i++) {
+    if((i&0xf)==0) {
+       printf("%1x",i>>4);
+    }
+    putchar(' ');
+    putchar(em->dispatched[i] ^ em->dispatched1[i] ? 'X' : '-');
+    if((i&0xf) == 0xF)
+      putchar('\n');
+  }
+  putchar('\n');
 }
 
-static void op81(void) {  // STA (zpg, X)
-  mem_write(addr_zpg_x_ind(),state.a);
-  state.cycle += 6;
-  trace("STA (zeropage %02X, X)");
+/*****************************************************************
+* ADC and SBC in decimal mode
+*
+* Indexed by [carry][A][operand], each entry holds the result in the
+* low byte and the N, V, Z and C flags in the high byte, as an NMOS
+* 6502 leaves them. N and V come from the sum before the high nibble
+* is adjusted and Z from the binary sum. SBC sets all its flags as in
+* binary mode. Binary mode is cheap enough to work out inline.
+*****************************************************************/
+static uint16_t alu_bcd_adc[2][256][256];
+static uint16_t alu_bcd_sbc[2][256][256];
+
+static void alu_init(void) {
+  int c, a, m;
+  for(c = 0; c < 2; c++) {
+    for(a = 0; a < 256; a++) {
+      for(m = 0; m < 256; m++) {
+        int bin, lo, hi, sbin, flags;
+
+        /* ADC */
+        bin = a + m + c;
+        lo  = (a & 0x0F) + (m & 0x0F) + c;
+        if(lo >= 0x0A)
+          lo = ((lo + 0x06) & 0x0F) + 0x10;
+        hi    = (a & 0xF0) + (m & 0xF0) + lo;
+        sbin  = (int8_t)(a & 0xF0) + (int8_t)(m & 0xF0) + lo;
+        flags = hi & FLAG_N;
+        if(sbin < -128 || sbin > 127) flags |= FLAG_V;
+        if((bin & 0xFF) == 0)         flags |= FLAG_Z;
+        if(hi >= 0xA0)
+          hi += 0x60;
+        if(hi >= 0x100)               flags |= FLAG_C;
+        alu_bcd_adc[c][a][m] = (hi & 0xFF) | (flags << 8);
+
+        /* SBC */
+        bin = a - m - (1 - c);
+        lo  = (a & 0x0F) - (m & 0x0F) + c - 1;
+        if(lo < 0)
+          lo = ((lo - 0x06) & 0x0F) - 0x10;
+        hi = (a & 0xF0) - (m & 0xF0) + lo;
+        if(hi < 0)
+          hi -= 0x60;
+        flags = bin & FLAG_N;
+        if((a ^ m) & (a ^ bin) & 0x80) flags |= FLAG_V;
+        if((bin & 0xFF) == 0)          flags |= FLAG_Z;
+        if(bin >= 0)                   flags |= FLAG_C;
+        alu_bcd_sbc[c][a][m] = (hi & 0xFF) | (flags << 8);
+      }
+    }
+  }
 }
 
-static void op84(void) {  // STY zpg
-  mem_write(addr_zpg(), state.y);
-  state.cycle += 4;
-  trace("STY zeropage %02X");
+/*****************************************************************
+* Running the CPU
+*
+* cpu_deadline is the cycle at which the current cpu_run_cycles()
+* batch ends. Anything that needs the CPU to come back to em6502_run()
+* early, like a change of trace level, pulls it in with cpu_break().
+* cpu_stop() does the same and makes cpu_run_cycles() return 0.
+*****************************************************************/
+static void cpu_break(void) {
+  em->cpu_deadline = em->state.cycle;
+}
+
+static void cpu_stop(const char *reason) {
+  if(em->cpu_stopped == NULL)
+    em->cpu_stopped = reason;
+  cpu_break();
+}
+
+static void trace_set(int level);
+static void cpu_select(void);
+
+/*****************************************************************
+* Stopping points
+*
+* A run can be made to stop when the PC reaches an address, or when a
+* value is written to an address. The exit address costs nothing, as
+* blocks are decoded to stop there, and the watched address only slows
+* down writes to its page.
+*****************************************************************/
+static void run_match_write(uint16_t addr, uint8_t data) {
+  if(em->run_saved_write)
+    em->run_saved_write[addr&0xFF] = data;
+  else
+    em->run_saved_io_write(addr, data);
+  if(addr == em->run_match_addr && data == em->run_match_value)
+    cpu_stop("memory");
 }
 
-static void op85(void) {  // STA zpg
-  mem_write(addr_zpg(), state.a);
-  state.cycle += 4;
-  trace("STA zeropage %02X");
-}
-
-static void op86(void) {  // STX zpg
-  mem_write(addr_zpg(), state.x);
-  state.cycle += 4;
-  trace("STX zeropage %02X");
-}
+/* Called once the memory map is set up, to hook the matched page */
+static void run_map_pages(void) {
+  uint8_t page = em->run_match_addr>>8;
+  if(em->run_match_addr < 0)
+    return;
+  em->run_saved_write    = em->page_write[page];
+  em->run_saved_io_write = em->page_io_write[page];
+  em->page_write[page]    = NULL;
+  em->page_io_write[page] = run_match_write;
+}
+
+/*****************************************************************
+* Breakpoints and watchpoints
+*
+* Each breakpoint covers an address range and has a set of actions.
+* PC breakpoints and read/write watchpoints are marked in bitmaps with
+* one bit per address. They are only checked by the diagnostic
+* interpreter, which cpu_select() picks when any are set. Watched pages
+* lose their direct pointers in the page table and go through
+* watch_read()/watch_write(), so unwatched pages pay nothing.
+*****************************************************************/
+#define BP_PC      1
+#define BP_READ    2
+#define BP_WRITE   4
+
+#define BP_ACT_TRACE    1
+#define BP_ACT_NOTRACE  2
+#define BP_ACT_DUMP     4
+#define BP_ACT_OPCODES  8
+#define BP_ACT_STOP     16
+
+#define MAX_BREAKPOINTS 64
+
+struct breakpoint {
+  uint16_t first;
+  uint16_t last;
+  int      kind;
+  int      actions;
+};
 
-static void op88(void) {  // DEY
-  state.y--;
-  if((state.y) == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if((state.y) & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("DEY");
-}
+#define BP_BIT(bits, addr) ((bits)[(addr)>>3] & (1<<((addr)&7)))
 
-static void op8A(void) {  // TXA
-  state.a      = state.x;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("TXA");
+static void bp_hit(int kind, uint16_t addr, uint8_t data) {
+  int i;
+  for(i = 0; i < em->breakpoint_count; i++) {
+    struct breakpoint *b = &em->breakpoints[i];
+    if(!(b->kind & kind) || addr < b->first || addr > b->last)
+      continue;
+
+    if(kind == BP_PC)
+      printf("Breakpoint at %04X, cycle %llu\n", addr, (unsigned long long)em->state.cycle);
+    else
+      printf("Watchpoint %s %04X %02X at PC %04X, cycle %llu\n",
+             kind == BP_READ ? "read" : "write", addr, data, em->state.pc,
+             (unsigned long long)em->state.cycle);
+
+    if(b->actions & BP_ACT_DUMP) {
+      cpu_dump();
+      zeropage_dump();
+      history_dump();
+    }
+    if(b->actions & BP_ACT_OPCODES) {
+      print_dispatched();
+      memset(em->dispatched, 0, sizeof(em->dispatched));
+    }
+    if(b->actions & BP_ACT_TRACE)
+      trace_set(em->trace_level | TRACE_OP);
+    if(b->actions & BP_ACT_NOTRACE)
+      trace_set(TRACE_OFF);
+    if(b->actions & BP_ACT_STOP)
+      cpu_stop("breakpoint");
+  }
+  if(kind == BP_PC && addr == em->run_exit_pc)
+    cpu_stop("pc");
 }
 
-static void op8C(void) {  // STY abs
-  mem_write(addr_absolute(), state.y);
-  state.cycle += 4;
-  trace("STY %04X");
+static uint8_t watch_read(uint16_t addr) {
+  uint8_t page = addr>>8;
+  uint8_t data;
+  if(em->watch_saved_read[page])
+    data = em->watch_saved_read[page][addr&0xFF];
+  else
+    data = em->watch_saved_io_read[page](addr);
+  if(BP_BIT(em->bp_read_bits, addr))
+    bp_hit(BP_READ, addr, data);
+  return data;
+}
+
+static void watch_write(uint16_t addr, uint8_t data) {
+  uint8_t page = addr>>8;
+  if(BP_BIT(em->bp_write_bits, addr))
+    bp_hit(BP_WRITE, addr, data);
+  if(em->watch_saved_write[page])
+    em->watch_saved_write[page][addr&0xFF] = data;
+  else
+    em->watch_saved_io_write[page](addr, data);
+}
+
+/* Called once the memory map is set up, to hook the watched pages */
+static void bp_map_pages(void) {
+  int page;
+  for(page = 0; page < 256; page++) {
+    if(!(em->bp_page[page] & (BP_READ|BP_WRITE)))
+      continue;
+    em->watch_saved_read[page]     = em->page_read[page];
+    em->watch_saved_write[page]    = em->page_write[page];
+    em->watch_saved_io_read[page]  = em->page_io_read[page];
+    em->watch_saved_io_write[page] = em->page_io_write[page];
+    mem_map_io(page, watch_read, watch_write);
+  }
+  /* The diagnostic interpreter finds run_exit_pc with the PC breakpoints */
+  if(em->run_exit_pc >= 0) {
+    em->bp_page[em->run_exit_pc>>8] |= BP_PC;
+    em->bp_pc_bits[em->run_exit_pc>>3] |= 1<<(em->run_exit_pc&7);
+  }
 }
 
+static int bp_add(const char *spec) {
+  struct breakpoint b;
+  char kind[16], range[32], actions[128];
+  char *action, *end, *save;
+  unsigned first, last, addr;
 
-static void op8D(void) {  // STA abs
-  mem_write(addr_absolute(), state.a);
-  state.cycle += 4;
-  trace("STA %04X");
-}
+  if(em->breakpoint_count == MAX_BREAKPOINTS) {
+    fprintf(stderr, "Too many breakpoints\n");
+    return 0;
+  }
+  if(sscanf(spec, "%15s %31s %127s", kind, range, actions) != 3) {
+    fprintf(stderr, "Bad breakpoint '%s'\n", spec);
+    return 0;
+  }
 
-static void op8E(void) {  // STX abs
-  mem_write(addr_absolute(), state.x);
-  state.cycle += 4;
-  trace("STX %04X");
-}
+  if(strcmp(kind, "pc") == 0)          b.kind = BP_PC;
+  else if(strcmp(kind, "read") == 0)   b.kind = BP_READ;
+  else if(strcmp(kind, "write") == 0)  b.kind = BP_WRITE;
+  else if(strcmp(kind, "access") == 0) b.kind = BP_READ|BP_WRITE;
+  else {
+    fprintf(stderr, "Unknown breakpoint type '%s'\n", kind);
+    return 0;
+  }
 
-static void op90(void) {  // BCC rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_C) {
-    state.cycle += 2; 
-  } else {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
+  first = strtoul(range, &end, 16);
+  last  = first;
+  if(*end == '-')
+    last = strtoul(end+1, &end, 16);
+  if(*end != '\0' || first > last || last > 0xFFFF) {
+    fprintf(stderr, "Bad address range '%s'\n", range);
+    return 0;
+  }
+  b.first = first;
+  b.last  = last;
+
+  b.actions = 0;
+  for(action = strtok_r(actions, ",", &save); action; action = strtok_r(NULL, ",", &save)) {
+    if(strcmp(action, "trace") == 0)        b.actions |= BP_ACT_TRACE;
+    else if(strcmp(action, "notrace") == 0) b.actions |= BP_ACT_NOTRACE;
+    else if(strcmp(action, "dump") == 0)    b.actions |= BP_ACT_DUMP;
+    else if(strcmp(action, "opcodes") == 0) b.actions |= BP_ACT_OPCODES;
+    else if(strcmp(action, "stop") == 0)    b.actions |= BP_ACT_STOP;
+    else {
+      fprintf(stderr, "Unknown breakpoint action '%s'\n", action);
+      return 0;
+    }
   }
-  trace("BCC %02i");
-}
 
-static void op91(void) {  // STA (zpg), y
-  mem_write(addr_zpg_ind_y(),state.a);
-  state.cycle += 6;
-  trace("STA (zeropage %02X), Y");
-}
+  for(addr = first; addr <= last; addr++) {
+    em->bp_page[addr>>8] |= b.kind;
+    if(b.kind & BP_PC)    em->bp_pc_bits[addr>>3]    |= 1<<(addr&7);
+    if(b.kind & BP_READ)  em->bp_read_bits[addr>>3]  |= 1<<(addr&7);
+    if(b.kind & BP_WRITE) em->bp_write_bits[addr>>3] |= 1<<(addr&7);
+  }
+  em->breakpoints[em->breakpoint_count++] = b;
+  cpu_select();
+  return 1;
+}
+
+/*****************************************************************
+* Basic block cache
+*
+* The production interpreter runs predecoded basic blocks rather than
+* fetching and decoding every instruction byte as it goes. A block
+* runs from its start address up to the first instruction that changes
+* the flow of control, or BLOCK_MAX instructions, and each entry holds
+* the handler, operand and length of one instruction. insn[0] is never
+* run, and the last entry is a BLOCK_SENTINEL whose handler looks up
+* the next block. Blocks live in a direct mapped cache indexed by PC.
+*
+* Code in RAM is marked a byte at a time in code_bits[]. The first time
+* code is decoded from a RAM page, writes to that page are routed
+* through code_write(). A write to a code byte bumps the page's
+* generation, which every block checks when it is looked up, and puts
+* the page back on the fast path until code is decoded from it again.
+*
+* A block that branches back to its own start without writing to
+* memory ends in BLOCK_IDLE instead. If the registers and flags come
+* round the loop unchanged, nothing it reads can change either until
+* the next event, so it would spin until then. The whole trips round
+* the loop up to cpu_deadline are skipped, and counted in idle_cycles.
+*
+* Blocks also stop short of run_exit_pc, and the block at it is empty
+* but for a BLOCK_STOP, so a headless run can stop there for nothing.
+*****************************************************************/
+#define BLOCK_MAX       16
+#define BLOCK_CACHE     4096
+#define BLOCK_SENTINEL  256
+#define BLOCK_COUNTED   257      // the sentinel when the JIT counts lookups
+#define BLOCK_IDLE      258      // the sentinel for a possible idle loop
+#define BLOCK_STOP      259      // the only entry of the block at run_exit_pc
+#define BLOCK_END       0x80     // in block_info[], for opcodes that end a block
+#define BLOCK_WRITES    0x40     // and for opcodes that write to memory
+#define BLOCK_LENGTH    0x03
+
+struct decoded {
+  const void *handler;
+  uint16_t    operand;
+  uint16_t    opcode;
+  uint8_t     length;
+};
 
-static void op94(void) {  // STY zpg, X
-  mem_write(addr_zpg_x(),state.y);
-  state.cycle += 4;
-  trace("STY zeropage %02X, X");
-}
+struct block {
+  int32_t        pc;             // -1 when the slot is empty
+  uint32_t       gen;            // page_gen[] of its first and last pages
+  uint16_t       start;
+  uint16_t       size;
+  uint8_t        last_page;
+  uint8_t        insns;          // instructions, for state.instructions
+  uint64_t       idle_cycle;     // when an idle loop last came round
+  uint64_t       idle_insns;     // state.instructions then
+  uint64_t       idle_regs;      // and its registers then, see idle_regs()
+#if EM6502_JIT
+  uint8_t        no_jit;         // not translatable, or bails out too often
+  uint8_t        bails;
+  uint32_t       count;          // lookups, until it is translated
+  void          *jit;
+#endif
+  struct decoded insn[BLOCK_MAX+2];
+};
 
-static void op95(void) {  // STA zpg, X
-  mem_write(addr_zpg_x(),state.a);
-  state.cycle += 4;
-  trace("STA zeropage %02X, X");
-}
+static void block_flush(void) {
+  int i;
+  for(i = 0; i < BLOCK_CACHE; i++) {
+    em->block_cache[i].pc = -1;
+#if EM6502_JIT
+    em->block_cache[i].jit = NULL;
+#endif
+  }
+  em->block_current = NULL;
+}
+
+/* Forgets which bytes held code as well, for once the memory map is set up again */
+static void block_reset(void) {
+  memset(em->code_page, 0, sizeof(em->code_page));
+  memset(em->code_bits, 0, sizeof(em->code_bits));
+  block_flush();
+}
+
+static void code_write(uint16_t addr, uint8_t data) {
+  uint8_t page = addr>>8;
+
+  if(em->code_bits[addr>>3] & (1<<(addr&7))) {
+    em->page_gen[page]++;
+    memset(em->code_bits + (page<<5), 0, 32);
+    em->page_write[page]    = em->code_saved_write[page];
+    em->page_io_write[page] = em->code_saved_io_write[page];
+    em->code_page[page]     = 0;
+    /* Writes to the rest of the page are no longer caught, so the running
+       block has to stop even if this byte was not part of it */
+    if(em->block_current && (page == em->block_current->start>>8 ||
+                             page == em->block_current->last_page))
+      cpu_break();
+  }
 
-static void op96(void) {  // STX zpg, Y
-  mem_write(addr_zpg_y(), state.x);
-  state.cycle += 4;
-  trace("STX zeropage %02X, Y");
+  if(em->code_saved_write[page])
+    em->code_saved_write[page][addr&0xFF] = data;
+  else
+    em->code_saved_io_write[page](addr, data);
 }
 
-static void op98(void) {  // TYA
-  state.a = state.y;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("TYA");
+static void code_hook(uint8_t page) {
+  em->code_saved_write[page]    = em->page_write[page];
+  em->code_saved_io_write[page] = em->page_io_write[page];
+  em->page_write[page]          = NULL;
+  em->page_io_write[page]       = code_write;
+  em->code_page[page]           = 1;
 }
 
-static void op99(void) {  // STA abs, Y
-  mem_write(addr_absolute_y(), state.a);
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  trace("STA %04X, Y");
+/* Called once the memory map is set up, to hook the pages holding code again */
+static void code_map_pages(void) {
+  int page;
+  for(page = 0; page < 256; page++)
+    if(em->code_page[page])
+      code_hook(page);
 }
 
+/* Reads a byte of code for the decoder, and returns 0 if it did not come
+   from plain memory and so must not be cached */
+static int block_code_byte(uint16_t addr, uint8_t *data) {
+  uint8_t page = addr>>8;
 
-static void op9A(void) {  // TXS
-  state.sp     = state.x;
-  state.cycle += 2; 
-  trace("TXS");
-}
+  if(!em->page_read[page]) {
+    *data = mem_read_nolog(addr);
+    return 0;
+  }
+  *data = em->page_read[page][addr&0xFF];
+
+  if(em->page_write[page] || em->page_io_write[page] == run_match_write ||
+     em->page_io_write[page] == vic_mem_write)
+    code_hook(page);
+  if(em->code_page[page])
+    em->code_bits[addr>>3] |= 1<<(addr&7);
+  return 1;
+}
+
+/*****************************************************************
+* Superinstructions
+*
+* Each run of opcodes listed in em6502_super.def is executed by one
+* fused handler, which does the work of each instruction in turn and
+* checks the deadline between them, so cycles, flags and cpu_break()
+* come out as if they had been dispatched one at a time. The block
+* decoder points the first instruction of a matching run at the fused
+* handler. Only the computed goto build has them.
+*****************************************************************/
+#if USE_COMPUTED_GOTO
+#define SUPER_BASE  (BLOCK_STOP+1)
+
+enum {
+#define SUPER2(c1,n1,m1,y1, c2,n2,m2,y2)  SUPER_##c1##_##c2,
+#define SUPER3(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3)  SUPER_##c1##_##c2##_##c3,
+#define SUPER4(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3, c4,n4,m4,y4)  SUPER_##c1##_##c2##_##c3##_##c4,
+#include "em6502_super.def"
+#undef SUPER4
+#undef SUPER3
+#undef SUPER2
+  SUPER_COUNT
+};
 
-static void op9D(void) {  // STA abs, X
-  mem_write(addr_absolute_x(), state.a);
-  state.cycle += 4;
-  trace("STA %04X, X");
-}
+static const struct super {
+  uint8_t length;
+  uint8_t opcode[4];
+} super_table[SUPER_COUNT] = {
+#define SUPER2(c1,n1,m1,y1, c2,n2,m2,y2)  { 2, { 0x##c1, 0x##c2 } },
+#define SUPER3(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3)  { 3, { 0x##c1, 0x##c2, 0x##c3 } },
+#define SUPER4(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3, c4,n4,m4,y4)  { 4, { 0x##c1, 0x##c2, 0x##c3, 0x##c4 } },
+#include "em6502_super.def"
+#undef SUPER4
+#undef SUPER3
+#undef SUPER2
+};
+#endif
 
-static void opA0(void) {  // LDY #
-  state.y      = immediate();
-  if(state.y == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.y &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("LDY #%02X");
+/*****************************************************************
+* The history
+*
+* A ring of the last HISTORY_SIZE things the CPU did, with the
+* registers as each started, for a post-mortem of how a fault or
+* breakpoint was got to. The diagnostic interpreter puts in every
+* instruction. The production interpreter only puts in each block it
+* runs, which costs a few stores a block rather than an instruction,
+* so it is always on; history_dump() disassembles the block again
+* from memory. Translated blocks and interrupts are an entry each.
+* Build with -DEM6502_NO_HISTORY to leave it out.
+*****************************************************************/
+/* For the JIT, which only has the registers in state */
+#if EM6502_HISTORY && EM6502_JIT
+static void history_add(int kind) {
+  struct history *h = &em->history[em->history_next++ % HISTORY_SIZE];
+  h->cycle = em->state.cycle;
+  h->regs  = (uint64_t)em->state.a | (uint64_t)em->state.x << 8 |
+             (uint64_t)em->state.y << 16 | (uint64_t)em->state.sp << 24 |
+             (uint64_t)em->state.flags << 32 | (uint64_t)em->state.n_res << 40 |
+             (uint64_t)em->state.z_res << 48 |
+             (uint64_t)(em->state.carry | (em->state.overflow & 0x80)) << 56;
+  h->insn  = em->state.pc | (uint64_t)kind << 40;
 }
+#endif
 
-static void opA1(void) {  // LDA (ind, X)
-  state.a = mem_read(addr_zpg_x_ind());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 3; 
-  trace("LDA zeropage %02X");
+/* Instructions are looked at again without reading I/O */
+static uint8_t history_peek(uint16_t addr) {
+  return em->page_read[addr>>8] ? em->page_read[addr>>8][addr&0xFF] : 0;
 }
 
-static void opA2(void) {  // LDX #
-  state.x      = immediate();
-  if(state.x == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.x &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("LDX #%02X");
-}
+/* The -P profiler and binary traces, below, are fed by the diagnostic
+   interpreter */
+static void profile_insn(uint8_t op);
+static void tracefile_insn(uint8_t opcode);
+static void tracefile_interrupt(int nmi);
 
-static void opA4(void) {  // LDY zeropage
-  state.y = mem_read(addr_zpg());
-  if(state.y == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.y &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 3; 
-  trace("LDA zeropage %02X");
-}
+#if EM6502_JIT
+static struct decoded *block_find(uint16_t pc, const void *const *handlers);
+#include "em6502_jit.h"
+#endif
 
-static void opA5(void) {  // LDA zeropage
-  state.a = mem_read(addr_zpg());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
+#define TRACING 0
+#define OPS(name) name##_fast
+#include "em6502_ops.h"
+#undef OPS
+#undef TRACING
+
+#define TRACING 1
+#define OPS(name) name##_trace
+#include "em6502_ops.h"
+#undef OPS
+#undef TRACING
+
+/*****************************************************************
+* Profiling runs of opcodes
+*
+* With -P, the diagnostic interpreter counts every run of two to four
+* instructions that lies inside a basic block. When the machine is
+* destroyed at the end of the run, the runs that would save the most
+* dispatches are written out in the form of em6502_super.def.
+*****************************************************************/
+#define PROFILE_SIZE  65536
+#define PROFILE_KEEP  32
+
+struct profile {
+  uint32_t seq;
+  uint8_t  length;
+  uint64_t count;
+};
 
-  state.cycle += 3; 
-  trace("LDA zeropage %02X");
-}
+static const struct {
+  const char *name;
+  const char *mode;
+  uint8_t     cycles;
+} opcode_info[256] = {
+#define OP(code, name, mode, cycles)   [0x##code] = { #name, #mode, cycles },
+#define UOP(code, name, mode, cycles)  OP(code, name, mode, cycles)
+#include "em6502_opcodes.def"
+#undef UOP
+#undef OP
+};
 
-static void opA6(void) {  // LDX zeropage
-  state.x = mem_read(addr_zpg());
-  if(state.x == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.x &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 3; 
-  trace("LDX zeropage %02X");
-}
+static void profile_count(uint32_t seq, int length) {
+  uint32_t h = (seq * 2654435761u + length) & (PROFILE_SIZE-1);
 
-static void opA8(void) {  // TAY
-  state.y      = state.a;
-  if(state.y == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.y &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("TAY");
+  while(em->profile[h].length) {
+    if(em->profile[h].seq == seq && em->profile[h].length == length) {
+      em->profile[h].count++;
+      return;
+    }
+    h = (h+1) & (PROFILE_SIZE-1);
+  }
+  /* Rare runs that turn up once the table is half full are not counted */
+  if(em->profile_used == PROFILE_SIZE/2)
+    return;
+  em->profile_used++;
+  em->profile[h].seq    = seq;
+  em->profile[h].length = length;
+  em->profile[h].count  = 1;
 }
 
-static void opA9(void) {  // LDA #
-  state.a      = immediate();
-  if(state.a == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("LDA #%02X");
-}
+static void profile_insn(uint8_t op) {
+  int n;
 
-static void opAA(void) {  // TAX
-  state.x      = state.a;
-  if(state.x == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.x &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("TAX");
-}
+  em->profile_insns++;
+  if(!block_info[op]) {
+    em->profile_run = 0;
+    return;
+  }
+  em->profile_seq = em->profile_seq<<8 | op;
+  if(em->profile_run < 4)
+    em->profile_run++;
+  for(n = 2; n <= em->profile_run; n++)
+    profile_count(em->profile_seq & (0xFFFFFFFFu >> (32 - 8*n)), n);
+  if(block_info[op] & BLOCK_END)
+    em->profile_run = 0;
+}
+
+/* Most dispatches saved first */
+static int profile_by_saving(const void *a, const void *b) {
+  const struct profile *pa = *(const struct profile *const *)a;
+  const struct profile *pb = *(const struct profile *const *)b;
+  uint64_t sa = pa->count * (pa->length-1);
+  uint64_t sb = pb->count * (pb->length-1);
+  return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/* Returns 1 if 'run' mostly turns up as part of the longer run 'in' */
+static int profile_within(const struct profile *run, const struct profile *in) {
+  uint32_t mask = 0xFFFFFFFFu >> (32 - 8*run->length);
+  int shift;
+
+  if(run->length >= in->length || run->count > in->count + in->count/10)
+    return 0;
+  for(shift = 0; shift <= in->length - run->length; shift++)
+    if(((in->seq >> (8*shift)) & mask) == run->seq)
+      return 1;
+  return 0;
+}
+
+/* Longest first, as the block decoder takes the first match */
+static int profile_by_length(const void *a, const void *b) {
+  const struct profile *pa = *(const struct profile *const *)a;
+  const struct profile *pb = *(const struct profile *const *)b;
+  if(pa->length != pb->length)
+    return pb->length - pa->length;
+  return profile_by_saving(a, b);
+}
+
+/*
+ * Keeps the PROFILE_KEEP runs that save the most dispatches, leaving out
+ * the rare ones and the ones that are nearly always part of a longer
+ * run that has already been kept.
+ */
+static int profile_write(const char *name) {
+  struct profile **runs = malloc(PROFILE_SIZE * sizeof(runs[0]));
+  int i, j, k, count = 0, n = 0;
+  FILE *f;
+
+  if(runs == NULL)
+    return 0;
+  for(i = 0; i < PROFILE_SIZE; i++)
+    if(em->profile[i].length && em->profile[i].count * 10000 >= em->profile_insns)
+      runs[count++] = &em->profile[i];
+  qsort(runs, count, sizeof(runs[0]), profile_by_saving);
+  for(i = 0; i < count && n < PROFILE_KEEP; i++) {
+    for(k = 0; k < n && !profile_within(runs[i], runs[k]); k++)
+      ;
+    if(k == n)
+      runs[n++] = runs[i];
+  }
+  qsort(runs, n, sizeof(runs[0]), profile_by_length);
 
-static void opAC(void) {  // LDY abs
-  state.y      = mem_read(addr_absolute());
-  if(state.y == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.y &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("LDY #%04X");
+  f = fopen(name, "w");
+  if(f == NULL) {
+    printf("Unable to write '%s'\n", name);
+    free(runs);
+    return 0;
+  }
+  fprintf(f, "/* Superinstructions - written by './em6502 -P' from %llu instructions */\n",
+          (unsigned long long)em->profile_insns);
+  for(i = 0; i < n; i++) {
+    fprintf(f, "SUPER%i(", runs[i]->length);
+    for(j = runs[i]->length-1; j >= 0; j--) {
+      uint8_t op = runs[i]->seq >> (8*j);
+      fprintf(f, "%02X, %s, %s, %i%s", op, opcode_info[op].name, opcode_info[op].mode,
+              opcode_info[op].cycles, j ? ",  " : ")");
+    }
+    fprintf(f, "   // %llu runs\n", (unsigned long long)runs[i]->count);
+  }
+  fclose(f);
+  free(runs);
+  printf("Wrote %i superinstructions to '%s'\n", n, name);
+  return 1;
 }
 
-static void opAD(void) {  // LDA abs
-  state.a      = mem_read(addr_absolute());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("LDA #%04X");
+static void cpu_select(void) {
+  if(em->trace_level == TRACE_OFF && em->breakpoint_count == 0 && em->profile_file == NULL &&
+     em->tracefile == NULL)
+    em->cpu_run_cycles = cpu_run_cycles_fast;
+  else
+    em->cpu_run_cycles = cpu_run_cycles_trace;
+  cpu_break();
 }
 
-static void opAE(void) {  // LDX abs
-  state.x      = mem_read(addr_absolute());
-  if(state.x == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.x &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("LDX #%04X");
+static void trace_set(int level) {
+  em->trace_level = level;
+  cpu_select();
 }
 
-static void opB0(void) {  // BCS rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_C) {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
-  } else {
-    state.cycle += 2; 
-  }
-  trace("BCS %02i");
-}
-
-static void opB1(void) {  // LDA (zpg), y
-  state.a = mem_read(addr_zpg_ind_y());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6;
-  trace("LDA (zeropage %02X), Y");
+static void cpu_reset(void) {
+   trace("RESET triggerd");
+   em->state.sp     = 0xFD;   
+   em->state.pc     = mem_read(0xFFFC);
+   em->state.pc    |= mem_read(0xFFFD)<<8;   
+   cpu_set_flags(cpu_flags() | FLAG_I);
+   em->state.cycle  = 0;   
+   em->state.instructions = 0;
 }
 
-static void opB4(void) {  // LDY zeropage, X
-  state.y = mem_read(addr_zpg_x());
-  if(state.y == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.y &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 3; 
-  trace("LDY zeropage %02X, X");
-}
+static uint32_t crc32(const uint8_t *data, size_t len) {
+   uint32_t crc = 0xFFFFFFFF;
+   int i;
+   while(len--) {
+      crc ^= *data++;
+      for(i = 0; i < 8; i++)
+         crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+   }
+   return ~crc;
+}
+
+/* How each addressing mode is shown, and its length */
+static const struct {
+  const char *mode;
+  const char *format;
+  int         length;
+} history_modes[] = {
+  { "IMP", "",          1 }, { "ACC", " A",         1 }, { "IMM", " #$%02X",    2 },
+  { "ZPG", " $%02X",    2 }, { "ZPX", " $%02X,X",   2 }, { "ZPY", " $%02X,Y",   2 },
+  { "ABS", " $%04X",    3 }, { "ABX", " $%04X,X",   3 }, { "ABY", " $%04X,Y",   3 },
+  { "IND", " ($%04X)",  3 }, { "IZX", " ($%02X,X)", 2 }, { "IZY", " ($%02X),Y", 2 },
+  { "REL", " $%04X",    2 },
+};
 
-static void opB5(void) {  // LDA zeropage, X
-  state.a = mem_read(addr_zpg_x());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-
-  state.cycle += 3; 
-  trace("LDA zeropage %02X, X");
-}
-
-static void opB6(void) {  // LDX zeropage, Y
-  state.x = mem_read(addr_zpg_y());
-  if(state.x == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.x &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 3; 
-  trace("LDX zeropage %02X, Y");
-}
-
-
-static void opB8(void) {  // CLV
-  state.flags &= ~FLAG_V;
-  state.cycle += 2; 
-  trace("CLV");
-}
-
-static void opB9(void) {  // LDA abs, Y
-  state.a      = mem_read(addr_absolute_y());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  trace("LDA %04X, Y");
-}
-
-static void opBD(void) {  // LDA abs, X
-  state.a      = mem_read(addr_absolute_x());
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  trace("LDA %04X, X");
-}
-
-static void opC0(void) {  // CPY #
-  uint16_t val = immediate();
-  uint8_t  d = state.y - val;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.y >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  trace("CPY #%02X");
-}
-
-static void opC1(void) {  // CMP (zpg, x)
-  uint8_t  m = mem_read(addr_zpg_x_ind());
-  uint8_t  d = state.a - m;
-  state.cycle += 6;
-  
-  if(d == 0)       state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)     state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.a >= m) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  
-  trace("CMP (zeropage %02X, X)");
-}
-
-static void opC4(void) {  // CPY zpg
-  uint16_t val = mem_read(addr_zpg());
-  uint8_t  d = state.y - val;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.y >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  trace("CPX zeropage %02X");
-}
-
-static void opC5(void) {  // CMP zpg
-  uint16_t val = mem_read(addr_zpg());
-  uint8_t  d = state.a - val;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.a >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  trace("CMP zeropage %02X");
-}
-
-static void opC6(void) {  // DEC zeropage
-  uint8_t z = addr_zpg();
-  uint8_t t = mem_read(z);
-  t--;
-  mem_write(z,t);
-  if(t == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 5; 
-  trace("DEC zeropage %02X");
-}
-
-static void opC8(void) {  // INY
-  state.y     += 1;
-  if((state.y) == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if((state.y) & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("INY");
-}
-
-static void opC9(void) {  // CMP #
-  uint8_t val = immediate();
-  uint8_t d = state.a - val;
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.a >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 2; 
-  trace("CMP #%02X");
-}
-
-static void opCA(void) {  // DEX
-  state.x     -= 1;
-  if((state.x) == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if((state.x) & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("DEX");
-}
-
-static void opD0(void) {  // BNE rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_Z) {
-    state.cycle += 2; 
+static int history_mode(uint8_t opcode) {
+  int i;
+  for(i = 0; strcmp(history_modes[i].mode, opcode_info[opcode].mode) != 0; i++)
+    ;
+  return i;
+}
+
+/* Prints an instruction, and the registers if it has them */
+static void history_line(uint64_t cycle, uint16_t pc, uint8_t opcode, uint16_t operand,
+                         const char *what, const struct history *regs) {
+  char bytes[12] = "", text[24] = "", flags[9];
+  const char *name = opcode_info[opcode].name;
+  uint64_t r;
+  uint8_t  lazy, p;
+  int      i;
+
+  if(what) {
+    snprintf(text, sizeof(text), "%s", what);
+  } else if(name == NULL) {
+    snprintf(bytes, sizeof(bytes), "%02X", opcode);
+    snprintf(text, sizeof(text), "???");
   } else {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
+    i = history_mode(opcode);
+    if(history_modes[i].length == 1)
+      snprintf(bytes, sizeof(bytes), "%02X", opcode);
+    else if(history_modes[i].length == 2)
+      snprintf(bytes, sizeof(bytes), "%02X %02X", opcode, operand & 0xFF);
+    else
+      snprintf(bytes, sizeof(bytes), "%02X %02X %02X", opcode, operand & 0xFF, operand >> 8);
+    memcpy(text, name, 3);
+    if(strcmp(history_modes[i].mode, "REL") == 0)
+      snprintf(text+3, sizeof(text)-3, history_modes[i].format,
+               (uint16_t)(pc + 2 + (int8_t)operand));
+    else
+      snprintf(text+3, sizeof(text)-3, history_modes[i].format,
+               history_modes[i].length == 2 ? operand & 0xFF : operand);
   }
-  trace("BNE %02i");
-}
-
-static void opD1(void) {  // CMP (zpg), y
-  uint8_t  m = mem_read(addr_zpg_ind_y());
-  uint8_t  d = state.a - m;
-  state.cycle += 6;
-  
-  if(d == 0)       state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)     state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.a >= m) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  
-  trace("CMP (zeropage %02X), Y");
-}
-
-static void opD5(void) {  // CMP zpg, X
-  uint16_t val = mem_read(addr_zpg_x());
-  uint8_t  d = state.a - val;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.a >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  trace("CMP zeropage %02X, X");
-}
-
-static void opD6(void) {  // DEC zeropage, X
-  uint8_t z = addr_zpg_x();
-  uint8_t t = mem_read(z);
-  t--;
-  mem_write(z,t);
-  if(t == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6; 
-  trace("DEC zeropage %02X");
-}
-
-static void opD8(void) {  // CLD
-  state.flags &= ~FLAG_D;
-  state.cycle += 2; 
-  trace("CLD");
-}
-
-static void opDD(void) {  // CMP abs,X
-  uint8_t val = mem_read(addr_absolute_x());
-  uint8_t d = state.a - val;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.a >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  trace("CMP %04X, X");
-}
-
-static void opE0(void) {  // CPX #
-  uint16_t val = immediate();
-  uint8_t  d = state.x - val;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.x >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  trace("CPX #%02X");
-}
-
-static void opE1(void) {  // SBC (zpg, X)
-  uint16_t t = state.a;
-  t += mem_read(addr_zpg_x_ind()) ^ 0xFF;  // TODO - check Carry flags
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  // TODO - OVERFLOW FLAGS
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("SBC (zeropage %02X, X)");
-}
-
-static void opE4(void) {  // CPX zpg
-  uint16_t val = mem_read(addr_zpg());
-  uint8_t  d = state.x - val;
-  if(d == 0)         state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(d & 0x80)       state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(state.x >= val) state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;  // TODO: +1 if boundary crossed
-  trace("CPX zeropage #%02X");
-}
-
-
-static void opE5(void) {  // SBC zpg
-  uint16_t t = state.a;
-  uint16_t o = mem_read(addr_zpg());
-  t += o ^ 0xFF;
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  // TODO - OVERFLOW FLAGS
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("SBC zeropage %02X");
-}
-
-static void opE8(void) {  // INX
-  state.x     += 1;
-  if((state.x) == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if((state.x) & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 2; 
-  trace("INX");
-}
-
-static void opE9(void) {  // SBC # 
-  uint16_t t = state.a;
-  t += immediate() ^ 0xFF;
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  // TODO - OVERFLOW FLAGS
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("SBC #%02X");
-}
-
-
-static void opE6(void) {  // INC zeropage
-  uint8_t z = addr_zpg();
-  uint8_t t = mem_read(z);
-  t++;
-  mem_write(z,t);
-  if(t == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 5; 
-  trace("INC zeropage %02X");
-}
-
-static void opEA(void) {  // NOP
-  state.cycle += 2;
-  trace("NOP");
-}
-
-static void opF0(void) {  // BEQ rel
-  int8_t offset = relative();
-  if(state.flags & FLAG_Z) {
-    state.pc    += offset;
-    state.cycle += 3;  // TODO: +1 if boundary crossed
-  } else {
-    state.cycle += 2; 
+  if(regs == NULL) {
+    printf("%10s %04X: %-9s %s\n", "", pc, bytes, text);
+    return;
+  }
+  r    = regs->regs;
+  lazy = r >> 56;
+  p    = ((r >> 32) & ~(FLAG_N|FLAG_V|FLAG_Z|FLAG_C)) | ((r >> 40) & FLAG_N) |
+         ((lazy & 0x80) >> 1) | ((r >> 48) & 0xFF ? 0 : FLAG_Z) | (lazy & FLAG_C);
+  for(i = 0; i < 8; i++)
+    flags[i] = p & (0x80 >> i) ? "NV-BDIZC"[i] : '.';
+  flags[8] = '\0';
+  printf("%10llu %04X: %-9s %-18s %02X %02X %02X %02X %s\n", (unsigned long long)cycle,
+         pc, bytes, text, (uint8_t)r, (uint8_t)(r >> 8), (uint8_t)(r >> 16),
+         (uint8_t)(r >> 24), flags);
+}
+
+/* Prints the history ring, oldest first. The newest block is cut
+   short where the CPU got to. */
+static void history_dump(void) {
+  static const char *const what[] = {
+    [HISTORY_JIT] = "(translated block)", [HISTORY_IRQ] = "(IRQ)", [HISTORY_NMI] = "(NMI)"
+  };
+  uint32_t n = em->history_next < HISTORY_SIZE ? em->history_next : HISTORY_SIZE;
+  uint32_t i;
+  printf("Last %u entries, with the registers before each:\n", (unsigned)n);
+  printf("     cycle   PC  bytes     instruction         A  X  Y  SP flags\n");
+  for(i = em->history_next - n; i != em->history_next; i++) {
+    const struct history *h = &em->history[i % HISTORY_SIZE];
+    uint16_t pc      = h->insn;
+    uint16_t operand = h->insn >> 16;
+    uint8_t  opcode  = h->insn >> 32;
+    int      kind    = (h->insn >> 40) & 0xFF;
+    int      j;
+
+    if(kind != HISTORY_BLOCK) {
+      history_line(h->cycle, pc, opcode, operand, kind == HISTORY_INSN ? NULL : what[kind], h);
+      continue;
+    }
+    for(j = 0; j < operand; j++) {
+      uint8_t op = history_peek(pc);
+      if(j > 0 && i+1 == em->history_next && pc == em->state.pc)
+        break;
+      history_line(h->cycle, pc, op, history_peek(pc+1) | history_peek(pc+2) << 8,
+                   NULL, j == 0 ? h : NULL);
+      pc += opcode_info[op].name ? history_modes[history_mode(op)].length : 1;
+    }
   }
-  trace("BEQ %02i");
-}
-
-static void opF1(void) {  // SBC zpg, Y
-  uint16_t t = state.a;
-  t += mem_read(addr_zpg_ind_y()) ^ 0xFF;
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  // TODO - OVERFLOW FLAGS
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("SBC zeropage %02X, Y");
-}
-
-static void opF5(void) {  // SBC zpg, X
-  uint16_t t = state.a;
-  t += mem_read(addr_zpg_x()) ^ 0xFF;
-  t += (state.flags & FLAG_C ? 1 : 0);
-  state.a = t;
-  if(state.a == 0)  state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  // TODO - OVERFLOW FLAGS
-  if(state.a &0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  if(t &0x100)      state.flags |= FLAG_C;  else state.flags &= ~FLAG_C;
-  state.cycle += 4;   // TODO Decimal mode
-  trace("SBC zeropage %02X, X");
-}
-
-static void opF6(void) {  // INC zeropage, X
-  uint8_t z = addr_zpg_x();
-  uint8_t t = mem_read(z);
-  t++;
-  mem_write(z,t);
-  if(t == 0)   state.flags |= FLAG_Z;  else state.flags &= ~FLAG_Z;
-  if(t & 0x80) state.flags |= FLAG_N;  else state.flags &= ~FLAG_N;
-  state.cycle += 6; 
-  trace("INC zeropage %02X");
-}
-
-static void opF8(void) {  // SED
-  state.flags |= FLAG_D;
-  state.cycle += 2; 
-  printf("DECIMAL NODE NOT IMPLEMENTED YET!\n");
-  trace("SED");
-}
-
-/********************************************************************************/
-/*************** END OF ALL THE OPCODE IMPLEMENTATOINS **************************/
-/********************************************************************************/
-
-static void (*dispatch[256])(void) = {
-//           00    01    02    03    04    05    06    07    08    09    0A    0B    0C    0D    0E    0F
-/* 00 */    op00, op01, NULL, NULL, NULL, op05, op06, NULL, op08, op09, op0A, NULL, NULL, op0D,    0, NULL,
-/* 10 */    op10, op11, NULL, NULL, NULL, op15, op16, NULL, op18,    0, NULL, NULL, NULL,    0,    0, NULL,
-/* 20 */    op20, op21, NULL, NULL, op24, op25, op26, NULL, op28, op29, op2A, NULL, op2C,    0,    0, NULL,
-/* 30 */    op30, op31, NULL, NULL, NULL, op35, op36, NULL, op38,    0, NULL, NULL, NULL,    0,    0, NULL,
-/* 40 */    op40, op41, NULL, NULL, NULL, op45, op46, NULL, op48, op49, op4A, NULL, op4C,    0,    0, NULL,
-/* 50 */    op50, op51, NULL, NULL, NULL, op55, op56, NULL, op58,    0, NULL, NULL, NULL,    0,    0, NULL,
-/* 60 */    op60, op61, NULL, NULL, NULL, op65, op66, NULL, op68, op69, op6A, NULL, op6C,    0,    0, NULL,
-/* 70 */    op70, op71, NULL, NULL, NULL, op75, op76, NULL, op78, op79, NULL, NULL, NULL,    0,    0, NULL,
-/* 80 */    NULL, op81, NULL, NULL, op84, op85, op86, NULL, op88, NULL, op8A, NULL, op8C, op8D, op8E, NULL,
-/* 90 */    op90, op91, NULL, NULL, op94, op95, op96, NULL, op98, op99, op9A, NULL, NULL, op9D, NULL, NULL,
-/* A0 */    opA0, opA1, opA2, NULL, opA4, opA5, opA6, NULL, opA8, opA9, opAA, NULL, opAC, opAD, opAE, NULL,
-/* B0 */    opB0, opB1, NULL, NULL, opB4, opB5, opB6, NULL, opB8, opB9,    0, NULL,    0, opBD,    0, NULL,
-/* C0 */    opC0, opC1, NULL, NULL, opC4, opC5, opC6, NULL, opC8, opC9, opCA, NULL,    0,    0,    0, NULL,
-/* D0 */    opD0, opD1, NULL, NULL, NULL, opD5, opD6, NULL, opD8,    0, NULL, NULL, NULL, opDD,    0, NULL,
-/* E0 */    opE0, opE1, NULL, NULL, opE4, opE5, opE6, NULL, opE8, opE9, opEA, NULL,    0,    0,    0, NULL,
-/* F0 */    opF0, opF1, NULL, NULL, NULL, opF5, opF6, NULL, opF8,    0, NULL, NULL, NULL,    0,    0, NULL};
-
-static uint8_t dispatched[256];
-static uint8_t dispatched1[256];
-
-static void logger_8(char *message, uint8_t data) {
-  printf("%s %02X\n", message, data);
 }
 
-static void logger_16_8(char *message, uint16_t data16, uint8_t data8) {
-  printf("%s %04X %02X\n", message, data16, data8);
-}
+static void zeropage_dump(void) {
+   int i;
+   printf("   ");
+   for(i = 0; i < 16; i++) {
+     printf(" %02X",i);
+   }
 
-static void cpu_dump(void) {
+   for(i = 0; i < 256; i++) {
+     if((i&0xF)==0) {
+       printf("\n%02X:",i);
+     }
+     printf(" %02X",em->ram[i]);
+   }
    printf("\n");
-   printf("Fault at cycle %i\n",state.cycle);
-   printf("PC:    %04x\n",state.pc);
-   printf("flags: %02X ",state.flags);
-   putchar(state.flags & FLAG_N ? 'N' : ' '); 
-   putchar(state.flags & FLAG_V ? 'V' : ' '); 
-   putchar(' '); 
-   putchar(state.flags & FLAG_D ? 'D' : ' '); 
-   putchar(state.flags & FLAG_I ? 'I' : ' '); 
-   putchar(state.flags & FLAG_Z ? 'Z' : ' '); 
-   putchar(state.flags & FLAG_C ? 'C' : ' '); 
-   putchar('\n'); 
-
-   printf("A:     %02X\n",state.a);
-   printf("X:     %02X\n",state.x);
-   printf("Y:     %02X\n",state.y);
-   printf("SP:    %02X\n",state.sp);
-}
-
-#if 0
-DETAILS OF THE VIC CHIP FROM
-http://www.zimmers.net/cbmpics/cbm/vic/memorymap.txt
-
-HEX       DECIMAL       DESCRIPTION
-
-9000-900F    36864-36879   Address of VIC chip registers
-9000     36864   bits 0-6 horizontal centering
-                           bit 7 sets interlace scan
-9001     36865   vertical centering
-9002     36866   bits 0-6 set # of columns
-                           bit 7 is part of video matrix address
-9003     36867   bits 1-6 set # of rows
-                           bit 0 sets 8x8 or 16x8 chars
-9004     36868   TV raster beam line
-9005     36869   bits 0-3 start of character memory
-                           (default = 0)
-                           bits 4-7 is rest of video address
-                           (default= F)
-                           BITS 3,2,1,0 CM startinq address
-                                        HEX   DEC
-                           0000   ROM   8000  32768
-                           0001         8400  33792
-                           0010         8800  34816
-                           0011         8C00  35840
-                           1000   RAM   0000  0000
-                           1001 xxxx
-                           1010 xxxx  unavail.
-                           1011 xxxx
-                           1100         1000  4096
-                           1101         1400  5120
-                           1110         1800  6144
-                           1111         1C00  7168
-
-9006     36870    horizontal position of light pen
-9007     36871    vertical position of light pen
-9008     36872    Digitized value of paddle X
-9009     36873    Digitized value of paddle Y
-900A     36874    Frequency for oscillator 1 (low)
-                  (on: 128-255)
-900B     36875    Frequency for oscillator 2 (medium)
-                  (on: 128-255)
-900C     36876    Frequency for oscillator 3 (high)
-                  (on: 128-255)
-900D     36877    Frequency of noise source
-900E     36878    bit 0-3 sets volume of all sound
-                  bits 4-7 are auxiliary color information
-900F     36879    Screen and border color register
-                   bits 4-7 select background color
-                   bits 0-2 select border color
-                   bit 3 selects inverted or normal mode
-
-#endif
-static uint8_t vic_read(uint16_t addr) {
-   assert(addr < 0x10);
-   return vic[addr];
-}
-static void vic_write(uint16_t addr, uint8_t data) {
-   printf("VIC write %04X %02X\n",addr,data);
-   vic[addr] = data;
-   assert(addr < 0x10);
 }
 
-/*****************************************************************/
-static uint8_t via1_read(uint16_t addr) {
-   assert(addr < 0x20);
-   return 0;
-}
-static void via1_write(uint16_t addr, uint8_t data) {
-   printf("VIA#1 write %04X %02X\n",addr,data);
-   assert(addr < 0x20);
-}
-/*****************************************************************/
-static uint8_t via2_read(uint16_t addr) {
-   assert(addr < 0x20);
-   return 0;
-}
-static void via2_write(uint16_t addr, uint8_t data) {
-   printf("VIA#2 write %04X %02X\n",addr,data);
-   assert(addr < 0x20);
-}
-/*****************************************************************/
-static uint8_t mem_read_nolog(uint16_t addr) {
-  uint8_t rtn;
-
-  if(addr < sizeof(ram)) 
-    rtn = ram[addr];
-  else if(addr >= 0x9000 && addr< 0x9010)
-    rtn = vic_read(addr-0x9000);
-  else if(addr >= 0x9110 && addr< 0x9120)
-    rtn = via1_read(addr-0x9110);
-  else if(addr >= 0x9120 && addr< 0x9130)
-    rtn = via2_read(addr-0x9110);
-  else if(addr >= 0x9400 && addr< 0x9800)
-    rtn = colour[addr-0x9400];
-  else if(addr < 0xC000) {
-    rtn = 0;
-  }
-  else if(addr < 0xE000) 
-    rtn =  rom1[addr-0xC000];
-  else if(addr <= 0xFFFF)
-    rtn =  rom2[addr-0xE000];
-  else  {
-    rtn = 0;
-  }
-  return rtn;
-}
 
-static uint8_t mem_read(uint16_t addr) {
-  uint8_t rtn = 0;
-  rtn = mem_read_nolog(addr);
-  if(trace_level & TRACE_RD)
-    logger_16_8("  Read ",addr, rtn);
-  return rtn;
+/* Sets up the memory map again, with the hooks each part of the emulator
+   puts on pages layered in the same order as ever: those of the VIC, the
+   watchpoints, the stopping point, then those for code, which unhook
+   themselves and so must be on top */
+static void mem_remap(void) {
+  mem_map_init();
+  vic_pages();
+  vic_map_pages();
+  bp_map_pages();
+  run_map_pages();
+  code_map_pages();
 }
 
-static uint8_t mem_fetch(uint16_t addr) {
-  uint8_t rtn = 0;
-  rtn = mem_read_nolog(addr);
-  state.pc++;
-  trace_fetch_len++;
-  if(trace_level & TRACE_FETCH)
-    logger_16_8("  Fetch",addr, rtn);
-  return rtn;
+/* Sets up the memory map, and forgets everything that was decoded from
+   memory, for when its contents have changed wholesale */
+static void mem_reset(void) {
+  block_reset();
+  mem_remap();
 }
 
-static void mem_write(uint16_t addr, uint8_t data) {
-  if(trace_level & TRACE_WR)
-    logger_16_8("  Write", addr, data);
+/* For when the VIC is moved to other memory */
+static void vic_remap(void) {
+  if(!vic_pages())
+    return;
+  mem_remap();
+  cpu_break();
+}
+
+/*****************************************************************
+* Save states
+*
+* A save state is a struct saved_state written out as it is, so
+* saving is one write() and restoring is one mmap() and a few
+* copies. The registers are kept in a fixed form rather than as the
+* lazy flags of cpu_state, so the interpreter is free to change. The
+* ROMs are not saved, only their CRC-32s, which have to match the
+* ROMs of the machine it is restored into. Save states are only good
+* on hosts with the same byte order, which the header checks too.
+*
+* Anything added to the machine that a program can see has to be
+* added here, with STATE_VERSION bumped.
+*****************************************************************/
+#define STATE_MAGIC       "em6502\x1a"
+#define STATE_VERSION     2
+#define STATE_BYTE_ORDER  0x01020304
+
+struct saved_state {
+  char     magic[8];
+  uint32_t version;
+  uint32_t size;             // of the whole save state
+  uint32_t byte_order;       // STATE_BYTE_ORDER, as the host stores it
+  uint32_t rom_crc[3];       // $C000, $E000 and $8000
+  uint64_t cycle;
+  uint64_t instructions;
+  uint16_t pc;
+  uint8_t  a;
+  uint8_t  x;
+  uint8_t  y;
+  uint8_t  sp;
+  uint8_t  flags;
+  uint8_t  nmi_pending;
+  uint8_t  vic[16];
+  struct via via[2];
+  uint8_t  colour[1024];
+  uint8_t  ram[1024*16];
+};
 
-  if(addr < sizeof(ram))  {
-      ram[addr] = data;
-      return;
+static void state_save(struct saved_state *s) {
+  memcpy(s->magic, STATE_MAGIC, sizeof(s->magic));
+  s->version      = STATE_VERSION;
+  s->size         = sizeof(*s);
+  s->byte_order   = STATE_BYTE_ORDER;
+  memcpy(s->rom_crc, em->rom_crc, sizeof(s->rom_crc));
+  s->cycle        = em->state.cycle;
+  s->instructions = em->state.instructions;
+  s->pc           = em->state.pc;
+  s->a            = em->state.a;
+  s->x            = em->state.x;
+  s->y            = em->state.y;
+  s->sp           = em->state.sp;
+  s->flags        = cpu_flags();
+  s->nmi_pending  = em->nmi_pending;
+  memcpy(s->vic,    em->vic,    sizeof(s->vic));
+  memcpy(s->via,    em->via,    sizeof(s->via));
+  memcpy(s->colour, em->colour, sizeof(s->colour));
+  memcpy(s->ram,    em->ram,    sizeof(s->ram));
+}
+
+static int state_restore(const struct saved_state *s, size_t size) {
+  if(size < sizeof(*s) || memcmp(s->magic, STATE_MAGIC, sizeof(s->magic)) != 0) {
+    fprintf(stderr, "Not a save state\n");
+    return 0;
   }
-  if(addr >= 0x9000 && addr< 0x9010) {
-    vic_write(addr-0x9000, data);
-    return;
+  if(s->byte_order != STATE_BYTE_ORDER || s->version != STATE_VERSION || s->size != sizeof(*s)) {
+    fprintf(stderr, "Save state version %u is not supported\n", (unsigned)s->version);
+    return 0;
   }
-
-  if(addr >= 0x9110 && addr< 0x9120) {
-    via1_write(addr-0x9110, data);
-    return;
+  if(memcmp(s->rom_crc, em->rom_crc, sizeof(s->rom_crc)) != 0) {
+    fprintf(stderr, "Save state was made with other ROMs\n");
+    return 0;
   }
-
-  if(addr >= 0x9120 && addr< 0x9130) {
-    via2_write(addr-0x9110, data);
-    return;
+  memcpy(em->vic,    s->vic,    sizeof(em->vic));
+  memcpy(em->via,    s->via,    sizeof(em->via));
+  memcpy(em->colour, s->colour, sizeof(em->colour));
+  memcpy(em->ram,    s->ram,    sizeof(em->ram));
+  mem_reset();
+  em->state.cycle        = s->cycle;
+  em->state.instructions = s->instructions;
+  em->state.pc           = s->pc;
+  em->state.a            = s->a;
+  em->state.x            = s->x;
+  em->state.y            = s->y;
+  em->state.sp           = s->sp;
+  cpu_set_flags(s->flags);
+  em->cpu_stopped = NULL;
+  em->nmi_pending  = s->nmi_pending;
+  em->history_next = 0;
+  vic_reset();
+  event_reset();
+  return 1;
+}
+
+#include "em6502_tracefile.h"
+
+/*****************************************************************
+* The library interface, see em6502.h
+*****************************************************************/
+static pthread_once_t alu_once = PTHREAD_ONCE_INIT;
+
+em6502 *em6502_create(void) {
+  struct em6502 *m = calloc(1, sizeof(*m));
+  if(m == NULL)
+    return NULL;
+  m->block_cache = calloc(BLOCK_CACHE, sizeof(m->block_cache[0]));
+  m->breakpoints = calloc(MAX_BREAKPOINTS, sizeof(m->breakpoints[0]));
+  m->vic_live    = calloc(1, sizeof(m->vic_live[0]));
+  m->vic_done    = calloc(1, sizeof(m->vic_done[0]));
+  m->history     = calloc(HISTORY_SIZE, sizeof(m->history[0]));
+#if EM6502_JIT
+  m->jit_stats   = calloc(1, sizeof(m->jit_stats[0]));
+  if(m->jit_stats == NULL) {
+    em6502_destroy(m);
+    return NULL;
   }
-
-  if(addr >= 0x9400 && addr< 0x9800) {
-    colour[addr-0x9400] = data;
+#endif
+  if(m->block_cache == NULL || m->breakpoints == NULL ||
+     m->vic_live == NULL || m->vic_done == NULL || m->history == NULL) {
+    em6502_destroy(m);
+    return NULL;
+  }
+  pthread_once(&alu_once, alu_init);
+
+  em = m;
+  m->state.z_res    = 1;
+  m->run_exit_pc    = -1;
+  m->run_match_addr = -1;
+  m->cpu_run_cycles = cpu_run_cycles_fast;
+  mem_map_init();
+  block_flush();
+  vic_reset();
+  event_reset();
+  return m;
+}
+
+void em6502_destroy(em6502 *m) {
+  if(m == NULL)
     return;
+  em = m;
+  if(m->tracefile)
+    tracefile_close();
+  if(m->profile_file)
+    profile_write(m->profile_file);
+#if EM6502_JIT
+  if(m->jit_buffer)
+    munmap(m->jit_buffer, JIT_BUFFER_SIZE);
+  free(m->jit_stats);
+#endif
+  free(m->vic_live);
+  free(m->vic_done);
+  free(m->history);
+  free(m->profile);
+  free(m->breakpoints);
+  free(m->block_cache);
+  em = NULL;
+  free(m);
+}
+
+int em6502_load_rom(em6502 *m, uint16_t base, const uint8_t *data, size_t size) {
+  const uint8_t **slot;
+  size_t expected;
+  int index;
+  em = m;
+  switch(base) {
+    case 0xC000: slot = &m->rom1; index = 0; expected = ROM_C000_SIZE; break;
+    case 0xE000: slot = &m->rom2; index = 1; expected = ROM_E000_SIZE; break;
+    case 0x8000: slot = &m->rom3; index = 2; expected = ROM_8000_SIZE; break;
+    default:
+      fprintf(stderr, "No ROM goes at %04X\n", base);
+      return 0;
   }
-
-//  if(addr != 0x4000) {
-    logger_16_8("Write to unmapped address", addr, data);
-//    trace_level |= TRACE_OP;
-//  }
+  if(size != expected) {
+    fprintf(stderr, "The ROM at %04X should be %u bytes, not %lu\n",
+            base, (unsigned)expected, (unsigned long)size);
+    return 0;
+  }
+  *slot = data;
+  m->rom_crc[index] = crc32(data, size);
+  return 1;
+}
+
+void em6502_reset(em6502 *m) {
+  em = m;
+  mem_reset();
+  cpu_reset();
+  vic_reset();
+  via_reset(&m->via[0]);
+  via_reset(&m->via[1]);
+  m->nmi_pending  = 0;
+  m->history_next = 0;
+  event_reset();
+}
+
+int em6502_run(em6502 *m, uint64_t cycles) {
+  uint64_t end;
+  em = m;
+  end = m->state.cycle + cycles;
+  m->cpu_stopped = NULL;
+  /* Each batch runs to the next event, or the end. A batch can end
+     early, after a change of trace level for one. */
+  event_run();
+  while(m->state.cycle < end) {
+    uint64_t until = event_next() < end ? event_next() : end;
+    uint64_t left  = until - m->state.cycle;
+    if(!m->cpu_run_cycles(left > UINT32_MAX ? UINT32_MAX : left))
+      return 0;
+    event_run();
+  }
+  return 1;
 }
 
-static void trace(char *msg) {
-  int i;
-  uint8_t inst;
-  if(!(trace_level & TRACE_OP))
-     return;
+const char *em6502_stop_reason(em6502 *m) {
+  return m->cpu_stopped;
+}
 
-  inst = mem_read_nolog(trace_addr);
-  printf("%10i %04X: %02X ", state.cycle, trace_addr, inst);
+uint8_t em6502_read(em6502 *m, uint16_t addr) {
+  em = m;
+  return mem_read_nolog(addr);
+}
 
-  for(i = 1; i < trace_fetch_len; i++) {
-    printf("%02X ", mem_read_nolog(trace_addr+i));
-  }
+void em6502_write(em6502 *m, uint16_t addr, uint8_t data) {
+  em = m;
+  mem_write_nolog(addr, data);
+}
 
-  while(i < 4) {
-    printf("   ");
-    i++;
-  }
-#if 1
-  printf("%02X %02X %02X ",state.a, state.x, state.y);
-  if(state.flags & FLAG_N) 
-    printf("N");
-  else
-    printf(" ");
+void em6502_get_regs(em6502 *m, struct em6502_regs *regs) {
+  em = m;
+  regs->pc           = m->state.pc;
+  regs->a            = m->state.a;
+  regs->x            = m->state.x;
+  regs->y            = m->state.y;
+  regs->sp           = m->state.sp;
+  regs->flags        = cpu_flags();
+  regs->cycle        = m->state.cycle;
+  regs->instructions = m->state.instructions;
+}
 
-  if(state.flags & FLAG_Z) 
-    printf("Z");
-  else
-    printf(" ");
+void em6502_set_regs(em6502 *m, const struct em6502_regs *regs) {
+  em = m;
+  m->state.pc = regs->pc;
+  m->state.a  = regs->a;
+  m->state.x  = regs->x;
+  m->state.y  = regs->y;
+  m->state.sp = regs->sp;
+  cpu_set_flags(regs->flags);
+}
 
-  if(state.flags & FLAG_C) 
-    printf("C ");
-  else
-    printf("  ");
+int em6502_enable_jit(em6502 *m) {
+  em = m;
+#if EM6502_JIT
+  if(!m->jit_enabled && jit_init()) {
+    m->jit_enabled = 1;
+    block_flush();
+  }
+  return m->jit_enabled;
+#else
+  printf("The JIT is not available in this build\n");
+  return 0;
 #endif
-
-  printf(msg, trace_num);
-  printf("\n");
 }
 
-void border_pixel(FILE *f) {
-   putc(64,f);
-   putc(64,f);
-   putc(255,f);
+void em6502_trace(em6502 *m, int level) {
+  em = m;
+  trace_set(level);
 }
 
-uint8_t colours[16][3] = {
-   {  0,  0,  0},   //BLACK            000
-   {255,255,255},   //WHITE            001
-   {255,  0,  0},   //RED              010
-   {  0,255,255},   //CYAN             011
-   {255,  0,255},   //PURPLE           100
-   {  0,255,  0},   //GREEN            101
-   {  0,  0,255},   //BLUE             110
-   {255,255,  0},   //YELLOW           111
-   {255,128,  0},   //    8 - 1000   Orange
-   {255,192, 64},   //    9 - 1001   Light orange
-   {255,128,128},   //    10 - 1010   Pink
-   {128,255,255},   //    11 - 1011   Light cyan
-   {255,128,255},   //    12 - 1100   Light purple
-   {128,255,128},   //    13 - 1101   Light green
-   {128,128,255},   //    14 - 1110   Light blue
-   {255,255,128},   //    15 - 1111   Light yellow
-};
-
-uint16_t vram_lookup[32] = {
-    0x8000, 0x8200, 0x8400, 0x8600, 0x8800, 0x8A00, 0x8C00, 0x8E00,
-    0x9000, 0x9200, 0x9400, 0x9600, 0x9800, 0x9A00, 0x9C00, 0x9E00,
-    0xE000, 0x0200, 0x0400, 0x0600, 0x0800, 0x0A00, 0x0C00, 0x0E00,
-    0x1000, 0x1200, 0x1400, 0x1600, 0x1800, 0x1A00, 0x1C00, 0x1E00
-};
+int em6502_trace_file(em6502 *m, const char *filename, const char *filter) {
+  em = m;
+  if(!tracefile_close())
+    return 0;
+  return filename ? tracefile_open(filename, filter) : 1;
+}
 
-void pixel(FILE *f, int colour) {
-   putc(colours[colour][0],f);
-   putc(colours[colour][1],f);
-   putc(colours[colour][2],f);
+int em6502_print_trace(const char *filename, uint64_t cycle, uint64_t count) {
+  return tracefile_print(filename, cycle, count);
 }
 
-void show_display(void) {
-   int i, j;
-   FILE *f = fopen("display.ppm", "wb");
-   if(f == NULL)
-     return;
-   int width  = 12+22*8+12;
-   int height = 38+23*8+38;
-   fprintf(f,"P6\n%i %i\n255\n", width, height);
-
-   uint16_t colour_ram_addr;
-   uint16_t video_ram_addr;
-   int bg_colour = mem_read_nolog(0x900F)>>4;
-   int bd_colour = mem_read_nolog(0x900F)&0x7;
-   int hoz_pos   = mem_read_nolog(0x9000)&0x7F; 
-   int vert_pos  = mem_read_nolog(0x9001); 
-
-   if(hoz_pos >= 24) hoz_pos = 24;
-
-   video_ram_addr  = (mem_read_nolog(0x9005)&0xF0)>>3; // 4 bits
-   video_ram_addr += (mem_read_nolog(0x9002)&0x80)>>7; // 1 bit
-   video_ram_addr = vram_lookup[video_ram_addr];   
-   video_ram_addr = 0x1000;  // TODO: Something odd with this = override computed value
-
-   if(mem_read_nolog(0x9002) & 0x80) 
-      colour_ram_addr = 0x9600;
-   else 
-      colour_ram_addr = 0x9400;
-   
-   for(i = 0; i < height; i++) {
-      if(i < vert_pos || i >= vert_pos+23*8) {
-         // Top or bottom frame
-         for(j = 0; j < width; j++) {
-            pixel(f, bd_colour);
-         }
-      } else {
-         // Left frame
-         for(j = 0; j < hoz_pos; j++) {
-            pixel(f, bd_colour);
-         }
+int em6502_add_breakpoint(em6502 *m, const char *spec) {
+  em = m;
+  return bp_add(spec);
+}
 
-         // Center
-         for(j = 0; j < 22*8 && j+hoz_pos < width; j++) {
-            int offset = ((i-vert_pos)>>3)*22+(j>>3);
-            int line = (i-vert_pos)&7;
-            int col  = j&7; 
-            char glyph = mem_read_nolog(video_ram_addr+offset);
-            int fg_colour = mem_read_nolog(colour_ram_addr+offset) & 0x7;
-            uint8_t byte = rom3[glyph*8+line];
-            uint8_t mask = 0x80 >> col;
-
-            pixel(f, (byte&mask) ? fg_colour : bg_colour);
-         }
+void em6502_stop_at(em6502 *m, uint16_t pc) {
+  m->run_exit_pc = pc;
+}
 
-         // Right frame
-         for(j = 0; j < width-22*8-hoz_pos; j++) {
-            pixel(f, bd_colour);
-         }
-      }
-   } 
-   fclose(f);
+void em6502_stop_on_write(em6502 *m, uint16_t addr, uint8_t value) {
+  m->run_match_addr  = addr;
+  m->run_match_value = value;
 }
 
-static void print_dispatched(void) {
-  printf("  0 1 2 3 4 5 6 7 8 9 A B C D E F\n");
-  for(int i = 0; i <256; i++) {
-    if((i&0xf)==0) {
-       printf("%1x",i>>4);
+int em6502_profile(em6502 *m, const char *filename) {
+  em = m;
+  if(m->profile == NULL) {
+    m->profile = calloc(PROFILE_SIZE, sizeof(m->profile[0]));
+    if(m->profile == NULL) {
+      fprintf(stderr, "Unable to allocate the profile\n");
+      return 0;
     }
-    putchar(' ');
-    putchar(dispatched[i] ^ dispatched1[i] ? 'X' : '-');
-    if((i&0xf) == 0xF)
-      putchar('\n');
   }
-  putchar('\n');
+  m->profile_file = filename;
+  cpu_select();
+  return 1;
 }
 
-static int cpu_run(void) {
-   uint8_t inst;
+void em6502_dump(em6502 *m) {
+  em = m;
+  cpu_dump();
+}
 
-   if(state.pc == 0xDDCD) {
-      memset(dispatched, 0, 256);
-      trace_level = TRACE_OP;
-   } else if(state.pc == 0xDDDA) {
-      print_dispatched();
-      trace_level = TRACE_OFF;
-      sleep(1);
-   } 
-   trace_addr   = state.pc; 
-   trace_fetch_len    = 0;
-   inst         = mem_fetch(state.pc);
-   trace_opcode = inst;
-   if(dispatch[inst]==0) {
-      logger_16_8("Unknown opcode at address",trace_addr, inst);
-      cpu_dump();
-      show_display(); 
-      return 0;
-   }
-   dispatched[inst] = 1;
-   dispatch[inst]();
-   return 1;
+void em6502_dump_zeropage(em6502 *m) {
+  em = m;
+  zeropage_dump();
 }
 
-static void cpu_reset(void) {
-   trace("RESET triggerd");
-   state.sp     = 0xFD;   
-   state.pc     = mem_read(0xFFFC);
-   state.pc    |= mem_read(0xFFFD)<<8;   
-   state.flags |= FLAG_I;
-   state.cycle  = 0;   
+void em6502_dump_history(em6502 *m) {
+  em = m;
+  history_dump();
 }
 
-static int rom1_load() {
-   FILE *f = fopen("rom1.img","rb");
-   if(f == NULL) {
-      fprintf(stderr, "Unable to open 'rom1.img'\n");
-      return 0;
-   }
-   if(fread(rom1,8192,1,f) != 1) {
-      fclose(f);
-      return 0;
-   }
-   fclose(f);
-   printf("ROM1 loaded\n");
-   return 1;
+void em6502_print_stats(em6502 *m) {
+  em = m;
+#if EM6502_JIT
+  if(m->jit_enabled)
+    jit_report();
+#endif
+  if(m->idle_cycles)
+    printf("Idle loops skipped %llu cycles\n", (unsigned long long)m->idle_cycles);
+}
+
+int em6502_get_frame(em6502 *m, struct em6502_display *d) {
+  int changed;
+  em = m;
+  vic_catch_up();
+  memcpy(d, m->vic_done, sizeof(*d));
+  changed = m->vic_serial != m->vic_taken;
+  m->vic_taken = m->vic_serial;
+  return changed;
+}
+
+void em6502_on_frame(em6502 *m, void (*fn)(void *ctx), void *ctx) {
+  em = m;
+  m->frame_fn  = fn;
+  m->frame_ctx = ctx;
+  if(fn)
+    event_set(EV_FRAME, (m->state.cycle / EM6502_FRAME_CYCLES + 1) * EM6502_FRAME_CYCLES);
+  else
+    event_cancel(EV_FRAME);
 }
 
-static int rom2_load() {
-   FILE *f = fopen("rom2.img","rb");
-   if(f == NULL) {
-      fprintf(stderr, "Unable to open 'rom2.img'\n");
-      return 0;
-   }
-   if(fread(rom2,8192,1,f) != 1) {
-      fclose(f);
-      return 0;
-   }
-   fclose(f);
-   printf("ROM2 loaded\n");
-   return 1;
+int em6502_save_display(em6502 *m, const char *filename) {
+  em = m;
+  return show_display(filename);
 }
 
-static int rom3_load() {
-   FILE *f = fopen("rom3.img","rb");
-   if(f == NULL) {
-      fprintf(stderr, "Unable to open 'rom3.img'\n");
-      return 0;
-   }
-   if(fread(rom3,4096,1,f) != 1) {
-      fclose(f);
-      return 0;
-   }
-   fclose(f);
-   printf("ROM3 loaded\n");
-   return 1;
+uint32_t em6502_crc32(const uint8_t *data, size_t len) {
+  return crc32(data, len);
 }
 
-static void zeropage_dump(void) {
-   int i;
-   printf("   ");
-   for(i = 0; i < 16; i++) {
-     printf(" %02X",i);
-   }
+size_t em6502_state_size(void) {
+  return sizeof(struct saved_state);
+}
 
-   for(i = 0; i < 256; i++) {
-     if((i&0xF)==0) {
-       printf("\n%02X:",i);
-     }
-     printf(" %02X",ram[i]);
-   }
-   printf("\n");
+int em6502_save_state_data(em6502 *m, void *data, size_t size) {
+  em = m;
+  if(size < sizeof(struct saved_state))
+    return 0;
+  state_save(data);
+  return 1;
 }
 
-static void sighandler_usr1(int v) {
-   cpu_dump();
-   zeropage_dump();
+int em6502_restore_state_data(em6502 *m, const void *data, size_t size) {
+  em = m;
+  return state_restore(data, size);
 }
 
-int main(int argc, char *argv[]) {
-   if(argc != 1 && argc != 3) {
-      printf("Unknown opton\n");
-      exit(1);
-   }
-   if(argc == 3)  {
-      if(strcmp(argv[1],"-v")!=0) {
-         printf("Unknown opton\n");
-         exit(1);
-      }
-      trace_level = atoi(argv[2]);
-   }
-   signal(SIGUSR1, sighandler_usr1);
-
-   if(rom1_load() && rom2_load() && rom3_load()) {
-      cpu_reset();
-      while(cpu_run()) {
-         if(state.cycle - last_display > 3000000) {
-            show_display();
-            last_display = state.cycle;
-         }
-      }
-      if(0)
-        logger_8("remove warning for unused logger_8()",0);
-   }
-   return 0;
+int em6502_save_state(em6502 *m, const char *filename) {
+  struct saved_state s;
+  ssize_t written;
+  int fd;
+
+  em = m;
+  state_save(&s);
+  fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "Unable to write '%s'\n", filename);
+    return 0;
+  }
+  written = write(fd, &s, sizeof(s));
+  if(close(fd) != 0 || written != sizeof(s)) {
+    fprintf(stderr, "Unable to write '%s'\n", filename);
+    return 0;
+  }
+  return 1;
+}
+
+int em6502_restore_state(em6502 *m, const char *filename) {
+  struct stat st;
+  void *data;
+  int fd, ok;
+
+  em = m;
+  fd = open(filename, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Unable to open '%s'\n", filename);
+    if(fd >= 0)
+      close(fd);
+    return 0;
+  }
+  data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if(data == MAP_FAILED) {
+    fprintf(stderr, "Not a save state\n");
+    return 0;
+  }
+  ok = state_restore(data, st.st_size);
+  munmap(data, st.st_size);
+  return ok;
 }
@@ -0,0 +1,114 @@
+/********************************************************************************
+* libem6502 - the VIC-20 emulator as a library
+*
+* Each em6502 is a whole machine: CPU, RAM, I/O chips, block cache and JIT.
+* Machines share no mutable state, so any number can be run at once from
+* different threads, as long as each machine is only used by one thread at
+* a time. ROM images are borrowed rather than copied and are never written,
+* so one copy can be loaded into every machine.
+*
+* A machine starts with RAM cleared and no ROMs. Load the ROMs, set up any
+* breakpoints and stopping points, then call em6502_reset() to map memory
+* and start the CPU from the reset vector.
+*
+* Functions that can fail return 0 and print why.
+********************************************************************************/
+#ifndef EM6502_H
+#define EM6502_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct em6502 em6502;
+
+struct em6502_regs {
+  uint16_t pc;
+  uint8_t  a;
+  uint8_t  x;
+  uint8_t  y;
+  uint8_t  sp;
+  uint8_t  flags;          // NV-BDIZC
+  uint64_t cycle;          // since reset, read only
+  uint64_t instructions;   // since reset, read only
+};
+
+em6502 *em6502_create(void);
+void    em6502_destroy(em6502 *m);
+
+/* Maps a ROM image at $8000 (4K), $C000 or $E000 (8K each), from the next
+   em6502_reset(). The data must outlive the machine. */
+int     em6502_load_rom(em6502 *m, uint16_t base, const uint8_t *data, size_t size);
+void    em6502_reset(em6502 *m);
+
+/* Runs for at least 'cycles' cycles. Returns 0 if emulation stopped first,
+   with the reason from em6502_stop_reason(): "fault" for an unknown
+   opcode, "breakpoint", "pc" or "memory". */
+int         em6502_run(em6502 *m, uint64_t cycles);
+const char *em6502_stop_reason(em6502 *m);
+
+/* Memory accesses go through the memory map, as the CPU's would */
+uint8_t em6502_read(em6502 *m, uint16_t addr);
+void    em6502_write(em6502 *m, uint16_t addr, uint8_t data);
+void    em6502_get_regs(em6502 *m, struct em6502_regs *regs);
+void    em6502_set_regs(em6502 *m, const struct em6502_regs *regs);
+
+/* Save states hold the registers, RAM and I/O chips, and the CRC-32s of the
+   ROMs, which must match the machine's own when restoring. Restoring maps
+   the file rather than reading it. The _data forms work on a buffer of
+   em6502_state_size() bytes instead, to restore the same state many times
+   without going near the file system. */
+int     em6502_save_state(em6502 *m, const char *filename);
+int     em6502_restore_state(em6502 *m, const char *filename);
+size_t  em6502_state_size(void);
+int     em6502_save_state_data(em6502 *m, void *data, size_t size);
+int     em6502_restore_state_data(em6502 *m, const void *data, size_t size);
+
+/* Diagnostics. Breakpoints take the form of the -b option, and, like the
+   stopping points, take effect from the next em6502_reset(). The profile
+   is written to its file by em6502_destroy(). */
+int     em6502_enable_jit(em6502 *m);
+void    em6502_trace(em6502 *m, int level);
+int     em6502_add_breakpoint(em6502 *m, const char *spec);
+void    em6502_stop_at(em6502 *m, uint16_t pc);
+void    em6502_stop_on_write(em6502 *m, uint16_t addr, uint8_t value);
+int     em6502_profile(em6502 *m, const char *filename);
+
+/* Binary traces, for long runs. em6502_trace_file() records what the CPU
+   does from now on into 'filename', or finishes the file for NULL. The
+   filter is NULL for everything, or a PC range and a list of the kinds of
+   record, 'ops', 'reads', 'writes' and 'irqs', either part optional, as in
+   "E000-FFFF ops,writes". Recording uses the diagnostic interpreter, and
+   is best started after em6502_reset() and any restore. A trace is
+   finished by em6502_destroy() too. em6502_print_trace() prints 'count'
+   instructions of a trace from 'cycle' on, on stdout. */
+int     em6502_trace_file(em6502 *m, const char *filename, const char *filter);
+int     em6502_print_trace(const char *filename, uint64_t cycle, uint64_t count);
+
+/* Reports, on stdout */
+void    em6502_dump(em6502 *m);
+void    em6502_dump_zeropage(em6502 *m);
+void    em6502_dump_history(em6502 *m);   // the last instructions run
+void    em6502_print_stats(em6502 *m);
+
+/* The display. The VIC draws the picture a line at a time as the machine
+   runs, and em6502_get_frame() copies out the last whole frame, returning
+   1 if it differs from the one the previous call got. A frame takes
+   EM6502_FRAME_CYCLES, 50 a second. em6502_save_display() writes the last
+   whole frame as a PPM file. em6502_on_frame() has 'fn' called from
+   em6502_run() as each frame is finished, NULL for never. */
+#define EM6502_DISPLAY_WIDTH   200
+#define EM6502_DISPLAY_HEIGHT  260
+#define EM6502_FRAME_CYCLES    (71*312)
+
+struct em6502_display {
+  uint8_t rgb[EM6502_DISPLAY_HEIGHT][EM6502_DISPLAY_WIDTH][3];
+};
+
+int     em6502_get_frame(em6502 *m, struct em6502_display *d);
+int     em6502_save_display(em6502 *m, const char *filename);
+void    em6502_on_frame(em6502 *m, void (*fn)(void *ctx), void *ctx);
+
+/* The CRC-32 used for ROM identities, as in zip and PNG */
+uint32_t em6502_crc32(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,454 @@
+/********************************************************************************
+* Benchmarks
+*
+* './em6502 -k <name>' runs one of these 6502 kernels, or all of them with
+* 'all', for a fixed number of cycles with whichever interpreter the other
+* options pick, and prints the host time per emulated instruction and the
+* emulated clock rate. They run from RAM at BENCH_CODE and need no ROMs.
+*
+* Each kernel is an endless loop. Every trip round it writes its results to
+* BENCH_RESULT and then counts itself at BENCH_COUNT, so however many cycles
+* it gets, the results it leaves are those of its last whole trip. They are
+* checked against the CRC-32 of results worked out outside the emulator, so an
+* interpreter that goes wrong shows up as a failed benchmark.
+********************************************************************************/
+#define BENCH_CODE    0x0400
+#define BENCH_RESULT  0x0300
+#define BENCH_COUNT   0x0310
+#define BENCH_CYCLES  100000000
+#define BENCH_RAM     0x4000     // cleared before each kernel
+
+/* Sieve of Eratosthenes over 4096 flags at $1000, then counts the primes */
+static const uint8_t bench_sieve[] = {
+  0xA9,0x00,       /* loop:   LDA #$00     */
+  0x85,0x10,       /*         STA $10      */
+  0xA9,0x10,       /*         LDA #$10     */
+  0x85,0x11,       /*         STA $11      */
+  0xA9,0x01,       /*         LDA #1       */
+  0xA0,0x00,       /*         LDY #0       */
+  0xA2,0x10,       /*         LDX #16      */
+  0x91,0x10,       /* fill:   STA ($10),Y  */
+  0xC8,            /*         INY          */
+  0xD0,0xFB,       /*         BNE fill     */
+  0xE6,0x11,       /*         INC $11      */
+  0xCA,            /*         DEX          */
+  0xD0,0xF6,       /*         BNE fill     */
+  0xA9,0x02,       /*         LDA #2       */
+  0x85,0x12,       /*         STA $12      */
+  0xA6,0x12,       /* outer:  LDX $12      */
+  0xBD,0x00,0x10,  /*         LDA $1000,X  */
+  0xF0,0x36,       /*         BEQ next     */
+  0xA9,0x00,       /*         LDA #0       */
+  0x85,0x14,       /*         STA $14      */
+  0x85,0x15,       /*         STA $15      */
+  0x18,            /* sq:     CLC          */
+  0xA5,0x14,       /*         LDA $14      */
+  0x65,0x12,       /*         ADC $12      */
+  0x85,0x14,       /*         STA $14      */
+  0xA5,0x15,       /*         LDA $15      */
+  0x69,0x00,       /*         ADC #0       */
+  0x85,0x15,       /*         STA $15      */
+  0xCA,            /*         DEX          */
+  0xD0,0xF0,       /*         BNE sq       */
+  0xA5,0x15,       /* inner:  LDA $15      */
+  0xC9,0x10,       /*         CMP #$10     */
+  0xB0,0x1A,       /*         BCS next     */
+  0x09,0x10,       /*         ORA #$10     */
+  0x85,0x17,       /*         STA $17      */
+  0xA5,0x14,       /*         LDA $14      */
+  0x85,0x16,       /*         STA $16      */
+  0xA9,0x00,       /*         LDA #0       */
+  0x91,0x16,       /*         STA ($16),Y  */
+  0x18,            /*         CLC          */
+  0xA5,0x14,       /*         LDA $14      */
+  0x65,0x12,       /*         ADC $12      */
+  0x85,0x14,       /*         STA $14      */
+  0x90,0xE5,       /*         BCC inner    */
+  0xE6,0x15,       /*         INC $15      */
+  0x4C,0x39,0x04,  /*         JMP inner    */
+  0xE6,0x12,       /* next:   INC $12      */
+  0xA5,0x12,       /*         LDA $12      */
+  0xC9,0x40,       /*         CMP #64      */
+  0xD0,0xBB,       /*         BNE outer    */
+  0xA9,0x00,       /*         LDA #0       */
+  0x8D,0x00,0x10,  /*         STA $1000    */
+  0x8D,0x01,0x10,  /*         STA $1001    */
+  0x85,0x18,       /*         STA $18      */
+  0x85,0x19,       /*         STA $19      */
+  0xA9,0x10,       /*         LDA #$10     */
+  0x85,0x11,       /*         STA $11      */
+  0xA2,0x10,       /*         LDX #16      */
+  0xB1,0x10,       /* cnt:    LDA ($10),Y  */
+  0xF0,0x06,       /*         BEQ skip     */
+  0xE6,0x18,       /*         INC $18      */
+  0xD0,0x02,       /*         BNE skip     */
+  0xE6,0x19,       /*         INC $19      */
+  0xC8,            /* skip:   INY          */
+  0xD0,0xF3,       /*         BNE cnt      */
+  0xE6,0x11,       /*         INC $11      */
+  0xCA,            /*         DEX          */
+  0xD0,0xEE,       /*         BNE cnt      */
+  0xA5,0x18,       /*         LDA $18      */
+  0x8D,0x00,0x03,  /*         STA $0300    */
+  0xA5,0x19,       /*         LDA $19      */
+  0x8D,0x01,0x03,  /*         STA $0301    */
+  0xEE,0x10,0x03,  /*         INC $0310    */
+  0xD0,0x03,       /*         BNE again    */
+  0xEE,0x11,0x03,  /*         INC $0311    */
+  0x4C,0x00,0x04,  /* again:  JMP loop     */
+};
+
+/* Fills 1K at $1000 with x = 5x+1 and takes its CRC-16/CCITT, a bit at a time */
+static const uint8_t bench_crc16[] = {
+  0xA9,0x00,       /* loop:   LDA #$00     */
+  0x85,0x10,       /*         STA $10      */
+  0x85,0x12,       /*         STA $12      */
+  0xA9,0x10,       /*         LDA #$10     */
+  0x85,0x11,       /*         STA $11      */
+  0xA2,0x04,       /*         LDX #4       */
+  0xA0,0x00,       /*         LDY #0       */
+  0xA5,0x12,       /* gen:    LDA $12      */
+  0x0A,            /*         ASL          */
+  0x0A,            /*         ASL          */
+  0x18,            /*         CLC          */
+  0x65,0x12,       /*         ADC $12      */
+  0x18,            /*         CLC          */
+  0x69,0x01,       /*         ADC #1       */
+  0x85,0x12,       /*         STA $12      */
+  0x91,0x10,       /*         STA ($10),Y  */
+  0xC8,            /*         INY          */
+  0xD0,0xEF,       /*         BNE gen      */
+  0xE6,0x11,       /*         INC $11      */
+  0xCA,            /*         DEX          */
+  0xD0,0xEA,       /*         BNE gen      */
+  0xA9,0xFF,       /*         LDA #$FF     */
+  0x85,0x14,       /*         STA $14      */
+  0x85,0x15,       /*         STA $15      */
+  0xA9,0x10,       /*         LDA #$10     */
+  0x85,0x11,       /*         STA $11      */
+  0xA9,0x04,       /*         LDA #4       */
+  0x85,0x13,       /*         STA $13      */
+  0xB1,0x10,       /* byte:   LDA ($10),Y  */
+  0x45,0x15,       /*         EOR $15      */
+  0x85,0x15,       /*         STA $15      */
+  0xA2,0x08,       /*         LDX #8       */
+  0x06,0x14,       /* bit:    ASL $14      */
+  0x26,0x15,       /*         ROL $15      */
+  0x90,0x0C,       /*         BCC nox      */
+  0xA5,0x14,       /*         LDA $14      */
+  0x49,0x21,       /*         EOR #$21     */
+  0x85,0x14,       /*         STA $14      */
+  0xA5,0x15,       /*         LDA $15      */
+  0x49,0x10,       /*         EOR #$10     */
+  0x85,0x15,       /*         STA $15      */
+  0xCA,            /* nox:    DEX          */
+  0xD0,0xEB,       /*         BNE bit      */
+  0xC8,            /*         INY          */
+  0xD0,0xE0,       /*         BNE byte     */
+  0xE6,0x11,       /*         INC $11      */
+  0xC6,0x13,       /*         DEC $13      */
+  0xD0,0xDA,       /*         BNE byte     */
+  0xA5,0x14,       /*         LDA $14      */
+  0x8D,0x00,0x03,  /*         STA $0300    */
+  0xA5,0x15,       /*         LDA $15      */
+  0x8D,0x01,0x03,  /*         STA $0301    */
+  0xEE,0x10,0x03,  /*         INC $0310    */
+  0xD0,0x03,       /*         BNE again    */
+  0xEE,0x11,0x03,  /*         INC $0311    */
+  0x4C,0x00,0x04,  /* again:  JMP loop     */
+};
+
+/* Fills 4K at $1000 a page at a time, copies it to $2000 and adds it up */
+static const uint8_t bench_memcpy[] = {
+  0xA9,0x00,       /* loop:   LDA #$00     */
+  0x85,0x10,       /*         STA $10      */
+  0x85,0x12,       /*         STA $12      */
+  0xA9,0x10,       /*         LDA #$10     */
+  0x85,0x11,       /*         STA $11      */
+  0xA0,0x00,       /*         LDY #0       */
+  0xA2,0x10,       /*         LDX #16      */
+  0x8A,            /* page:   TXA          */
+  0x91,0x10,       /* set:    STA ($10),Y  */
+  0xC8,            /*         INY          */
+  0xD0,0xFB,       /*         BNE set      */
+  0xE6,0x11,       /*         INC $11      */
+  0xCA,            /*         DEX          */
+  0xD0,0xF5,       /*         BNE page     */
+  0xA9,0x10,       /*         LDA #$10     */
+  0x85,0x11,       /*         STA $11      */
+  0xA9,0x20,       /*         LDA #$20     */
+  0x85,0x13,       /*         STA $13      */
+  0xA2,0x10,       /*         LDX #16      */
+  0xB1,0x10,       /* copy:   LDA ($10),Y  */
+  0x91,0x12,       /*         STA ($12),Y  */
+  0xC8,            /*         INY          */
+  0xD0,0xF9,       /*         BNE copy     */
+  0xE6,0x11,       /*         INC $11      */
+  0xE6,0x13,       /*         INC $13      */
+  0xCA,            /*         DEX          */
+  0xD0,0xF2,       /*         BNE copy     */
+  0xA9,0x00,       /*         LDA #0       */
+  0x85,0x14,       /*         STA $14      */
+  0x85,0x15,       /*         STA $15      */
+  0xA9,0x20,       /*         LDA #$20     */
+  0x85,0x13,       /*         STA $13      */
+  0xA2,0x10,       /*         LDX #16      */
+  0x18,            /* sum:    CLC          */
+  0xB1,0x12,       /*         LDA ($12),Y  */
+  0x65,0x14,       /*         ADC $14      */
+  0x85,0x14,       /*         STA $14      */
+  0x90,0x02,       /*         BCC nc       */
+  0xE6,0x15,       /*         INC $15      */
+  0xC8,            /* nc:     INY          */
+  0xD0,0xF2,       /*         BNE sum      */
+  0xE6,0x13,       /*         INC $13      */
+  0xCA,            /*         DEX          */
+  0xD0,0xED,       /*         BNE sum      */
+  0xA5,0x14,       /*         LDA $14      */
+  0x8D,0x00,0x03,  /*         STA $0300    */
+  0xA5,0x15,       /*         LDA $15      */
+  0x8D,0x01,0x03,  /*         STA $0301    */
+  0xEE,0x10,0x03,  /*         INC $0310    */
+  0xD0,0x03,       /*         BNE again    */
+  0xEE,0x11,0x03,  /*         INC $0311    */
+  0x4C,0x00,0x04,  /* again:  JMP loop     */
+};
+
+/* Adds 1 to 9999 in decimal mode, and subtracts 12345678 from the total */
+static const uint8_t bench_bcd[] = {
+  0xF8,            /* loop:   SED          */
+  0xA9,0x00,       /*         LDA #0       */
+  0x85,0x10,       /*         STA $10      */
+  0x85,0x11,       /*         STA $11      */
+  0x85,0x12,       /*         STA $12      */
+  0x85,0x13,       /*         STA $13      */
+  0x85,0x14,       /*         STA $14      */
+  0x85,0x15,       /*         STA $15      */
+  0x18,            /* add:    CLC          */
+  0xA5,0x14,       /*         LDA $14      */
+  0x69,0x01,       /*         ADC #1       */
+  0x85,0x14,       /*         STA $14      */
+  0xA5,0x15,       /*         LDA $15      */
+  0x69,0x00,       /*         ADC #0       */
+  0x85,0x15,       /*         STA $15      */
+  0x18,            /*         CLC          */
+  0xA5,0x10,       /*         LDA $10      */
+  0x65,0x14,       /*         ADC $14      */
+  0x85,0x10,       /*         STA $10      */
+  0xA5,0x11,       /*         LDA $11      */
+  0x65,0x15,       /*         ADC $15      */
+  0x85,0x11,       /*         STA $11      */
+  0xA5,0x12,       /*         LDA $12      */
+  0x69,0x00,       /*         ADC #0       */
+  0x85,0x12,       /*         STA $12      */
+  0xA5,0x13,       /*         LDA $13      */
+  0x69,0x00,       /*         ADC #0       */
+  0x85,0x13,       /*         STA $13      */
+  0xA5,0x14,       /*         LDA $14      */
+  0xC9,0x99,       /*         CMP #$99     */
+  0xD0,0xD4,       /*         BNE add      */
+  0xA5,0x15,       /*         LDA $15      */
+  0xC9,0x99,       /*         CMP #$99     */
+  0xD0,0xCE,       /*         BNE add      */
+  0x38,            /*         SEC          */
+  0xA5,0x10,       /*         LDA $10      */
+  0xE9,0x78,       /*         SBC #$78     */
+  0x8D,0x00,0x03,  /*         STA $0300    */
+  0xA5,0x11,       /*         LDA $11      */
+  0xE9,0x56,       /*         SBC #$56     */
+  0x8D,0x01,0x03,  /*         STA $0301    */
+  0xA5,0x12,       /*         LDA $12      */
+  0xE9,0x34,       /*         SBC #$34     */
+  0x8D,0x02,0x03,  /*         STA $0302    */
+  0xA5,0x13,       /*         LDA $13      */
+  0xE9,0x12,       /*         SBC #$12     */
+  0x8D,0x03,0x03,  /*         STA $0303    */
+  0xD8,            /*         CLD          */
+  0xEE,0x10,0x03,  /*         INC $0310    */
+  0xD0,0x03,       /*         BNE again    */
+  0xEE,0x11,0x03,  /*         INC $0311    */
+  0x4C,0x00,0x04,  /* again:  JMP loop     */
+};
+
+/* Fibonacci(18) by recursive JSRs, and 1+2+...+80 recursing 80 deep */
+static const uint8_t bench_recurse[] = {
+  0xA9,0x00,       /* loop:   LDA #0       */
+  0x85,0x10,       /*         STA $10      */
+  0x85,0x11,       /*         STA $11      */
+  0x85,0x12,       /*         STA $12      */
+  0x85,0x13,       /*         STA $13      */
+  0xA2,0x12,       /*         LDX #18      */
+  0x20,0x33,0x04,  /*         JSR fib      */
+  0xA2,0x50,       /*         LDX #80      */
+  0x20,0x4D,0x04,  /*         JSR tri      */
+  0xA5,0x10,       /*         LDA $10      */
+  0x8D,0x00,0x03,  /*         STA $0300    */
+  0xA5,0x11,       /*         LDA $11      */
+  0x8D,0x01,0x03,  /*         STA $0301    */
+  0xA5,0x12,       /*         LDA $12      */
+  0x8D,0x02,0x03,  /*         STA $0302    */
+  0xA5,0x13,       /*         LDA $13      */
+  0x8D,0x03,0x03,  /*         STA $0303    */
+  0xEE,0x10,0x03,  /*         INC $0310    */
+  0xD0,0x03,       /*         BNE again    */
+  0xEE,0x11,0x03,  /*         INC $0311    */
+  0x4C,0x00,0x04,  /* again:  JMP loop     */
+  0xE0,0x02,       /* fib:    CPX #2       */
+  0x90,0x0B,       /*         BCC leaf     */
+  0xCA,            /*         DEX          */
+  0x20,0x33,0x04,  /*         JSR fib      */
+  0xCA,            /*         DEX          */
+  0x20,0x33,0x04,  /*         JSR fib      */
+  0xE8,            /*         INX          */
+  0xE8,            /*         INX          */
+  0x60,            /*         RTS          */
+  0x8A,            /* leaf:   TXA          */
+  0x18,            /*         CLC          */
+  0x65,0x10,       /*         ADC $10      */
+  0x85,0x10,       /*         STA $10      */
+  0x90,0x02,       /*         BCC ret1     */
+  0xE6,0x11,       /*         INC $11      */
+  0x60,            /* ret1:   RTS          */
+  0xE0,0x00,       /* tri:    CPX #0       */
+  0xF0,0x0F,       /*         BEQ ret2     */
+  0xCA,            /*         DEX          */
+  0x20,0x4D,0x04,  /*         JSR tri      */
+  0xE8,            /*         INX          */
+  0x8A,            /*         TXA          */
+  0x18,            /*         CLC          */
+  0x65,0x12,       /*         ADC $12      */
+  0x85,0x12,       /*         STA $12      */
+  0x90,0x02,       /*         BCC ret2     */
+  0xE6,0x13,       /*         INC $13      */
+  0x60,            /* ret2:   RTS          */
+};
+
+/* Sorts 4096 steps of an 8-bit LFSR into four buckets with a chain of compares */
+static const uint8_t bench_branch[] = {
+  0xA9,0x01,       /* loop:   LDA #1       */
+  0x85,0x10,       /*         STA $10      */
+  0xA9,0x00,       /*         LDA #0       */
+  0x85,0x14,       /*         STA $14      */
+  0x85,0x15,       /*         STA $15      */
+  0x85,0x16,       /*         STA $16      */
+  0x85,0x17,       /*         STA $17      */
+  0x85,0x18,       /*         STA $18      */
+  0x85,0x19,       /*         STA $19      */
+  0x85,0x1A,       /*         STA $1A      */
+  0x85,0x1B,       /*         STA $1B      */
+  0xA9,0x10,       /*         LDA #16      */
+  0x85,0x13,       /*         STA $13      */
+  0xA0,0x00,       /*         LDY #0       */
+  0xA5,0x10,       /* step:   LDA $10      */
+  0x4A,            /*         LSR          */
+  0x90,0x02,       /*         BCC nt       */
+  0x49,0xB8,       /*         EOR #$B8     */
+  0x85,0x10,       /* nt:     STA $10      */
+  0xC9,0x40,       /*         CMP #$40     */
+  0x90,0x11,       /*         BCC b0       */
+  0xC9,0x80,       /*         CMP #$80     */
+  0x90,0x16,       /*         BCC b1       */
+  0xC9,0xC0,       /*         CMP #$C0     */
+  0x90,0x1B,       /*         BCC b2       */
+  0xE6,0x1A,       /*         INC $1A      */
+  0xD0,0x1D,       /*         BNE nx       */
+  0xE6,0x1B,       /*         INC $1B      */
+  0x4C,0x52,0x04,  /*         JMP nx       */
+  0xE6,0x14,       /* b0:     INC $14      */
+  0xD0,0x14,       /*         BNE nx       */
+  0xE6,0x15,       /*         INC $15      */
+  0x4C,0x52,0x04,  /*         JMP nx       */
+  0xE6,0x16,       /* b1:     INC $16      */
+  0xD0,0x0B,       /*         BNE nx       */
+  0xE6,0x17,       /*         INC $17      */
+  0x4C,0x52,0x04,  /*         JMP nx       */
+  0xE6,0x18,       /* b2:     INC $18      */
+  0xD0,0x02,       /*         BNE nx       */
+  0xE6,0x19,       /*         INC $19      */
+  0x88,            /* nx:     DEY          */
+  0xD0,0xC7,       /*         BNE step     */
+  0xC6,0x13,       /*         DEC $13      */
+  0xD0,0xC3,       /*         BNE step     */
+  0xA2,0x07,       /*         LDX #7       */
+  0xB5,0x14,       /* cp:     LDA $14,X    */
+  0x9D,0x00,0x03,  /*         STA $0300,X  */
+  0xCA,            /*         DEX          */
+  0x10,0xF8,       /*         BPL cp       */
+  0xEE,0x10,0x03,  /*         INC $0310    */
+  0xD0,0x03,       /*         BNE again    */
+  0xEE,0x11,0x03,  /*         INC $0311    */
+  0x4C,0x00,0x04,  /* again:  JMP loop     */
+};
+
+static const struct bench {
+  const char    *name;
+  const uint8_t *code;
+  uint16_t       size;
+  uint8_t        result_size;  // bytes at BENCH_RESULT
+  uint32_t       checksum;     // and their CRC-32
+} bench_kernels[] = {
+  { "sieve",   bench_sieve,   sizeof(bench_sieve),   2, 0x14FD8024 },
+  { "crc16",   bench_crc16,   sizeof(bench_crc16),   2, 0x558EFD74 },
+  { "memcpy",  bench_memcpy,  sizeof(bench_memcpy),  2, 0xA2BA19ED },
+  { "bcd",     bench_bcd,     sizeof(bench_bcd),     4, 0x6D06B5AC },
+  { "recurse", bench_recurse, sizeof(bench_recurse), 4, 0xD6165F70 },
+  { "branch",  bench_branch,  sizeof(bench_branch),  8, 0x88DCC579 },
+};
+
+/* Sets up the machine with nothing but the kernel in RAM */
+static void bench_load(const struct bench *k) {
+  struct em6502_regs regs = { BENCH_CODE, 0, 0, 0, 0xFF, 0x04 /* I */ };
+  unsigned addr;
+
+  for(addr = 0; addr < BENCH_RAM; addr++)
+    em6502_write(machine, addr, 0);
+  for(addr = 0; addr < k->size; addr++)
+    em6502_write(machine, BENCH_CODE + addr, k->code[addr]);
+  em6502_reset(machine);
+  em6502_set_regs(machine, &regs);
+}
+
+static int bench_run(const char *name, uint64_t cycles) {
+  const struct bench *k;
+  int found = 0, failed = 0;
+
+  printf("%-8s %10s %12s %8s %8s  %s\n",
+         "kernel", "iterations", "instructions", "ns/insn", "MHz", "result");
+  for(k = bench_kernels; k < bench_kernels + sizeof(bench_kernels)/sizeof(bench_kernels[0]); k++) {
+    struct em6502_regs regs;
+    uint8_t results[8];
+    double start, seconds;
+    unsigned iterations, addr;
+    uint32_t checksum;
+    int ok = 1;
+
+    if(strcmp(name, "all") != 0 && strcmp(name, k->name) != 0)
+      continue;
+    found = 1;
+    bench_load(k);
+    em6502_get_regs(machine, &regs);
+    start = run_clock();
+    while(ok && regs.cycle < cycles) {
+      ok = em6502_run(machine, cycles - regs.cycle < RUN_BATCH ? cycles - regs.cycle : RUN_BATCH);
+      em6502_get_regs(machine, &regs);
+      if(run_usr1_pending)
+        run_usr1();
+    }
+    seconds = run_clock() - start;
+
+    iterations = em6502_read(machine, BENCH_COUNT) | em6502_read(machine, BENCH_COUNT+1)<<8;
+    for(addr = 0; addr < k->result_size; addr++)
+      results[addr] = em6502_read(machine, BENCH_RESULT + addr);
+    checksum   = em6502_crc32(results, k->result_size);
+    ok = ok && iterations && checksum == k->checksum;
+    failed |= !ok;
+    printf("%-8s %10u %12llu %8.2f %8.1f  %s\n", k->name, iterations,
+           (unsigned long long)regs.instructions,
+           regs.instructions ? seconds * 1e9 / regs.instructions : 0.0,
+           seconds > 0 ? regs.cycle / seconds / 1e6 : 0.0,
+           ok ? "ok" : "FAILED");
+  }
+  if(!found)
+    fprintf(stderr, "No benchmark called '%s'\n", name);
+  return found && !failed;
+}
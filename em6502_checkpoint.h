@@ -0,0 +1,254 @@
+/********************************************************************************
+* Checkpoints
+*
+* With '-C <cycle> -I <file>', the machine runs to the checkpoint cycle and
+* then fork()s a child for each input script in the file, up to -J at a
+* time. A machine already at or past the cycle, as with -C 0 or a restored
+* state, forks straight away. The kernel shares the parent's memory with the children copy on
+* write, so a child only costs the pages it dirties. Each child plays its
+* script, runs on until one of the usual limits (-c, -t, -x or -m) and sends
+* its report back up a pipe. The parent collects them and prints them in
+* script order, each headed by 'script=<n>' and 'input=<script>'.
+*
+* A script is one line of steps separated by spaces, and '#' starts a
+* comment line:
+*
+*   keys=TEXT   types TEXT, through the KERNAL's keyboard buffer. '\r' is
+*               RETURN, '\xHH' is any PETSCII code and '\\' a backslash.
+*   ADDR=VALUE  pokes a hex value into memory, as the CPU would write it
+*   +CYCLES     runs this many cycles before the next step
+********************************************************************************/
+#define CHECKPOINT_MAX  1024
+
+static int      checkpoint_set;      // -C was given, for any cycle including 0
+static uint64_t checkpoint_cycle;
+static int      checkpoint_jobs;
+static char    *checkpoint_scripts[CHECKPOINT_MAX];
+static int      checkpoint_count;
+
+/* Checks a step, and plays it too if 'apply' is set. '+CYCLES' steps are
+   run by the caller. */
+static int checkpoint_step(char *step, int apply) {
+  char *p, *eq = strchr(step, '=');
+  int32_t addr, value;
+
+  if(strncmp(step, "keys=", 5) == 0) {
+    for(p = step+5; *p; p++) {
+      int key = (uint8_t)*p;
+      if(*p == '\\' && p[1] == 'r') {
+        key = 13;
+        p++;
+      } else if(*p == '\\' && p[1] == '\\') {
+        p++;
+      } else if(*p == '\\' && p[1] == 'x') {
+        char hex[3] = { p[2], p[2] ? p[3] : 0, 0 }, *end;
+        key = strtoul(hex, &end, 16);
+        if(end != hex+2) {
+          fprintf(stderr, "Bad key escape in '%s'\n", step);
+          return 0;
+        }
+        p += 3;
+      } else if(*p >= 'a' && *p <= 'z') {
+        key = *p - 'a' + 'A';
+      }
+      if(apply && run_key_count < (int)sizeof(run_keys))
+        run_keys[run_key_count++] = key;
+    }
+    return 1;
+  }
+  if(*step == '+') {
+    strtoull(step+1, &p, 10);
+    if(step[1] == '\0' || *p != '\0') {
+      fprintf(stderr, "Bad cycle count '%s'\n", step);
+      return 0;
+    }
+    return 1;
+  }
+  if(eq == NULL) {
+    fprintf(stderr, "Unknown step '%s'\n", step);
+    return 0;
+  }
+  *eq = '\0';
+  if(!run_parse_hex(step, &addr, 0xFFFF) || !run_parse_hex(eq+1, &value, 0xFF)) {
+    *eq = '=';
+    return 0;
+  }
+  *eq = '=';
+  if(apply)
+    em6502_write(machine, addr, value);
+  return 1;
+}
+
+static int checkpoint_load(char *filename) {
+  char line[1024], copy[1024], *step, *save;
+  FILE *f = fopen(filename, "r");
+  if(f == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", filename);
+    return 0;
+  }
+  while(fgets(line, sizeof(line), f)) {
+    char *p = line + strspn(line, " \t");
+    p[strcspn(p, "\r\n")] = '\0';
+    if(*p == '#' || *p == '\0')
+      continue;
+    if(checkpoint_count == CHECKPOINT_MAX) {
+      fprintf(stderr, "Too many input scripts\n");
+      fclose(f);
+      return 0;
+    }
+    strcpy(copy, p);
+    for(step = strtok_r(copy, " \t", &save); step; step = strtok_r(NULL, " \t", &save)) {
+      if(!checkpoint_step(step, 0)) {
+        fclose(f);
+        return 0;
+      }
+    }
+    checkpoint_scripts[checkpoint_count++] = strdup(p);
+  }
+  fclose(f);
+  return 1;
+}
+
+/* Plays a script in the child, then runs on to the usual limits */
+static const char *checkpoint_play(char *script) {
+  char *step, *save;
+  struct em6502_regs regs;
+  const char *reason;
+
+  for(step = strtok_r(script, " \t", &save); step; step = strtok_r(NULL, " \t", &save)) {
+    if(*step != '+') {
+      checkpoint_step(step, 1);
+      continue;
+    }
+    em6502_get_regs(machine, &regs);
+    regs.cycle += strtoull(step+1, NULL, 10);
+    if(run_max_cycles && regs.cycle >= run_max_cycles)
+      break;
+    reason = run(regs.cycle);
+    if(strcmp(reason, "cycles") != 0)
+      return reason;
+  }
+  return run(run_max_cycles);
+}
+
+static pid_t checkpoint_fork(int n, int *fd) {
+  int pipe_fd[2];
+  pid_t pid;
+
+  if(pipe(pipe_fd) != 0) {
+    perror("Unable to make a pipe");
+    return -1;
+  }
+  pid = fork();
+  if(pid < 0) {
+    perror("Unable to fork");
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return -1;
+  }
+  if(pid == 0) {
+    FILE *out;
+    const char *reason;
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    close(pipe_fd[0]);
+    /* The emulator's own chatter would be interleaved with the others' */
+    if(null_fd >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      close(null_fd);
+    }
+    out = fdopen(pipe_fd[1], "w");
+    if(out == NULL) {
+      perror("Unable to open the report pipe");
+      _exit(1);
+    }
+    run_set_frames(0);
+    run_save_file    = NULL;
+    run_start        = run_clock();
+    reason = checkpoint_play(checkpoint_scripts[n]);
+    run_report(out, reason, run_clock() - run_start);
+    fclose(out);
+    _exit(0);
+  }
+  close(pipe_fd[1]);
+  *fd = pipe_fd[0];
+  return pid;
+}
+
+/* Forks the children, and collects and prints their reports */
+static int checkpoint_explore(void) {
+  struct child {
+    pid_t  pid;
+    int    fd;
+    char  *report;
+    size_t length;
+  } *children = calloc(checkpoint_count, sizeof(*children));
+  struct pollfd *fds = calloc(checkpoint_count, sizeof(*fds));
+  int *index = calloc(checkpoint_count, sizeof(*index));
+  int next = 0, running = 0, failed = 0, i;
+  struct em6502_regs regs;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int jobs = checkpoint_jobs > 0 ? checkpoint_jobs : cpus > 0 ? cpus : 1;
+
+  if(children == NULL || fds == NULL || index == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  /* A restored state may already be past the -C cycle */
+  em6502_get_regs(machine, &regs);
+  printf("checkpoint_cycle=%llu\n", (unsigned long long)regs.cycle);
+  while(next < checkpoint_count || running) {
+    while(running < jobs && next < checkpoint_count) {
+      fflush(stdout);
+      children[next].pid = checkpoint_fork(next, &children[next].fd);
+      if(children[next].pid < 0) {
+        failed = 1;
+        next++;
+        continue;
+      }
+      index[running++] = next++;
+    }
+    for(i = 0; i < running; i++) {
+      fds[i].fd     = children[index[i]].fd;
+      fds[i].events = POLLIN;
+    }
+    if(running == 0 || poll(fds, running, -1) < 0)
+      continue;
+    for(i = running-1; i >= 0; i--) {
+      struct child *c = &children[index[i]];
+      char buffer[4096];
+      ssize_t got;
+      int status;
+
+      if(!fds[i].revents)
+        continue;
+      got = read(c->fd, buffer, sizeof(buffer));
+      if(got > 0) {
+        char *more = realloc(c->report, c->length + got);
+        if(more) {
+          memcpy(more + c->length, buffer, got);
+          c->report  = more;
+          c->length += got;
+        }
+        continue;
+      }
+      close(c->fd);
+      waitpid(c->pid, &status, 0);
+      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        failed = 1;
+      index[i] = index[--running];
+    }
+  }
+  for(i = 0; i < checkpoint_count; i++) {
+    printf("\nscript=%i\ninput=%s\n", i+1, checkpoint_scripts[i]);
+    if(children[i].length)
+      fwrite(children[i].report, 1, children[i].length, stdout);
+    else
+      printf("exit=crash\n");
+    free(children[i].report);
+  }
+  free(children);
+  free(fds);
+  free(index);
+  return failed;
+}
@@ -0,0 +1,888 @@
+/********************************************************************************
+* The x86-64 JIT
+*
+* With -j, a block from the block cache that has been looked up
+* JIT_THRESHOLD times is translated into x86-64 code in the machine's own
+* mmap'd buffer, and from then on runs as a single call. The buffer is never
+* writable and executable at once: the pages a block goes into are made
+* writable while it is translated, and executable again after. The 6502
+* registers live in R12-R14 for the length of the block, the lazy flags stay in
+* 'state', and the cycles the block takes, including page crossing and
+* branch penalties, are counted in R8 and added to state.cycle when it
+* exits. A block that branches back to its own start loops inside the
+* translated code. Cycle counting is exact, but the deadline is only
+* checked between blocks and between trips round such a loop. Only the
+* production interpreter uses translated code, so tracing and breakpoints
+* see every instruction.
+*
+* Every memory access goes through the page table. If a page has no
+* direct mapping - I/O, watched memory, or a RAM page holding code - the
+* block bails out to the interpreter at the start of the instruction that
+* made the access, before it has changed anything. Blocks that keep bailing
+* out, or that hold instructions the JIT does not translate, are left to
+* the interpreter. Writes to code bytes always come through the
+* interpreter, and so invalidate blocks and their translations as usual.
+*
+* Decimal mode is left to the interpreter, as are BRK, RTI, PHP, PLP, the
+* instructions that change I or D, and the undocumented opcodes.
+********************************************************************************/
+#define JIT_THRESHOLD   32
+#define JIT_MAX_BAILS   8
+#define JIT_BUFFER_SIZE (8<<20)
+#define JIT_BLOCK_SPACE 4096     // more than the largest translated block
+#define JIT_MAX_FIXUPS  64
+
+struct jit_stats {
+  uint64_t translated;
+  uint64_t untranslatable;
+  uint64_t invalidated;
+  uint64_t evicted;
+  uint64_t flushes;
+  uint64_t runs;
+  uint64_t bails;
+  uint64_t cycles;
+  uint64_t ticks;
+  uint64_t start_ticks;
+};
+
+/* The operations the JIT translates, from em6502_opcodes.def */
+enum {
+  JOP_NONE,
+  JOP_ADC, JOP_AND, JOP_ASL, JOP_BCC, JOP_BCS, JOP_BEQ, JOP_BIT, JOP_BMI,
+  JOP_BNE, JOP_BPL, JOP_BVC, JOP_BVS, JOP_CLC, JOP_CLV, JOP_CMP, JOP_CPX,
+  JOP_CPY, JOP_DEC, JOP_DEX, JOP_DEY, JOP_EOR, JOP_INC, JOP_INX, JOP_INY,
+  JOP_JMP, JOP_JSR, JOP_LDA, JOP_LDX, JOP_LDY, JOP_LSR, JOP_NOP, JOP_ORA,
+  JOP_PHA, JOP_PLA, JOP_ROL, JOP_ROR, JOP_RTS, JOP_SBC, JOP_SEC, JOP_STA,
+  JOP_STX, JOP_STY, JOP_TAX, JOP_TAY, JOP_TSX, JOP_TXA, JOP_TXS, JOP_TYA
+};
+#define JOP_BRK  JOP_NONE
+#define JOP_CLD  JOP_NONE
+#define JOP_CLI  JOP_NONE
+#define JOP_PHP  JOP_NONE
+#define JOP_PLP  JOP_NONE
+#define JOP_RTI  JOP_NONE
+#define JOP_SED  JOP_NONE
+#define JOP_SEI  JOP_NONE
+
+enum { JM_IMP, JM_ACC, JM_IMM, JM_ZPG, JM_ZPX, JM_ZPY, JM_ABS, JM_ABX, JM_ABY,
+       JM_IND, JM_IZX, JM_IZY, JM_REL };
+
+static const struct jit_op {
+  uint8_t op;
+  uint8_t mode;
+  uint8_t cycles;
+} jit_ops[256] = {
+#define OP(code, name, mode, cycles)  [0x##code] = { JOP_##name, JM_##mode, cycles },
+#define UOP(code, name, mode, cycles)
+#include "em6502_opcodes.def"
+#undef UOP
+#undef OP
+};
+
+/*****************************************************************
+* x86-64 encoding
+*****************************************************************/
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+#define REG_A   R12
+#define REG_X   R13
+#define REG_Y   R14
+#define NOINDEX (-1)
+
+#define CC_AE   0x3
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_L    0xC
+
+#define X_ADD   0x01          // op r/m32, r32
+#define X_OR    0x09
+#define X_AND   0x21
+#define X_SUB   0x29
+#define X_XOR   0x31
+#define X_CMP   0x39
+#define X_MOV   0x89
+#define XI_ADD  0             // 81 /digit, op r/m32, imm32
+#define XI_AND  4
+#define XI_SUB  5
+#define XI_XOR  6
+#define XS_SHL  4             // C1 /digit, shift r/m32, imm8
+#define XS_SHR  5
+
+#define STATE(field)  ((int32_t)offsetof(struct cpu_state, field))
+
+static void x_byte(uint8_t v) {
+  *em->jit_ptr++ = v;
+}
+
+static void x_u32(uint32_t v) {
+  memcpy(em->jit_ptr, &v, 4);
+  em->jit_ptr += 4;
+}
+
+static void x_u64(uint64_t v) {
+  memcpy(em->jit_ptr, &v, 8);
+  em->jit_ptr += 8;
+}
+
+/* 'byte' forces a REX prefix, so that registers 4-7 are SPL-DIL rather than AH-BH */
+static void x_rex(int w, int reg, int index, int base, int byte) {
+  uint8_t rex = 0x40 | w<<3 | (reg&8)>>1 | (index > 0 ? (index&8)>>2 : 0) | (base&8)>>3;
+  if(rex != 0x40 || byte)
+    x_byte(rex);
+}
+
+static void x_modrm_reg(int reg, int rm) {
+  x_byte(0xC0 | (reg&7)<<3 | (rm&7));
+}
+
+static void x_modrm_mem(int reg, int base, int index, int scale, int32_t disp) {
+  uint8_t mod = disp == (int8_t)disp ? 0x40 : 0x80;
+  if(index != NOINDEX || (base&7) == RSP) {
+    x_byte(mod | (reg&7)<<3 | 4);
+    x_byte(scale<<6 | ((index != NOINDEX ? index : RSP)&7)<<3 | (base&7));
+  } else {
+    x_byte(mod | (reg&7)<<3 | (base&7));
+  }
+  if(mod == 0x40)
+    x_byte(disp);
+  else
+    x_u32(disp);
+}
+
+static void x_mov_ri(int r, uint32_t imm) {
+  x_rex(0, 0, NOINDEX, r, 0);
+  x_byte(0xB8 + (r&7));
+  x_u32(imm);
+}
+
+static void x_movq_ri(int r, uint64_t imm) {
+  x_rex(1, 0, NOINDEX, r, 0);
+  x_byte(0xB8 + (r&7));
+  x_u64(imm);
+}
+
+static void x_alu_rr(uint8_t op, int dst, int src) {
+  x_rex(0, src, NOINDEX, dst, 0);
+  x_byte(op);
+  x_modrm_reg(src, dst);
+}
+
+static void x_alu_ri(int digit, int dst, uint32_t imm) {
+  x_rex(0, 0, NOINDEX, dst, 0);
+  x_byte(0x81);
+  x_modrm_reg(digit, dst);
+  x_u32(imm);
+}
+
+static void x_shift_ri(int digit, int dst, uint8_t n) {
+  x_rex(0, 0, NOINDEX, dst, 0);
+  x_byte(0xC1);
+  x_modrm_reg(digit, dst);
+  x_byte(n);
+}
+
+static void x_not(int r) {
+  x_rex(0, 0, NOINDEX, r, 0);
+  x_byte(0xF7);
+  x_modrm_reg(2, r);
+}
+
+/* movzx dst32, src8 */
+static void x_zx8(int dst, int src) {
+  x_rex(0, dst, NOINDEX, src, 1);
+  x_byte(0x0F);
+  x_byte(0xB6);
+  x_modrm_reg(dst, src);
+}
+
+/* movzx dst32, src16 */
+static void x_zx16(int dst, int src) {
+  x_rex(0, dst, NOINDEX, src, 0);
+  x_byte(0x0F);
+  x_byte(0xB7);
+  x_modrm_reg(dst, src);
+}
+
+/* movzx dst32, byte [base + index + disp] */
+static void x_load8(int dst, int base, int index, int32_t disp) {
+  x_rex(0, dst, index, base, 0);
+  x_byte(0x0F);
+  x_byte(0xB6);
+  x_modrm_mem(dst, base, index, 0, disp);
+}
+
+/* mov byte [base + index + disp], src8 */
+static void x_store8(int src, int base, int index, int32_t disp) {
+  x_rex(0, src, index, base, 1);
+  x_byte(0x88);
+  x_modrm_mem(src, base, index, 0, disp);
+}
+
+/* mov word [base + disp], src16 */
+static void x_store16(int src, int base, int32_t disp) {
+  x_byte(0x66);
+  x_rex(0, src, NOINDEX, base, 0);
+  x_byte(0x89);
+  x_modrm_mem(src, base, NOINDEX, 0, disp);
+}
+
+/* mov dst64, [base + index*8 + disp] */
+static void x_loadq(int dst, int base, int index, int32_t disp) {
+  x_rex(1, dst, index, base, 0);
+  x_byte(0x8B);
+  x_modrm_mem(dst, base, index, 3, disp);
+}
+
+/* mov/cmp/test byte [base + disp], imm8 */
+static void x_mem_i8(uint8_t op, int digit, int base, int32_t disp, uint8_t imm) {
+  x_rex(0, 0, NOINDEX, base, 0);
+  x_byte(op);
+  x_modrm_mem(digit, base, NOINDEX, 0, disp);
+  x_byte(imm);
+}
+#define X_MOVB_MI(base, disp, imm)   x_mem_i8(0xC6, 0, base, disp, imm)
+#define X_CMPB_MI(base, disp, imm)   x_mem_i8(0x80, 7, base, disp, imm)
+#define X_TESTB_MI(base, disp, imm)  x_mem_i8(0xF6, 0, base, disp, imm)
+
+/* mov dst32, dword [base + disp] */
+static void x_load32(int dst, int base, int32_t disp) {
+  x_rex(0, dst, NOINDEX, base, 0);
+  x_byte(0x8B);
+  x_modrm_mem(dst, base, NOINDEX, 0, disp);
+}
+
+/* sub dst32, dword [base + disp] */
+static void x_sub_rm(int dst, int base, int32_t disp) {
+  x_rex(0, dst, NOINDEX, base, 0);
+  x_byte(0x2B);
+  x_modrm_mem(dst, base, NOINDEX, 0, disp);
+}
+
+/* add qword [base + disp], src64 */
+static void x_addq_mr(int base, int32_t disp, int src) {
+  x_rex(1, src, NOINDEX, base, 0);
+  x_byte(0x01);
+  x_modrm_mem(src, base, NOINDEX, 0, disp);
+}
+
+/* add qword [base + disp], simm32 */
+static void x_addq_mi(int base, int32_t disp, int32_t imm) {
+  x_rex(1, 0, NOINDEX, base, 0);
+  x_byte(0x81);
+  x_modrm_mem(0, base, NOINDEX, 0, disp);
+  x_u32(imm);
+}
+
+static void x_testq(int r) {
+  x_rex(1, r, NOINDEX, r, 0);
+  x_byte(0x85);
+  x_modrm_reg(r, r);
+}
+
+static void x_setcc(int cc, int r) {
+  x_rex(0, 0, NOINDEX, r, 1);
+  x_byte(0x0F);
+  x_byte(0x90 + cc);
+  x_modrm_reg(0, r);
+}
+
+static void x_push(int r) {
+  x_rex(0, 0, NOINDEX, r, 0);
+  x_byte(0x50 + (r&7));
+}
+
+static void x_pop(int r) {
+  x_rex(0, 0, NOINDEX, r, 0);
+  x_byte(0x58 + (r&7));
+}
+
+/* Jumps return where their rel32 goes, for x_patch() */
+static uint8_t *x_jcc(int cc) {
+  x_byte(0x0F);
+  x_byte(0x80 + cc);
+  x_u32(0);
+  return em->jit_ptr - 4;
+}
+
+static uint8_t *x_jmp(void) {
+  x_byte(0xE9);
+  x_u32(0);
+  return em->jit_ptr - 4;
+}
+
+static void x_patch(uint8_t *at, uint8_t *target) {
+  int32_t rel = target - (at + 4);
+  memcpy(at, &rel, 4);
+}
+
+/*****************************************************************
+* Translating a block
+*****************************************************************/
+/* Scratch space for the block being translated, by whichever thread */
+static _Thread_local struct {
+  uint8_t  *at;
+  uint16_t  pc;
+  uint8_t   done;       // instructions run before it, of this trip round the block
+} jit_bails[JIT_MAX_FIXUPS];
+static _Thread_local uint8_t *jit_exits[JIT_MAX_FIXUPS];
+static _Thread_local int      jit_bail_count, jit_exit_count;
+static _Thread_local uint16_t jit_start;      // the 6502 address of the block being translated
+static _Thread_local uint8_t *jit_body;       // and where its translation starts
+static _Thread_local uint8_t  jit_done;       // instructions translated so far
+
+/* Bails out to the interpreter at 'pc' if the page pointer in 'r' is NULL */
+static void jit_bail_if_null(int r, uint16_t pc) {
+  x_testq(r);
+  jit_bails[jit_bail_count].at = x_jcc(CC_E);
+  jit_bails[jit_bail_count].pc = pc;
+  jit_bails[jit_bail_count].done = jit_done;
+  jit_bail_count++;
+}
+
+static void jit_exit(void) {
+  jit_exits[jit_exit_count++] = x_jmp();
+}
+
+/* A block that jumps back to its own start loops without leaving the
+   translated code, for as long as the cycles left in R10 last */
+static void jit_exit_to(uint16_t pc) {
+  if(pc == jit_start) {
+    x_alu_rr(X_CMP, R8, R10);
+    x_patch(x_jcc(CC_L), jit_body);
+  }
+  x_mov_ri(RCX, pc);
+  x_store16(RCX, RBX, STATE(pc));
+  jit_exit();
+}
+
+static void jit_nz(int r) {
+  x_store8(r, RBX, NOINDEX, STATE(n_res));
+  x_store8(r, RBX, NOINDEX, STATE(z_res));
+}
+
+/*
+ * Works out a non-constant effective address into EAX, with the page
+ * crossing penalty for abs,X, abs,Y and (zp),Y in EDI.
+ */
+static void jit_ea(int mode, uint16_t operand, uint16_t pc) {
+  int index = (mode == JM_ZPY || mode == JM_ABY || mode == JM_IZY) ? REG_Y : REG_X;
+
+  switch(mode) {
+    case JM_ZPX:
+    case JM_ZPY:
+      x_alu_rr(X_MOV, RAX, index);
+      x_alu_ri(XI_ADD, RAX, operand);
+      x_zx8(RAX, RAX);
+      break;
+    case JM_ABX:
+    case JM_ABY:
+      x_alu_rr(X_MOV, RDI, index);
+      x_alu_ri(XI_ADD, RDI, operand & 0xFF);
+      x_shift_ri(XS_SHR, RDI, 8);
+      x_alu_rr(X_MOV, RAX, index);
+      x_alu_ri(XI_ADD, RAX, operand);
+      x_zx16(RAX, RAX);
+      break;
+    case JM_IZX:
+      x_loadq(RDX, R15, NOINDEX, 0);
+      jit_bail_if_null(RDX, pc);
+      x_alu_rr(X_MOV, RCX, REG_X);
+      x_alu_ri(XI_ADD, RCX, operand);
+      x_zx8(RCX, RCX);
+      x_load8(RAX, RDX, RCX, 0);
+      x_alu_ri(XI_ADD, RCX, 1);
+      x_zx8(RCX, RCX);
+      x_load8(RCX, RDX, RCX, 0);
+      x_shift_ri(XS_SHL, RCX, 8);
+      x_alu_rr(X_OR, RAX, RCX);
+      break;
+    case JM_IZY:
+      x_loadq(RDX, R15, NOINDEX, 0);
+      jit_bail_if_null(RDX, pc);
+      x_load8(RAX, RDX, NOINDEX, operand & 0xFF);
+      x_load8(RCX, RDX, NOINDEX, (operand + 1) & 0xFF);
+      x_shift_ri(XS_SHL, RCX, 8);
+      x_alu_rr(X_OR, RAX, RCX);
+      x_zx8(RDI, RAX);
+      x_alu_rr(X_ADD, RDI, REG_Y);
+      x_shift_ri(XS_SHR, RDI, 8);
+      x_alu_rr(X_ADD, RAX, REG_Y);
+      x_zx16(RAX, RAX);
+      break;
+  }
+}
+
+/* Leaves the page for the operand's address in RDX and the offset in RCX */
+static void jit_page(int table, int mode, uint16_t operand, uint16_t pc) {
+  if(mode == JM_ZPG || mode == JM_ABS) {
+    x_loadq(RDX, table, NOINDEX, (operand>>8)*8);
+    jit_bail_if_null(RDX, pc);
+    x_mov_ri(RCX, operand & 0xFF);
+  } else {
+    jit_ea(mode, operand, pc);
+    x_alu_rr(X_MOV, RCX, RAX);
+    x_shift_ri(XS_SHR, RCX, 8);
+    x_loadq(RDX, table, RCX, 0);
+    jit_bail_if_null(RDX, pc);
+    x_zx8(RCX, RAX);
+  }
+}
+
+/* Reads the operand into EAX */
+static void jit_read(int mode, uint16_t operand, uint16_t pc) {
+  if(mode == JM_IMM) {
+    x_mov_ri(RAX, operand);
+    return;
+  }
+  jit_page(R15, mode, operand, pc);
+  x_load8(RAX, RDX, RCX, 0);
+  if(mode == JM_ABX || mode == JM_ABY || mode == JM_IZY)
+    x_alu_rr(X_ADD, R8, RDI);
+}
+
+/* Pages are mapped to the same memory for reading and writing, so
+   read-modify-write instructions read through the write mapping */
+static void jit_modify(int op, int mode, uint16_t operand, uint16_t pc) {
+  if(mode == JM_ACC) {
+    x_alu_rr(X_MOV, RAX, REG_A);
+  } else {
+    jit_page(RBP, mode, operand, pc);
+    x_load8(RAX, RDX, RCX, 0);
+  }
+
+  /* The new value in ESI, and the new carry in EDI */
+  x_alu_rr(X_MOV, RSI, RAX);
+  switch(op) {
+    case JOP_ASL:
+      x_alu_rr(X_ADD, RSI, RSI);
+      x_alu_rr(X_MOV, RDI, RAX);
+      x_shift_ri(XS_SHR, RDI, 7);
+      break;
+    case JOP_LSR:
+      x_shift_ri(XS_SHR, RSI, 1);
+      x_alu_rr(X_MOV, RDI, RAX);
+      x_alu_ri(XI_AND, RDI, 1);
+      break;
+    case JOP_ROL:
+      x_load8(R9, RBX, NOINDEX, STATE(carry));
+      x_alu_rr(X_ADD, RSI, RSI);
+      x_alu_rr(X_OR, RSI, R9);
+      x_alu_rr(X_MOV, RDI, RAX);
+      x_shift_ri(XS_SHR, RDI, 7);
+      break;
+    case JOP_ROR:
+      x_load8(R9, RBX, NOINDEX, STATE(carry));
+      x_shift_ri(XS_SHL, R9, 7);
+      x_shift_ri(XS_SHR, RSI, 1);
+      x_alu_rr(X_OR, RSI, R9);
+      x_alu_rr(X_MOV, RDI, RAX);
+      x_alu_ri(XI_AND, RDI, 1);
+      break;
+    case JOP_INC:
+      x_alu_ri(XI_ADD, RSI, 1);
+      break;
+    case JOP_DEC:
+      x_alu_ri(XI_SUB, RSI, 1);
+      break;
+  }
+  x_zx8(RSI, RSI);
+
+  if(mode == JM_ACC)
+    x_alu_rr(X_MOV, REG_A, RSI);
+  else
+    x_store8(RSI, RDX, RCX, 0);
+  if(op != JOP_INC && op != JOP_DEC)
+    x_store8(RDI, RBX, NOINDEX, STATE(carry));
+  jit_nz(RSI);
+}
+
+static void jit_adc(void) {
+  x_load8(RDX, RBX, NOINDEX, STATE(carry));
+  x_alu_rr(X_MOV, RCX, REG_A);
+  x_alu_rr(X_ADD, RCX, RAX);
+  x_alu_rr(X_ADD, RCX, RDX);
+  x_alu_rr(X_MOV, RDX, REG_A);
+  x_alu_rr(X_XOR, RDX, RAX);
+  x_not(RDX);
+  x_alu_rr(X_MOV, RSI, REG_A);
+  x_alu_rr(X_XOR, RSI, RCX);
+  x_alu_rr(X_AND, RDX, RSI);
+  x_store8(RDX, RBX, NOINDEX, STATE(overflow));
+  x_alu_rr(X_MOV, RDX, RCX);
+  x_shift_ri(XS_SHR, RDX, 8);
+  x_store8(RDX, RBX, NOINDEX, STATE(carry));
+  x_zx8(REG_A, RCX);
+  jit_nz(REG_A);
+}
+
+static void jit_compare(int r) {
+  x_alu_rr(X_CMP, r, RAX);
+  x_setcc(CC_AE, RDX);
+  x_store8(RDX, RBX, NOINDEX, STATE(carry));
+  x_alu_rr(X_MOV, RCX, r);
+  x_alu_rr(X_SUB, RCX, RAX);
+  jit_nz(RCX);
+}
+
+static void jit_branch(int op, uint16_t next, uint16_t target) {
+  static const struct {
+    uint8_t op, field, taken_if_set;
+  } conds[] = {
+    { JOP_BCC, offsetof(struct cpu_state, carry),    0 },
+    { JOP_BCS, offsetof(struct cpu_state, carry),    1 },
+    { JOP_BNE, offsetof(struct cpu_state, z_res),    1 },
+    { JOP_BEQ, offsetof(struct cpu_state, z_res),    0 },
+    { JOP_BPL, offsetof(struct cpu_state, n_res),    0 },
+    { JOP_BMI, offsetof(struct cpu_state, n_res),    1 },
+    { JOP_BVC, offsetof(struct cpu_state, overflow), 0 },
+    { JOP_BVS, offsetof(struct cpu_state, overflow), 1 },
+  };
+  uint8_t *taken;
+  unsigned i;
+
+  for(i = 0; conds[i].op != op; i++)
+    ;
+  if(op == JOP_BCC || op == JOP_BCS || op == JOP_BNE || op == JOP_BEQ)
+    X_CMPB_MI(RBX, conds[i].field, 0);
+  else
+    X_TESTB_MI(RBX, conds[i].field, 0x80);
+  taken = x_jcc(conds[i].taken_if_set ? CC_NE : CC_E);
+  jit_exit_to(next);
+  x_patch(taken, em->jit_ptr);
+  x_alu_ri(XI_ADD, R8, 1 + ((target ^ next) > 0xFF));
+  jit_exit_to(target);
+}
+
+/* Returns -1 if the instruction can't be translated, 1 if it ends the block */
+static int jit_insn(const struct decoded *d, uint16_t pc, uint16_t next) {
+  const struct jit_op *e = &jit_ops[d->opcode];
+  uint16_t operand = d->operand;
+  int mode = e->mode;
+
+  switch(e->op) {
+    case JOP_NONE:
+      return -1;
+
+    case JOP_LDA: jit_read(mode, operand, pc); x_alu_rr(X_MOV, REG_A, RAX); jit_nz(REG_A); break;
+    case JOP_LDX: jit_read(mode, operand, pc); x_alu_rr(X_MOV, REG_X, RAX); jit_nz(REG_X); break;
+    case JOP_LDY: jit_read(mode, operand, pc); x_alu_rr(X_MOV, REG_Y, RAX); jit_nz(REG_Y); break;
+    case JOP_AND: jit_read(mode, operand, pc); x_alu_rr(X_AND, REG_A, RAX); jit_nz(REG_A); break;
+    case JOP_ORA: jit_read(mode, operand, pc); x_alu_rr(X_OR,  REG_A, RAX); jit_nz(REG_A); break;
+    case JOP_EOR: jit_read(mode, operand, pc); x_alu_rr(X_XOR, REG_A, RAX); jit_nz(REG_A); break;
+    case JOP_ADC: jit_read(mode, operand, pc); jit_adc(); break;
+    case JOP_SBC: jit_read(mode, operand, pc); x_alu_ri(XI_XOR, RAX, 0xFF); jit_adc(); break;
+    case JOP_CMP: jit_read(mode, operand, pc); jit_compare(REG_A); break;
+    case JOP_CPX: jit_read(mode, operand, pc); jit_compare(REG_X); break;
+    case JOP_CPY: jit_read(mode, operand, pc); jit_compare(REG_Y); break;
+    case JOP_BIT:
+      jit_read(mode, operand, pc);
+      x_alu_rr(X_MOV, RCX, REG_A);
+      x_alu_rr(X_AND, RCX, RAX);
+      x_store8(RCX, RBX, NOINDEX, STATE(z_res));
+      x_store8(RAX, RBX, NOINDEX, STATE(n_res));
+      x_alu_rr(X_ADD, RAX, RAX);
+      x_store8(RAX, RBX, NOINDEX, STATE(overflow));
+      break;
+
+    case JOP_STA: jit_page(RBP, mode, operand, pc); x_store8(REG_A, RDX, RCX, 0); break;
+    case JOP_STX: jit_page(RBP, mode, operand, pc); x_store8(REG_X, RDX, RCX, 0); break;
+    case JOP_STY: jit_page(RBP, mode, operand, pc); x_store8(REG_Y, RDX, RCX, 0); break;
+
+    case JOP_ASL:
+    case JOP_LSR:
+    case JOP_ROL:
+    case JOP_ROR:
+    case JOP_INC:
+    case JOP_DEC:
+      jit_modify(e->op, mode, operand, pc);
+      break;
+
+    case JOP_INX: x_alu_ri(XI_ADD, REG_X, 1); x_zx8(REG_X, REG_X); jit_nz(REG_X); break;
+    case JOP_INY: x_alu_ri(XI_ADD, REG_Y, 1); x_zx8(REG_Y, REG_Y); jit_nz(REG_Y); break;
+    case JOP_DEX: x_alu_ri(XI_SUB, REG_X, 1); x_zx8(REG_X, REG_X); jit_nz(REG_X); break;
+    case JOP_DEY: x_alu_ri(XI_SUB, REG_Y, 1); x_zx8(REG_Y, REG_Y); jit_nz(REG_Y); break;
+    case JOP_TAX: x_alu_rr(X_MOV, REG_X, REG_A); jit_nz(REG_X); break;
+    case JOP_TAY: x_alu_rr(X_MOV, REG_Y, REG_A); jit_nz(REG_Y); break;
+    case JOP_TXA: x_alu_rr(X_MOV, REG_A, REG_X); jit_nz(REG_A); break;
+    case JOP_TYA: x_alu_rr(X_MOV, REG_A, REG_Y); jit_nz(REG_A); break;
+    case JOP_TSX: x_load8(REG_X, RBX, NOINDEX, STATE(sp)); jit_nz(REG_X); break;
+    case JOP_TXS: x_store8(REG_X, RBX, NOINDEX, STATE(sp)); break;
+    case JOP_CLC: X_MOVB_MI(RBX, STATE(carry), 0); break;
+    case JOP_SEC: X_MOVB_MI(RBX, STATE(carry), 1); break;
+    case JOP_CLV: X_MOVB_MI(RBX, STATE(overflow), 0); break;
+    case JOP_NOP: break;
+
+    case JOP_PHA:
+      x_loadq(RDX, RBP, NOINDEX, 1*8);
+      jit_bail_if_null(RDX, pc);
+      x_load8(RCX, RBX, NOINDEX, STATE(sp));
+      x_store8(REG_A, RDX, RCX, 0);
+      x_alu_ri(XI_SUB, RCX, 1);
+      x_store8(RCX, RBX, NOINDEX, STATE(sp));
+      break;
+    case JOP_PLA:
+      x_loadq(RDX, R15, NOINDEX, 1*8);
+      jit_bail_if_null(RDX, pc);
+      x_load8(RCX, RBX, NOINDEX, STATE(sp));
+      x_alu_ri(XI_ADD, RCX, 1);
+      x_zx8(RCX, RCX);
+      x_load8(REG_A, RDX, RCX, 0);
+      x_store8(RCX, RBX, NOINDEX, STATE(sp));
+      jit_nz(REG_A);
+      break;
+
+    /* The rest end the block */
+    case JOP_BCC: case JOP_BCS: case JOP_BNE: case JOP_BEQ:
+    case JOP_BPL: case JOP_BMI: case JOP_BVC: case JOP_BVS:
+      x_alu_ri(XI_ADD, R8, e->cycles);
+      jit_branch(e->op, next, next + (int8_t)operand);
+      return 1;
+
+    case JOP_JMP:
+      if(mode == JM_IND) {
+        x_loadq(RDX, R15, NOINDEX, (operand>>8)*8);
+        jit_bail_if_null(RDX, pc);
+        x_load8(RAX, RDX, NOINDEX, operand & 0xFF);
+        x_load8(RCX, RDX, NOINDEX, (operand + 1) & 0xFF);
+        x_shift_ri(XS_SHL, RCX, 8);
+        x_alu_rr(X_OR, RAX, RCX);
+        x_alu_ri(XI_ADD, R8, e->cycles);
+        x_store16(RAX, RBX, STATE(pc));
+        jit_exit();
+      } else {
+        x_alu_ri(XI_ADD, R8, e->cycles);
+        jit_exit_to(operand);
+      }
+      return 1;
+
+    case JOP_JSR:
+      x_loadq(RDX, RBP, NOINDEX, 1*8);
+      jit_bail_if_null(RDX, pc);
+      x_load8(RCX, RBX, NOINDEX, STATE(sp));
+      x_mov_ri(RSI, (uint16_t)(next-1) >> 8);
+      x_store8(RSI, RDX, RCX, 0);
+      x_alu_ri(XI_SUB, RCX, 1);
+      x_zx8(RCX, RCX);
+      x_mov_ri(RSI, (next-1) & 0xFF);
+      x_store8(RSI, RDX, RCX, 0);
+      x_alu_ri(XI_SUB, RCX, 1);
+      x_store8(RCX, RBX, NOINDEX, STATE(sp));
+      x_alu_ri(XI_ADD, R8, e->cycles);
+      jit_exit_to(operand);
+      return 1;
+
+    case JOP_RTS:
+      x_loadq(RDX, R15, NOINDEX, 1*8);
+      jit_bail_if_null(RDX, pc);
+      x_load8(RCX, RBX, NOINDEX, STATE(sp));
+      x_alu_ri(XI_ADD, RCX, 1);
+      x_zx8(RCX, RCX);
+      x_load8(RAX, RDX, RCX, 0);
+      x_alu_ri(XI_ADD, RCX, 1);
+      x_zx8(RCX, RCX);
+      x_load8(RSI, RDX, RCX, 0);
+      x_store8(RCX, RBX, NOINDEX, STATE(sp));
+      x_shift_ri(XS_SHL, RSI, 8);
+      x_alu_rr(X_OR, RAX, RSI);
+      x_alu_ri(XI_ADD, RAX, 1);
+      x_alu_ri(XI_ADD, R8, e->cycles);
+      x_store16(RAX, RBX, STATE(pc));
+      jit_exit();
+      return 1;
+  }
+
+  x_alu_ri(XI_ADD, R8, e->cycles);
+  return 0;
+}
+
+static void jit_flush(void) {
+  int i;
+  for(i = 0; i < BLOCK_CACHE; i++)
+    em->block_cache[i].jit = NULL;
+  em->jit_ptr = em->jit_buffer;
+  em->jit_stats->flushes++;
+}
+
+static void jit_translate(struct block *b) {
+  static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+  uint8_t *start = em->jit_ptr, *exit_ok, *exit_bail, *epilogue, *p;
+  uint16_t pc = b->start;
+  int i, r = 0;
+
+  jit_bail_count = jit_exit_count = 0;
+
+  for(i = 0; i < 6; i++)
+    x_push(saved[i]);
+  x_movq_ri(RBX, (uintptr_t)&em->state);
+  x_movq_ri(R15, (uintptr_t)em->page_read);
+  x_movq_ri(RBP, (uintptr_t)em->page_write);
+  x_load8(REG_A, RBX, NOINDEX, STATE(a));
+  x_load8(REG_X, RBX, NOINDEX, STATE(x));
+  x_load8(REG_Y, RBX, NOINDEX, STATE(y));
+  x_mov_ri(R8, 0);
+  /* Batches are short, so the low halves of the deadline and cycle will do */
+  x_movq_ri(RAX, (uintptr_t)&em->cpu_deadline);
+  x_load32(R10, RAX, 0);
+  x_sub_rm(R10, RBX, STATE(cycle));
+  X_TESTB_MI(RBX, STATE(flags), FLAG_D);
+  x_byte(0x0F);   // jnz - bail out in decimal mode
+  x_byte(0x85);
+  x_u32(0);
+  jit_bails[jit_bail_count].at = em->jit_ptr - 4;
+  jit_bails[jit_bail_count].pc = pc;
+  jit_bails[jit_bail_count].done = b->insns;
+  jit_bail_count++;
+  jit_start = pc;
+  jit_body  = em->jit_ptr;
+  /* Each trip counts the whole block, and bailing out takes back the rest */
+  x_addq_mi(RBX, STATE(instructions), b->insns);
+
+  for(i = 1; r == 0 && b->insn[i].opcode < BLOCK_SENTINEL; i++) {
+    uint16_t next = pc + b->insn[i].length;
+    jit_done = i-1;
+    r = jit_insn(&b->insn[i], pc, next);
+    pc = next;
+  }
+  if(r < 0) {
+    em->jit_ptr = start;
+    b->no_jit = 1;
+    em->jit_stats->untranslatable++;
+    return;
+  }
+  if(r == 0)
+    jit_exit_to(pc);
+
+  exit_ok = em->jit_ptr;
+  x_mov_ri(RAX, 1);
+  p = x_jmp();
+  exit_bail = em->jit_ptr;
+  x_mov_ri(RAX, 0);
+  epilogue = em->jit_ptr;
+  x_patch(p, epilogue);
+  x_store8(REG_A, RBX, NOINDEX, STATE(a));
+  x_store8(REG_X, RBX, NOINDEX, STATE(x));
+  x_store8(REG_Y, RBX, NOINDEX, STATE(y));
+  x_addq_mr(RBX, STATE(cycle), R8);
+  for(i = 5; i >= 0; i--)
+    x_pop(saved[i]);
+  x_byte(0xC3);
+
+  for(i = 0; i < jit_exit_count; i++)
+    x_patch(jit_exits[i], exit_ok);
+  for(i = 0; i < jit_bail_count; i++) {
+    x_patch(jit_bails[i].at, em->jit_ptr);
+    if(jit_bails[i].done < b->insns)
+      x_addq_mi(RBX, STATE(instructions), jit_bails[i].done - b->insns);
+    x_mov_ri(RCX, jit_bails[i].pc);
+    x_store16(RCX, RBX, STATE(pc));
+    x_patch(x_jmp(), exit_bail);
+  }
+
+  b->jit = start;
+  em->jit_stats->translated++;
+}
+
+/* Only the pages being translated into are writable, and only meanwhile */
+static void jit_compile(struct block *b) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uint8_t *first, *end;
+
+  if(em->jit_buffer + JIT_BUFFER_SIZE - em->jit_ptr < JIT_BLOCK_SPACE)
+    jit_flush();
+  first = em->jit_buffer + ((em->jit_ptr - em->jit_buffer) & -page);
+  end   = em->jit_buffer + ((em->jit_ptr + JIT_BLOCK_SPACE - em->jit_buffer + page-1) & -page);
+  if(mprotect(first, end - first, PROT_READ|PROT_WRITE) != 0) {
+    b->no_jit = 1;
+    return;
+  }
+  jit_translate(b);
+  mprotect(first, end - first, PROT_READ|PROT_EXEC);
+}
+
+/*****************************************************************
+* Running translated blocks
+*****************************************************************/
+static int jit_ready(struct block *b) {
+  if(!b->jit && !b->no_jit && ++b->count == JIT_THRESHOLD)
+    jit_compile(b);
+  return b->jit != NULL;
+}
+
+/* Called by block_decode() when a block is replaced */
+static void jit_discard(struct block *b, uint16_t pc) {
+  if(b->jit) {
+    if(b->pc == pc)
+      em->jit_stats->invalidated++;
+    else
+      em->jit_stats->evicted++;
+  }
+  b->jit    = NULL;
+  b->count  = 0;
+  b->no_jit = 0;
+  b->bails  = 0;
+}
+
+/*
+ * Runs translated blocks, starting with block_current, for as long as
+ * there are any and the deadline has not passed. Returns the block the
+ * interpreter should carry on with.
+ */
+static struct decoded *jit_run(const void *const *handlers) {
+  struct block *b = em->block_current;
+  uint64_t start = __builtin_ia32_rdtsc();
+  uint64_t cycle = em->state.cycle;
+  struct decoded *d;
+  int (*code)(void);
+
+  for(;;) {
+    em->jit_stats->runs++;
+#if EM6502_HISTORY
+    history_add(HISTORY_JIT);
+#endif
+    memcpy(&code, &b->jit, sizeof code);   // ISO C has no cast from data to code
+    if(!code()) {
+      em->jit_stats->bails++;
+      if(++b->bails == JIT_MAX_BAILS) {
+        b->jit    = NULL;
+        b->no_jit = 1;
+      }
+      d = block_find(em->state.pc, handlers);
+      break;
+    }
+    d = block_find(em->state.pc, handlers);
+    b = em->block_current;
+    if(!jit_ready(b) || em->state.cycle >= em->cpu_deadline)
+      break;
+  }
+
+  em->jit_stats->cycles += em->state.cycle - cycle;
+  em->jit_stats->ticks  += __builtin_ia32_rdtsc() - start;
+  return d;
+}
+
+static int jit_init(void) {
+  em->jit_buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ|PROT_EXEC,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(em->jit_buffer == MAP_FAILED) {
+    perror("Unable to map the JIT buffer");
+    return 0;
+  }
+  em->jit_ptr = em->jit_buffer;
+  em->jit_stats->start_ticks = __builtin_ia32_rdtsc();
+  return 1;
+}
+
+static void jit_report(void) {
+  const struct jit_stats *st = em->jit_stats;
+  uint64_t ticks = __builtin_ia32_rdtsc() - st->start_ticks;
+  printf("JIT: %llu blocks translated, %llu not translatable, %llu invalidated, "
+         "%llu evicted, %llu flushes\n",
+         (unsigned long long)st->translated, (unsigned long long)st->untranslatable,
+         (unsigned long long)st->invalidated, (unsigned long long)st->evicted,
+         (unsigned long long)st->flushes);
+  printf("JIT: %llu block runs, %llu bailed out to the interpreter\n",
+         (unsigned long long)st->runs, (unsigned long long)st->bails);
+  printf("JIT: %.1f%% of the time and %.1f%% of the cycles in translated code, "
+         "the rest in the interpreter\n",
+         ticks ? 100.0 * st->ticks / ticks : 0.0,
+         em->state.cycle ? 100.0 * st->cycles / em->state.cycle : 0.0);
+}
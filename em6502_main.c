@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "em6502.h"
+
+static em6502 *machine;
+
+/*****************************************************************
+* Video output
+*
+* -V streams frames to a file, FIFO or '-' for stdout, for piping
+* into an encoder: YUV4MPEG2 (4:4:4, BT.601) by default, or raw
+* 8-bit RGB with '-F rgb'. A frame goes out every -N VIC frames,
+* changed or not, each in a single write().
+*****************************************************************/
+#define VIC_FRAME_RATE    50          // PAL
+
+#define VIDEO_Y4M_FRAME   "FRAME\n"
+#define VIDEO_PIXELS      (EM6502_DISPLAY_WIDTH*EM6502_DISPLAY_HEIGHT)
+
+static int          video_fd = -1;
+static int          video_rgb;
+static int          video_every = 1;
+static uint8_t     *video_buffer;      // a Y4M frame, header and planes
+
+static int video_write(const void *data, size_t size) {
+  const uint8_t *p = data;
+  while(size) {
+    ssize_t done = write(video_fd, p, size);
+    if(done < 0) {
+      perror("Video output");
+      close(video_fd);
+      video_fd = -1;
+      return 0;
+    }
+    p    += done;
+    size -= done;
+  }
+  return 1;
+}
+
+static int video_open(const char *filename) {
+  char header[100];
+  if(strcmp(filename, "-") == 0) {
+    /* The frames get stdout to themselves, and everything else goes to stderr */
+    fflush(stdout);
+    video_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  } else {
+    video_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  }
+  if(video_fd < 0) {
+    fprintf(stderr, "Unable to open '%s'\n", filename);
+    return 0;
+  }
+  /* An encoder that goes away ends the stream, not the run */
+  signal(SIGPIPE, SIG_IGN);
+  if(video_rgb)
+    return 1;
+  video_buffer = malloc(strlen(VIDEO_Y4M_FRAME) + 3*VIDEO_PIXELS);
+  if(video_buffer == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 0;
+  }
+  memcpy(video_buffer, VIDEO_Y4M_FRAME, strlen(VIDEO_Y4M_FRAME));
+  sprintf(header, "YUV4MPEG2 W%i H%i F%i:%i Ip A1:1 C444\n",
+          EM6502_DISPLAY_WIDTH, EM6502_DISPLAY_HEIGHT, VIC_FRAME_RATE, video_every);
+  return video_write(header, strlen(header));
+}
+
+static void video_frame(const struct em6502_display *display) {
+  const uint8_t *rgb = display->rgb[0][0];
+  uint8_t *y = video_buffer + strlen(VIDEO_Y4M_FRAME);
+  uint8_t *u = y + VIDEO_PIXELS;
+  uint8_t *v = u + VIDEO_PIXELS;
+  int i;
+
+  if(video_fd < 0)
+    return;
+  if(video_rgb) {
+    video_write(rgb, sizeof(display->rgb));
+    return;
+  }
+  for(i = 0; i < VIDEO_PIXELS; i++, rgb += 3) {
+    int r = rgb[0], g = rgb[1], b = rgb[2];
+    y[i] = ( 66*r + 129*g +  25*b + 128 + ( 16<<8)) >> 8;
+    u[i] = (-38*r -  74*g + 112*b + 128 + (128<<8)) >> 8;
+    v[i] = (112*r -  94*g -  18*b + 128 + (128<<8)) >> 8;
+  }
+  video_write(video_buffer, v + VIDEO_PIXELS - video_buffer);
+}
+
+/*****************************************************************
+* Frame queue
+*
+* Frames are converted and written out on a thread of their own, so
+* the emulator can keep a core to itself. At the end of a frame the
+* emulator copies the VIC's picture into the next slot of a single
+* producer, single consumer ring, and the output thread takes them
+* from the other end. If the ring is full the frame is dropped
+* rather than holding up the emulation.
+*****************************************************************/
+#define FRAME_QUEUE  8           // slots in the ring
+
+static struct em6502_display frame_slots[FRAME_QUEUE];
+static atomic_uint           frame_head;   // only written by the emulator
+static atomic_uint           frame_tail;   // only written by the output thread
+static sem_t                 frame_ready;  // posted per frame, and once to stop
+static pthread_t             frame_thread;
+static int                   frame_running;
+static unsigned              frame_dropped;
+
+/* Streams the frame, or rewrites display.ppm with it */
+static void frame_show(const struct em6502_display *display) {
+  FILE *f;
+
+  if(video_fd >= 0) {
+    video_frame(display);
+    return;
+  }
+  f = fopen("display.ppm", "wb");
+  if(f == NULL)
+    return;
+  fprintf(f, "P6\n%i %i\n255\n", EM6502_DISPLAY_WIDTH, EM6502_DISPLAY_HEIGHT);
+  fwrite(display->rgb, sizeof(display->rgb), 1, f);
+  fclose(f);
+}
+
+static void *frame_output(void *arg) {
+  for(;;) {
+    unsigned tail = atomic_load_explicit(&frame_tail, memory_order_relaxed);
+    if(sem_wait(&frame_ready) != 0)
+      continue;
+    /* A post with nothing queued is the signal to stop */
+    if(tail == atomic_load_explicit(&frame_head, memory_order_acquire))
+      return NULL;
+    frame_show(&frame_slots[tail % FRAME_QUEUE]);
+    atomic_store_explicit(&frame_tail, tail+1, memory_order_release);
+  }
+}
+
+/* Only a changed frame is worth rewriting display.ppm for */
+static void frame_queue(void) {
+  unsigned head = atomic_load_explicit(&frame_head, memory_order_relaxed);
+  if(head - atomic_load_explicit(&frame_tail, memory_order_acquire) == FRAME_QUEUE) {
+    frame_dropped++;
+    return;
+  }
+  if(!em6502_get_frame(machine, &frame_slots[head % FRAME_QUEUE]) && video_fd < 0)
+    return;
+  atomic_store_explicit(&frame_head, head+1, memory_order_release);
+  sem_post(&frame_ready);
+}
+
+/* Without a thread, frames are shown as they come */
+static void frame_start(void) {
+  sigset_t all, old;
+  if(sem_init(&frame_ready, 0, 0) != 0)
+    return;
+  /* Signals are for the emulator's thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  frame_running = pthread_create(&frame_thread, NULL, frame_output, NULL) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if(!frame_running)
+    sem_destroy(&frame_ready);
+}
+
+/* Waits for the queued frames to be shown */
+static void frame_stop(void) {
+  if(!frame_running)
+    return;
+  sem_post(&frame_ready);
+  pthread_join(frame_thread, NULL);
+  sem_destroy(&frame_ready);
+  frame_running = 0;
+  if(frame_dropped)
+    fprintf(stderr, "Dropped %u frames\n", frame_dropped);
+}
+
+/*****************************************************************
+* Headless runs
+*
+* With -H nothing is shown unless frames are asked for with -f, and
+* a report is printed when the run ends, one 'key=value' per line.
+* A run ends after -c cycles or -t seconds of host time, when the PC
+* reaches -x, or when -m's value is written to its address.
+*****************************************************************/
+#define RUN_BATCH  1000000       // cycles between checks of the limits
+
+static int          run_headless;
+static uint64_t     run_frame_cycles = 3000000;
+static uint64_t     run_max_cycles;
+static double       run_max_seconds;
+static const char  *run_save_file;       // -S, written at the end and on SIGUSR1
+static volatile sig_atomic_t run_usr1_pending;
+static double       run_start;
+static int          run_frame_every;     // frames, from run_frame_cycles
+static int          run_frame_count;
+static uint8_t      run_keys[256];       // waiting for room in the keyboard buffer
+static int          run_key_count;
+
+static double run_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run_parse_hex(char *arg, int32_t *value, unsigned max) {
+  char *end;
+  unsigned long v = strtoul(arg, &end, 16);
+  if(*arg == '\0' || *end != '\0' || v > max) {
+    fprintf(stderr, "Bad hex value '%s'\n", arg);
+    return 0;
+  }
+  *value = v;
+  return 1;
+}
+
+static int run_parse_match(char *arg) {
+  char *value = strchr(arg, '=');
+  int32_t a, v;
+  if(value == NULL) {
+    fprintf(stderr, "Expected address=value, not '%s'\n", arg);
+    return 0;
+  }
+  *value++ = '\0';
+  if(!run_parse_hex(arg, &a, 0xFFFF) || !run_parse_hex(value, &v, 0xFF))
+    return 0;
+  em6502_stop_on_write(machine, a, v);
+  return 1;
+}
+
+static void run_report(FILE *f, const char *reason, double seconds) {
+  struct em6502_regs regs;
+  em6502_get_regs(machine, &regs);
+  fprintf(f, "exit=%s\n", reason);
+  fprintf(f, "cycles=%llu\n", (unsigned long long)regs.cycle);
+  fprintf(f, "instructions=%llu\n", (unsigned long long)regs.instructions);
+  fprintf(f, "host_seconds=%.6f\n", seconds);
+  fprintf(f, "emulated_mhz=%.3f\n", seconds > 0 ? regs.cycle / seconds / 1e6 : 0.0);
+  fprintf(f, "pc=%04X\n", regs.pc);
+  fprintf(f, "a=%02X\n", regs.a);
+  fprintf(f, "x=%02X\n", regs.x);
+  fprintf(f, "y=%02X\n", regs.y);
+  fprintf(f, "sp=%02X\n", regs.sp);
+  fprintf(f, "flags=%02X\n", regs.flags);
+}
+
+/* Moves typed keys into the KERNAL's keyboard buffer as it makes room */
+#define KEY_BUFFER  0x0277
+#define KEY_COUNT   0x00C6
+#define KEY_MAX     10
+
+static void run_feed_keys(void) {
+  int n = em6502_read(machine, KEY_COUNT), i = 0;
+  while(i < run_key_count && n < KEY_MAX)
+    em6502_write(machine, KEY_BUFFER + n++, run_keys[i++]);
+  if(i == 0)
+    return;
+  em6502_write(machine, KEY_COUNT, n);
+  run_key_count -= i;
+  memmove(run_keys, run_keys + i, run_key_count);
+}
+
+/* Hands the frame to the output thread, or shows it here without one */
+static void run_display(void) {
+  static struct em6502_display display;
+  if(frame_running) {
+    frame_queue();
+    return;
+  }
+  if(em6502_get_frame(machine, &display) || video_fd >= 0)
+    frame_show(&display);
+}
+
+/* Called by the machine as it finishes each frame */
+static void run_frame(void *ctx) {
+  if(++run_frame_count < run_frame_every)
+    return;
+  run_frame_count = 0;
+  run_display();
+}
+
+/* Shows a frame every run_frame_cycles, to the nearest whole frame, or never for 0 */
+static void run_set_frames(uint64_t cycles) {
+  run_frame_cycles = cycles;
+  run_frame_every  = (cycles + EM6502_FRAME_CYCLES/2) / EM6502_FRAME_CYCLES;
+  if(run_frame_every < 1)
+    run_frame_every = 1;
+  run_frame_count  = 0;
+  em6502_on_frame(machine, cycles ? run_frame : NULL, NULL);
+}
+
+/* SIGUSR1's dumps and save, once the batch it came in has finished */
+static void run_usr1(void) {
+  run_usr1_pending = 0;
+  em6502_dump(machine);
+  em6502_dump_zeropage(machine);
+  em6502_dump_history(machine);
+  em6502_print_stats(machine);
+  if(run_save_file)
+    em6502_save_state(machine, run_save_file);
+}
+
+/* Runs until max_cycles, if not 0, or one of the other limits, and returns why it stopped */
+static const char *run(uint64_t max_cycles) {
+  struct em6502_regs regs;
+  em6502_get_regs(machine, &regs);
+  for(;;) {
+    uint64_t end = regs.cycle + RUN_BATCH;
+    if(max_cycles && end > max_cycles)
+      end = max_cycles;
+    /* Only when a restored state is already past the limit */
+    if(end <= regs.cycle)
+      return "cycles";
+    if(run_key_count)
+      run_feed_keys();
+    if(!em6502_run(machine, end - regs.cycle))
+      return em6502_stop_reason(machine);
+    em6502_get_regs(machine, &regs);
+    if(run_usr1_pending)
+      run_usr1();
+    if(max_cycles && regs.cycle >= max_cycles)
+      return "cycles";
+    if(run_max_seconds && run_clock() - run_start >= run_max_seconds)
+      return "time";
+  }
+}
+
+/*****************************************************************
+* ROM sets
+*
+* ROM images are mapped read only rather than read, so every
+* instance running the same images shares one copy of them in the
+* page cache. The set is rom1.img at $C000, rom2.img at $E000 and
+* rom3.img at $8000, unless -r says otherwise, with ADDR=FILE or a
+* file of such lines. Images are known by their CRC-32; unknown ones
+* still load, as test ROMs are often home made.
+*****************************************************************/
+#define ROM_SET_SIZE  3
+#define ROM_NAME_SIZE 1024        // as long as a line of a ROM set file
+
+struct rom_revision {
+  uint32_t    crc;
+  uint16_t    base;
+  const char *name;
+};
+
+static const struct rom_revision rom_revisions[] = {
+  { 0xDB4C43C1, 0xC000, "BASIC 901486-01" },
+  { 0xE5E7C174, 0xE000, "KERNAL 901486-06 (NTSC)" },
+  { 0x4BE07CB4, 0xE000, "KERNAL 901486-07 (PAL)" },
+  { 0x83E032A6, 0x8000, "characters 901460-03" },
+};
+
+static struct rom_image {
+  uint16_t    base;
+  char        filename[ROM_NAME_SIZE];
+} rom_set[ROM_SET_SIZE] = {
+  { 0xC000, "rom1.img" },
+  { 0xE000, "rom2.img" },
+  { 0x8000, "rom3.img" },
+};
+
+static int rom_set_add(char *arg) {
+  char *file = strchr(arg, '=');
+  int32_t base;
+  int i;
+  if(file == NULL) {
+    fprintf(stderr, "Expected address=file, not '%s'\n", arg);
+    return 0;
+  }
+  *file++ = '\0';
+  if(!run_parse_hex(arg, &base, 0xFFFF))
+    return 0;
+  for(i = 0; i < ROM_SET_SIZE; i++) {
+    if(rom_set[i].base == base) {
+      if(strlen(file) >= ROM_NAME_SIZE) {
+        fprintf(stderr, "ROM file name too long '%s'\n", file);
+        return 0;
+      }
+      strcpy(rom_set[i].filename, file);
+      return 1;
+    }
+  }
+  fprintf(stderr, "No ROM goes at %04X\n", base);
+  return 0;
+}
+
+/* -r takes either one ADDR=FILE or a file of them, one per line */
+static int rom_set_load(char *arg) {
+  char line[1024];
+  int ok = 1;
+  FILE *f;
+  if(strchr(arg, '='))
+    return rom_set_add(arg);
+  f = fopen(arg, "r");
+  if(f == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", arg);
+    return 0;
+  }
+  while(ok && fgets(line, sizeof(line), f)) {
+    char *p = line + strspn(line, " \t");
+    p[strcspn(p, "\r\n")] = '\0';
+    if(*p == '#' || *p == '\0')
+      continue;
+    ok = rom_set_add(p);
+  }
+  fclose(f);
+  return ok;
+}
+
+static int rom_map(const struct rom_image *rom) {
+  struct stat st;
+  const uint8_t *data;
+  uint32_t crc;
+  size_t i;
+  int fd = open(rom->filename, O_RDONLY);
+  if(fd < 0) {
+    fprintf(stderr, "Unable to open '%s'\n", rom->filename);
+    return 0;
+  }
+  if(fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "Unable to read '%s'\n", rom->filename);
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) {
+    fprintf(stderr, "Unable to map '%s'\n", rom->filename);
+    return 0;
+  }
+  if(!em6502_load_rom(machine, rom->base, data, st.st_size)) {
+    munmap((void *)data, st.st_size);
+    return 0;
+  }
+  crc = em6502_crc32(data, st.st_size);
+  for(i = 0; i < sizeof(rom_revisions)/sizeof(rom_revisions[0]); i++) {
+    if(rom_revisions[i].crc != crc)
+      continue;
+    printf("%04X: %s from %s\n", rom->base, rom_revisions[i].name, rom->filename);
+    if(rom_revisions[i].base != rom->base)
+      printf("Warning: %s belongs at %04X\n", rom_revisions[i].name, rom_revisions[i].base);
+    return 1;
+  }
+  printf("%04X: unknown ROM %08X from %s\n", rom->base, crc, rom->filename);
+  return 1;
+}
+
+static int bp_load(char *filename) {
+  char line[256];
+  int ok = 1;
+  FILE *f = fopen(filename, "r");
+  if(f == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", filename);
+    return 0;
+  }
+  while(ok && fgets(line, sizeof(line), f)) {
+    char *p = line + strspn(line, " \t");
+    if(*p == '#' || *p == '\n' || *p == '\0')
+      continue;
+    ok = em6502_add_breakpoint(machine, p);
+  }
+  fclose(f);
+  return ok;
+}
+
+#include "em6502_bench.h"
+#include "em6502_checkpoint.h"
+
+/* Nothing else is safe in a signal handler, so run() does the work */
+static void sighandler_usr1(int v) {
+   run_usr1_pending = 1;
+}
+
+int main(int argc, char *argv[]) {
+   int i, frames = 0;
+   int32_t value;
+   char *bench = NULL;
+   char *restore = NULL;
+   char *video = NULL;
+   char *trace_file = NULL;
+   char *trace_filter = NULL;
+   const char *reason;
+   uint64_t limit;
+   struct em6502_regs regs;
+
+   machine = em6502_create();
+   if(machine == NULL) {
+      fprintf(stderr, "Unable to create the machine\n");
+      return 1;
+   }
+   for(i = 1; i < argc; i++) {
+      if(strcmp(argv[i],"-j")==0) {
+         em6502_enable_jit(machine);
+         continue;
+      }
+      if(strcmp(argv[i],"-H")==0) {
+         run_headless = 1;
+         continue;
+      }
+      if(i+1 == argc) {
+         printf("Unknown opton\n");
+         exit(1);
+      }
+      if(strcmp(argv[i],"-v")==0) {
+         em6502_trace(machine, atoi(argv[++i]));
+      } else if(strcmp(argv[i],"-T")==0) {
+         trace_file = argv[++i];
+      } else if(strcmp(argv[i],"-L")==0) {
+         trace_filter = argv[++i];
+      } else if(strcmp(argv[i],"-b")==0) {
+         if(!em6502_add_breakpoint(machine, argv[++i]))
+            exit(1);
+      } else if(strcmp(argv[i],"-B")==0) {
+         if(!bp_load(argv[++i]))
+            exit(1);
+      } else if(strcmp(argv[i],"-P")==0) {
+         if(!em6502_profile(machine, argv[++i]))
+            exit(1);
+      } else if(strcmp(argv[i],"-f")==0) {
+         run_frame_cycles = strtoull(argv[++i], NULL, 10);
+         frames = 1;
+      } else if(strcmp(argv[i],"-c")==0) {
+         run_max_cycles = strtoull(argv[++i], NULL, 10);
+      } else if(strcmp(argv[i],"-t")==0) {
+         run_max_seconds = atof(argv[++i]);
+      } else if(strcmp(argv[i],"-x")==0) {
+         if(!run_parse_hex(argv[++i], &value, 0xFFFF))
+            exit(1);
+         em6502_stop_at(machine, value);
+      } else if(strcmp(argv[i],"-m")==0) {
+         if(!run_parse_match(argv[++i]))
+            exit(1);
+      } else if(strcmp(argv[i],"-k")==0) {
+         bench = argv[++i];
+      } else if(strcmp(argv[i],"-S")==0) {
+         run_save_file = argv[++i];
+      } else if(strcmp(argv[i],"-R")==0) {
+         restore = argv[++i];
+      } else if(strcmp(argv[i],"-r")==0) {
+         if(!rom_set_load(argv[++i]))
+            exit(1);
+      } else if(strcmp(argv[i],"-V")==0) {
+         video = argv[++i];
+      } else if(strcmp(argv[i],"-F")==0) {
+         i++;
+         if(strcmp(argv[i],"rgb")==0) {
+            video_rgb = 1;
+         } else if(strcmp(argv[i],"y4m")!=0) {
+            fprintf(stderr, "Unknown video format '%s'\n", argv[i]);
+            exit(1);
+         }
+      } else if(strcmp(argv[i],"-N")==0) {
+         video_every = atoi(argv[++i]);
+         if(video_every < 1)
+            video_every = 1;
+      } else if(strcmp(argv[i],"-C")==0) {
+         checkpoint_cycle = strtoull(argv[++i], NULL, 10);
+         checkpoint_set   = 1;
+      } else if(strcmp(argv[i],"-I")==0) {
+         if(!checkpoint_load(argv[++i]))
+            exit(1);
+      } else if(strcmp(argv[i],"-J")==0) {
+         checkpoint_jobs = atoi(argv[++i]);
+      } else {
+         printf("Unknown opton\n");
+         exit(1);
+      }
+   }
+   if(checkpoint_set != (checkpoint_count > 0)) {
+      fprintf(stderr, "-C and -I must be given together, with at least one input script\n");
+      exit(1);
+   }
+   if(run_headless && !frames)
+      run_frame_cycles = 0;
+   if(video) {
+      if(!video_open(video))
+         exit(1);
+      run_frame_cycles = (uint64_t)EM6502_FRAME_CYCLES * video_every;
+   }
+   run_set_frames(run_frame_cycles);
+   signal(SIGUSR1, sighandler_usr1);
+
+   if(bench) {
+      /* Each benchmark resets the machine, so the trace is one run after another */
+      if(trace_file && !em6502_trace_file(machine, trace_file, trace_filter))
+         exit(1);
+      i = bench_run(bench, run_max_cycles ? run_max_cycles : BENCH_CYCLES);
+      em6502_destroy(machine);
+      return i ? 0 : 1;
+   }
+
+   if(rom_map(&rom_set[0]) && rom_map(&rom_set[1]) && rom_map(&rom_set[2])) {
+      em6502_reset(machine);
+      if(restore && !em6502_restore_state(machine, restore))
+         exit(1);
+      if(trace_file && !em6502_trace_file(machine, trace_file, trace_filter))
+         exit(1);
+      em6502_get_regs(machine, &regs);
+      run_start = run_clock();
+      limit = run_max_cycles;
+      /* Only a checkpoint before the -c limit is ever reached */
+      checkpoint_set = checkpoint_set && (!limit || checkpoint_cycle < limit);
+      if(checkpoint_set)
+         limit = checkpoint_cycle;
+      if(run_frame_cycles)
+         frame_start();
+      /* run(0) would run without a limit, so a checkpoint already reached forks now */
+      if(checkpoint_set && regs.cycle >= checkpoint_cycle)
+         reason = "cycles";
+      else
+         reason = run(limit);
+      frame_stop();
+      /* The checkpoint's children would have no writer thread */
+      em6502_trace_file(machine, NULL, NULL);
+      if(checkpoint_set && strcmp(reason, "cycles") == 0) {
+         i = checkpoint_explore();
+         em6502_destroy(machine);
+         return i;
+      }
+      if(strcmp(reason, "fault") == 0) {
+         em6502_get_regs(machine, &regs);
+         printf("Unknown opcode at address %04X %02X\n",
+                (uint16_t)(regs.pc-1), em6502_read(machine, regs.pc-1));
+         em6502_dump(machine);
+         em6502_dump_history(machine);
+         em6502_save_display(machine, "display.ppm");
+      }
+      em6502_print_stats(machine);
+      if(run_save_file)
+         em6502_save_state(machine, run_save_file);
+      if(run_headless)
+         run_report(stdout, reason, run_clock() - run_start);
+   }
+   em6502_destroy(machine);
+   return 0;
+}
@@ -0,0 +1,971 @@
+/********************************************************************************
+* The CPU interpreter - cpu_run_cycles()
+*
+* This file is included twice by em6502.c. With TRACING set to 0 it builds
+* the production interpreter, where all the trace bookkeeping is compiled
+* out, the registers live in locals for the whole batch and memory is
+* accessed straight through the page table. With TRACING set to 1 it builds
+* the diagnostic interpreter, which works on 'state' directly and traces,
+* checks PC breakpoints and marks dispatched[] on every instruction. It is
+* also used whenever breakpoints or watchpoints are set. OPS()
+* gives each instantiation its own names.
+*
+* cpu_run_cycles() runs instructions until 'cycles' have passed or until
+* cpu_deadline is pulled in by cpu_break(). It returns 0 if emulation
+* should stop. With GCC and Clang every handler ends with its own computed
+* goto to the next handler, otherwise a switch is used.
+********************************************************************************/
+#if TRACING
+#define HIST_NEXT      machine->history_next
+#define A              machine->state.a
+#define X              machine->state.x
+#define Y              machine->state.y
+#define SP             machine->state.sp
+#define PC             machine->state.pc
+#define FLAGS          machine->state.flags
+#define N_RES          machine->state.n_res
+#define Z_RES          machine->state.z_res
+#define CARRY          machine->state.carry
+#define OVERFLOW       machine->state.overflow
+#define CYCLES         machine->state.cycle
+#define SYNC()         ((void)0)
+#define SYNC_CYCLES()  ((void)0)
+#define TRACE(msg)     trace(msg)
+#define TRACE_NUM(n)   (machine->trace_num = (n))
+#define FETCH()        mem_fetch(PC)
+#define BYTE_OPERAND() FETCH()
+#define ABS_OPERAND()  (ea = FETCH(), ea |= FETCH()<<8, TRACE_NUM(ea))
+#define READ(addr)     mem_read(addr)
+#define WRITE(addr,d)  mem_write(addr,d)
+#else
+#define HIST_NEXT      reg_hist
+#define A              reg_a
+#define X              reg_x
+#define Y              reg_y
+#define SP             reg_sp
+#define PC             reg_pc
+#define FLAGS          reg_flags
+#define N_RES          reg_n
+#define Z_RES          reg_z
+#define CARRY          reg_c
+#define OVERFLOW       reg_v
+#define CYCLES         reg_cycle
+#define SYNC()         (machine->state.a = A, machine->state.x = X,              \
+                        machine->state.y = Y, machine->state.sp = SP,            \
+                        machine->state.pc = PC, machine->state.flags = FLAGS,    \
+                        machine->state.n_res = N_RES,                            \
+                        machine->state.z_res = Z_RES,                            \
+                        machine->state.carry = CARRY,                            \
+                        machine->state.overflow = OVERFLOW,                      \
+                        machine->state.cycle = CYCLES,                           \
+                        machine->history_next = HIST_NEXT)
+#define SYNC_CYCLES()  (machine->state.cycle = CYCLES)
+#define RELOAD()       (A = machine->state.a, X = machine->state.x,              \
+                        Y = machine->state.y, SP = machine->state.sp,            \
+                        PC = machine->state.pc, FLAGS = machine->state.flags,    \
+                        N_RES = machine->state.n_res,                            \
+                        Z_RES = machine->state.z_res,                            \
+                        CARRY = machine->state.carry,                            \
+                        OVERFLOW = machine->state.overflow,                      \
+                        CYCLES = machine->state.cycle,                           \
+                        HIST_NEXT = machine->history_next)
+#define TRACE(msg)
+#define TRACE_NUM(n)   ((void)0)
+/* Opcodes and operands come predecoded from the block cache */
+#define BYTE_OPERAND() ((uint8_t)di->operand)
+#define ABS_OPERAND()  (ea = di->operand)
+/* I/O pages only get to see the cycle count - anything that looks at the
+   other registers mid-batch, like a watchpoint, needs the diagnostic build */
+#define READ(addr)     (ra = (addr), machine->page_read[ra>>8]                    \
+                          ? machine->page_read[ra>>8][ra&0xFF]                   \
+                          : (SYNC_CYCLES(), machine->page_io_read[ra>>8](ra)))
+#define WRITE(addr,d)  do {                                           \
+                          uint16_t wa = (addr);                       \
+                          uint8_t  wd = (d);                          \
+                          if(machine->page_write[wa>>8]) {            \
+                            machine->page_write[wa>>8][wa&0xFF] = wd; \
+                          } else {                                    \
+                            SYNC_CYCLES();                            \
+                            machine->page_io_write[wa>>8](wa, wd);    \
+                          }                                           \
+                       } while(0)
+#endif
+
+/* Packs the registers, flags as they are kept, into 64 bits, for idle
+   loop detection and the history. The top byte can never be all ones,
+   so ~0 matches nothing. */
+#define PACK_REGS()    ((uint64_t)A | (uint64_t)X << 8 | (uint64_t)Y << 16 |          \
+                        (uint64_t)SP << 24 | (uint64_t)FLAGS << 32 |                \
+                        (uint64_t)N_RES << 40 | (uint64_t)Z_RES << 48 |             \
+                        (uint64_t)(CARRY | (OVERFLOW & 0x80)) << 56)
+
+/*
+ * Lazy flags - N and Z come from the last result, C is kept as 0 or 1 and
+ * V as bit 7 of an expression of the operands. FLAGS only holds I, D and B,
+ * and the full byte is only put together when something reads it.
+ */
+#define SET_NZ(r)      (N_RES = Z_RES = (r))
+#define GET_FLAGS()    ((FLAGS & ~(FLAG_N|FLAG_V|FLAG_Z|FLAG_C)) | (N_RES & FLAG_N) | \
+                        ((OVERFLOW & 0x80) >> 1) | (Z_RES ? 0 : FLAG_Z) | CARRY)
+#define SET_FLAGS(p)   (FLAGS = (p), N_RES = FLAGS, Z_RES = ~FLAGS & FLAG_Z, \
+                        CARRY = FLAGS & FLAG_C, OVERFLOW = FLAGS << 1)
+
+/*
+ * ADC and SBC. Binary mode is a handful of branch free operations on the
+ * lazy flags, decimal mode looks up the result and flags in the tables
+ * built by alu_init(). SBC is ADC of the inverted operand in binary mode.
+ */
+#define SET_NVZC(p)    (N_RES = (p), Z_RES = ~(p) & FLAG_Z, CARRY = (p) & FLAG_C, \
+                        OVERFLOW = (p) << 1)
+#define ALU_BINARY(m)  (alu = A + (m) + CARRY, OVERFLOW = ~(A ^ (m)) & (A ^ alu), \
+                        CARRY = alu >> 8, A = alu, SET_NZ(A))
+#define ALU_ADC(m)     do {                                            \
+                          uint8_t am = (m);                            \
+                          if(FLAGS & FLAG_D) {                         \
+                            alu = alu_bcd_adc[CARRY][A][am];           \
+                            A = alu;                                   \
+                            SET_NVZC(alu >> 8);                        \
+                          } else {                                     \
+                            ALU_BINARY(am);                            \
+                          }                                            \
+                       } while(0)
+#define ALU_SBC(m)     do {                                            \
+                          uint8_t am = (m);                            \
+                          if(FLAGS & FLAG_D) {                         \
+                            alu = alu_bcd_sbc[CARRY][A][am];           \
+                            A = alu;                                   \
+                            SET_NVZC(alu >> 8);                        \
+                          } else {                                     \
+                            am ^= 0xFF;                                \
+                            ALU_BINARY(am);                            \
+                          }                                            \
+                       } while(0)
+
+/* The stack, and taking an interrupt */
+#define PUSH(v)        do { WRITE(0x100 | SP, (v)); SP--; } while(0)
+#define PULL()         (SP++, READ(0x100 | SP))
+#define INTERRUPT(vector, p)  do {                                     \
+                          PUSH(PC >> 8);                               \
+                          PUSH(PC & 0xFF);                             \
+                          PUSH(p);                                     \
+                          FLAGS |= FLAG_I;                             \
+                          PC  = READ(vector);                          \
+                          PC |= READ((vector) + 1) << 8;               \
+                       } while(0)
+/* Clearing I with the IRQ line active ends the batch, so that the
+   interrupt is taken */
+#define IRQ_CHECK()    (machine->irq && !(FLAGS & FLAG_I)                \
+                          ? (void)(machine->cpu_deadline = CYCLES) : (void)0)
+
+#define COMPARE(r, v)  (CARRY = (r) >= (v), SET_NZ((uint8_t)((r) - (v))))
+
+/*
+ * Addressing modes - each one is a single sequenced expression that
+ * leaves the effective address in 'ea'. JMP (ind) does not carry into
+ * the high byte of the pointer, as on the NMOS part.
+ */
+#define ZP_POINTER()   (ea = READ(zp), ea |= READ((uint8_t)(zp+1))<<8)
+#define ADDR_ZPG()     (ea = BYTE_OPERAND(), TRACE_NUM(ea), ea)
+#define ADDR_ZPX()     (ea = BYTE_OPERAND(), TRACE_NUM(ea), ea = (uint8_t)(ea+X))
+#define ADDR_ZPY()     (ea = BYTE_OPERAND(), TRACE_NUM(ea), ea = (uint8_t)(ea+Y))
+#define ADDR_ABS()     (ABS_OPERAND(), ea)
+#define ADDR_ABX()     (ABS_OPERAND(), ea += X)
+#define ADDR_ABY()     (ABS_OPERAND(), ea += Y)
+#define ADDR_IND()     (ABS_OPERAND(), ptr = ea, ea = READ(ptr),               \
+                        ea |= READ((ptr & 0xFF00) | ((ptr+1) & 0xFF))<<8)
+#define ADDR_IZX()     (zp = BYTE_OPERAND(), TRACE_NUM(zp), zp += X, ZP_POINTER(), ea)
+#define ADDR_IZY()     (zp = BYTE_OPERAND(), TRACE_NUM(zp), ZP_POINTER(), ea += Y)
+#define RELATIVE()     (ea = BYTE_OPERAND(), TRACE_NUM((int8_t)ea), (int8_t)ea)
+
+/* Operands for instructions that read - indexing into the next page
+   costs an extra cycle. NOP is the only implied instruction that reads. */
+#define PAGE_CROSS(r)  (CYCLES += ((ea & 0xFF) + (r)) >> 8)
+#define LOAD_IMP()     0
+#define LOAD_IMM()     (ea = BYTE_OPERAND(), TRACE_NUM(ea), (uint8_t)ea)
+#define LOAD_ZPG()     READ(ADDR_ZPG())
+#define LOAD_ZPX()     READ(ADDR_ZPX())
+#define LOAD_ZPY()     READ(ADDR_ZPY())
+#define LOAD_ABS()     READ(ADDR_ABS())
+#define LOAD_ABX()     (ABS_OPERAND(), PAGE_CROSS(X), READ(ea += X))
+#define LOAD_ABY()     (ABS_OPERAND(), PAGE_CROSS(Y), READ(ea += Y))
+#define LOAD_IZX()     READ(ADDR_IZX())
+#define LOAD_IZY()     (zp = BYTE_OPERAND(), TRACE_NUM(zp), ZP_POINTER(), PAGE_CROSS(Y), \
+                        READ(ea += Y))
+
+/* Read-modify-write, on the accumulator or on memory */
+#define MODIFY_ACC(body)        { uint8_t m = A; body; A = m; }
+#define MODIFY_MEM(addr, body)  { uint8_t m = READ(addr); body; WRITE(ea, m); }
+#define MODIFY_ZPG(body)        MODIFY_MEM(ADDR_ZPG(), body)
+#define MODIFY_ZPX(body)        MODIFY_MEM(ADDR_ZPX(), body)
+#define MODIFY_ABS(body)        MODIFY_MEM(ADDR_ABS(), body)
+#define MODIFY_ABX(body)        MODIFY_MEM(ADDR_ABX(), body)
+#define MODIFY_ABY(body)        MODIFY_MEM(ADDR_ABY(), body)
+#define MODIFY_IZX(body)        MODIFY_MEM(ADDR_IZX(), body)
+#define MODIFY_IZY(body)        MODIFY_MEM(ADDR_IZY(), body)
+
+/*
+ * Each operation is its kind followed by what it does:
+ *   I - implied, the body is all there is
+ *   P - implied, and pushes onto the stack
+ *   R - reads its operand into 'm'
+ *   W - stores the value given
+ *   M - read-modify-write of 'm'
+ *   F - implied, and changes the flow of control
+ *   J - jumps, with the target address in 'ea'
+ *   B - branches if the condition given is true
+ */
+#define EXEC(op, mode)           EXEC_(mode, op)
+#define EXEC_(mode, kind, body)  EXEC_##kind(mode, body)
+#define EXEC_I(mode, body)       body
+#define EXEC_P(mode, body)       body
+#define EXEC_F(mode, body)       body
+#define EXEC_R(mode, body)       { uint8_t m = LOAD_##mode(); body; }
+#define EXEC_W(mode, value)      WRITE(ADDR_##mode(), value)
+#define EXEC_M(mode, body)       MODIFY_##mode(body)
+#define EXEC_J(mode, body)       { (void)ADDR_##mode(); body; }
+#define EXEC_B(mode, cond)       {                                        \
+                                   int8_t rel = RELATIVE();               \
+                                   if(cond) {                             \
+                                     ea = PC + rel;                       \
+                                     CYCLES += 1 + ((ea ^ PC) > 0xFF);    \
+                                     PC = ea;                             \
+                                   }                                      \
+                                 }
+
+#define ADC_OP  R, ALU_ADC(m)
+#define AND_OP  R, (A &= m, SET_NZ(A))
+#define ASL_OP  M, (CARRY = m >> 7, m <<= 1, SET_NZ(m))
+#define BCC_OP  B, !CARRY
+#define BCS_OP  B, CARRY
+#define BEQ_OP  B, !Z_RES
+#define BIT_OP  R, (Z_RES = A & m, N_RES = m, OVERFLOW = m << 1)
+#define BMI_OP  B, N_RES & 0x80
+#define BNE_OP  B, Z_RES
+#define BPL_OP  B, !(N_RES & 0x80)
+#define BRK_OP  F, { PC++; INTERRUPT(0xFFFE, GET_FLAGS() | FLAG_B | FLAG_U); }
+#define BVC_OP  B, !(OVERFLOW & 0x80)
+#define BVS_OP  B, OVERFLOW & 0x80
+#define CLC_OP  I, CARRY = 0
+#define CLD_OP  I, FLAGS &= ~FLAG_D
+#define CLI_OP  I, (FLAGS &= ~FLAG_I, IRQ_CHECK())
+#define CLV_OP  I, OVERFLOW = 0
+#define CMP_OP  R, COMPARE(A, m)
+#define CPX_OP  R, COMPARE(X, m)
+#define CPY_OP  R, COMPARE(Y, m)
+#define DEC_OP  M, (m -= 1, SET_NZ(m))
+#define DEX_OP  I, (X -= 1, SET_NZ(X))
+#define DEY_OP  I, (Y -= 1, SET_NZ(Y))
+#define EOR_OP  R, (A ^= m, SET_NZ(A))
+#define INC_OP  M, (m += 1, SET_NZ(m))
+#define INX_OP  I, (X += 1, SET_NZ(X))
+#define INY_OP  I, (Y += 1, SET_NZ(Y))
+#define JMP_OP  J, PC = ea
+#define JSR_OP  J, { PC--; PUSH(PC >> 8); PUSH(PC & 0xFF); PC = ea; }
+#define LDA_OP  R, (A = m, SET_NZ(A))
+#define LDX_OP  R, (X = m, SET_NZ(X))
+#define LDY_OP  R, (Y = m, SET_NZ(Y))
+#define LSR_OP  M, (CARRY = m & 1, m >>= 1, SET_NZ(m))
+#define NOP_OP  R, (void)m
+#define ORA_OP  R, (A |= m, SET_NZ(A))
+#define PHA_OP  P, PUSH(A)
+#define PHP_OP  P, PUSH(GET_FLAGS() | FLAG_B | FLAG_U)
+#define PLA_OP  I, (A = PULL(), SET_NZ(A))
+#define PLP_OP  I, (SET_FLAGS(PULL() & ~(FLAG_B | FLAG_U)), IRQ_CHECK())
+#define ROL_OP  M, (alu = m << 1 | CARRY, CARRY = alu >> 8, m = alu, SET_NZ(m))
+#define ROR_OP  M, (alu = m | CARRY << 8, CARRY = m & 1, m = alu >> 1, SET_NZ(m))
+#define RTI_OP  F, { SET_FLAGS(PULL() & ~(FLAG_B | FLAG_U)); PC = PULL(); PC |= PULL() << 8; IRQ_CHECK(); }
+#define RTS_OP  F, { PC = PULL(); PC |= PULL() << 8; PC++; }
+#define SBC_OP  R, ALU_SBC(m)
+#define SEC_OP  I, CARRY = 1
+#define SED_OP  I, FLAGS |= FLAG_D
+#define SEI_OP  I, FLAGS |= FLAG_I
+#define STA_OP  W, A
+#define STX_OP  W, X
+#define STY_OP  W, Y
+#define TAX_OP  I, (X = A, SET_NZ(X))
+#define TAY_OP  I, (Y = A, SET_NZ(Y))
+#define TSX_OP  I, (X = SP, SET_NZ(X))
+#define TXA_OP  I, (A = X, SET_NZ(A))
+#define TXS_OP  I, SP = X
+#define TYA_OP  I, (A = Y, SET_NZ(A))
+
+/* The stable undocumented ones */
+#define ALR_OP  R, (A &= m, CARRY = A & 1, A >>= 1, SET_NZ(A))
+#define ANC_OP  R, (A &= m, SET_NZ(A), CARRY = A >> 7)
+#define AXS_OP  R, (CARRY = (A & X) >= m, X = (A & X) - m, SET_NZ(X))
+#define DCP_OP  M, (m -= 1, COMPARE(A, m))
+#define ISC_OP  M, { m += 1; ALU_SBC(m); }
+#define LAX_OP  R, (A = X = m, SET_NZ(A))
+#define RLA_OP  M, (alu = m << 1 | CARRY, CARRY = alu >> 8, m = alu, A &= m, SET_NZ(A))
+#define RRA_OP  M, { alu = m | CARRY << 8; CARRY = m & 1; m = alu >> 1; ALU_ADC(m); }
+#define SAX_OP  W, A & X
+#define SLO_OP  M, (CARRY = m >> 7, m <<= 1, A |= m, SET_NZ(A))
+#define SRE_OP  M, (CARRY = m & 1, m >>= 1, A ^= m, SET_NZ(A))
+
+#ifdef EM6502_DOCUMENTED_ONLY
+#define UOP(code, name, mode, cycles)
+#else
+#define UOP(code, name, mode, cycles)  OP(code, name, mode, cycles)
+#endif
+
+/* How the trace shows each addressing mode */
+#define FMT_IMP        ""
+#define FMT_ACC        " A"
+#define FMT_IMM        " #%02X"
+#define FMT_ZPG        " zeropage %02X"
+#define FMT_ZPX        " zeropage %02X, X"
+#define FMT_ZPY        " zeropage %02X, Y"
+#define FMT_ABS        " %04X"
+#define FMT_ABX        " %04X, X"
+#define FMT_ABY        " %04X, Y"
+#define FMT_IND        " (%04X)"
+#define FMT_IZX        " (zeropage %02X, X)"
+#define FMT_IZY        " (zeropage %02X), Y"
+#define FMT_REL        " %02i"
+
+/* Instruction lengths, for the block decoder */
+#define LENGTH_IMP     1
+#define LENGTH_ACC     1
+#define LENGTH_IMM     2
+#define LENGTH_ZPG     2
+#define LENGTH_ZPX     2
+#define LENGTH_ZPY     2
+#define LENGTH_ABS     3
+#define LENGTH_ABX     3
+#define LENGTH_ABY     3
+#define LENGTH_IND     3
+#define LENGTH_IZX     2
+#define LENGTH_IZY     2
+#define LENGTH_REL     2
+
+/* Puts an entry into the history ring. The diagnostic interpreter puts
+   in each instruction as it starts, the production one each block. */
+#if EM6502_HISTORY
+#define HISTORY_PUT(pc, operand, opcode, kind)  do {                                 \
+          struct history *h = &machine->history[HIST_NEXT++ % HISTORY_SIZE];       \
+          h->cycle = CYCLES;                                                        \
+          h->regs  = PACK_REGS();                                                   \
+          h->insn  = (pc) | (uint32_t)(operand) << 16 | (uint64_t)(opcode) << 32 |  \
+                     (uint64_t)(kind) << 40;                                        \
+        } while(0)
+#else
+#define HISTORY_PUT(pc, operand, opcode, kind)  ((void)0)
+#endif
+#if TRACING
+#define TRACE_FILE(code)  (machine->tracefile ? tracefile_insn(0x##code) : (void)0)
+#else
+#define TRACE_FILE(code)  ((void)0)
+#endif
+#if TRACING
+#define HISTORY(code)  HISTORY_PUT(machine->trace_addr,                              \
+                                   history_peek(PC) | history_peek(PC+1) << 8,      \
+                                   0x##code, HISTORY_INSN)
+#else
+#define HISTORY(code)  ((void)0)
+#endif
+
+#if TRACING
+#define BEGIN_INSTRUCTION()                                                          \
+          if((machine->bp_page[PC>>8] & BP_PC) && BP_BIT(machine->bp_pc_bits, PC)) { \
+            bp_hit(BP_PC, PC, 0);                                                    \
+            if(machine->cpu_stopped)                                                 \
+              goto done;                                                             \
+          }                                                                          \
+          machine->state.instructions++;                                             \
+          machine->trace_addr      = PC;                                             \
+          machine->trace_fetch_len = 0;                                              \
+          inst            = FETCH();                                                 \
+          machine->trace_opcode    = inst;                                           \
+          machine->dispatched[inst] = 1;                                             \
+          if(machine->profile_file)                                                  \
+            profile_insn(inst);
+#define HANDLER        jump[inst]
+#define INST           inst
+#else
+#define BEGIN_INSTRUCTION()                                  \
+          di++;                                              \
+          PC  += di->length;
+#define HANDLER        di->handler
+#define INST           di->opcode
+#endif
+
+#if USE_COMPUTED_GOTO
+#define OPCODE(code)   op_##code:
+#define NEXT           do {                                      \
+                          if(CYCLES >= machine->cpu_deadline)    \
+                            goto done;                           \
+                          BEGIN_INSTRUCTION()                    \
+                          goto *HANDLER;                         \
+                       } while(0)
+#define JUMP_TABLE     jump
+#else
+#define OPCODE(code)   case 0x##code:
+#define NEXT           break
+#define JUMP_TABLE     NULL
+#endif
+
+#if !TRACING
+/*
+ * The block decoder. block_info[] gives the length of each opcode, with
+ * BLOCK_END set on the ones that change the flow of control and
+ * BLOCK_WRITES on the ones that write to memory - a zero entry is an
+ * unknown opcode, which also ends the block.
+ */
+#define BLOCK_KIND(op)            BLOCK_KIND_(op)
+#define BLOCK_KIND_(kind, body)   BLOCK_KIND_##kind
+#define BLOCK_KIND_I   0
+#define BLOCK_KIND_P   BLOCK_WRITES
+#define BLOCK_KIND_R   0
+#define BLOCK_KIND_W   BLOCK_WRITES
+#define BLOCK_KIND_M   BLOCK_WRITES
+#define BLOCK_KIND_F   BLOCK_END
+#define BLOCK_KIND_J   BLOCK_END
+#define BLOCK_KIND_B   BLOCK_END
+
+static const uint8_t block_info[256] = {
+#define OP(code, name, mode, cycles)  [0x##code] = LENGTH_##mode | BLOCK_KIND(name##_OP),
+#include "em6502_opcodes.def"
+#undef OP
+};
+
+/* With -j blocks end in BLOCK_COUNTED, so that lookups are counted */
+#if EM6502_JIT
+#define BLOCK_END_OPCODE  (em->jit_enabled ? BLOCK_COUNTED : BLOCK_SENTINEL)
+#else
+#define BLOCK_END_OPCODE  BLOCK_SENTINEL
+#endif
+
+#if USE_COMPUTED_GOTO
+/* Points the first instruction of each run in super_table[] at its fused handler */
+static void super_apply(struct decoded *insn, int count, const void *const *handlers) {
+  int i, j, k;
+
+  for(i = 1; i < count; i++) {
+    for(k = 0; k < SUPER_COUNT; k++) {
+      if(i + super_table[k].length - 1 > count)
+        continue;
+      for(j = 0; j < super_table[k].length && insn[i+j].opcode == super_table[k].opcode[j]; j++)
+        ;
+      if(j == super_table[k].length)
+        break;
+    }
+    if(k < SUPER_COUNT) {
+      insn[i].handler = handlers[SUPER_BASE + k];
+      i += super_table[k].length - 1;
+    }
+  }
+}
+#endif
+
+static struct block *block_decode(struct block *b, uint16_t pc,
+                                  const void *const *handlers) {
+  uint16_t addr   = pc;
+  int      cached = 1;
+  int      i      = 0;
+  uint8_t  writes = 0;
+  uint8_t  info, byte;
+  struct decoded *d;
+
+#if EM6502_JIT
+  jit_discard(b, pc);
+#endif
+  info = 0;
+  while(!(info & BLOCK_END) && i < BLOCK_MAX && addr != em->run_exit_pc) {
+    d = &b->insn[++i];
+    cached &= block_code_byte(addr, &byte);
+    info = block_info[byte];
+    if(!info)
+      info = 1 | BLOCK_END;
+    writes    |= info;
+    d->opcode  = byte;
+    d->length  = info & BLOCK_LENGTH;
+    d->operand = 0;
+    if(d->length > 1) {
+      cached &= block_code_byte(addr+1, &byte);
+      d->operand = byte;
+    }
+    if(d->length > 2) {
+      cached &= block_code_byte(addr+2, &byte);
+      d->operand |= byte<<8;
+    }
+    d->handler = handlers ? handlers[d->opcode] : NULL;
+    addr += d->length;
+  }
+
+  /* All the branches are xxx10000 */
+  b->idle_regs = ~(uint64_t)0;
+  d = &b->insn[i+1];
+  if(i == 0) {
+    d->opcode = BLOCK_STOP;
+#if EM6502_JIT
+    b->no_jit = 1;
+#endif
+  } else if(cached && !(writes & BLOCK_WRITES) && (d[-1].opcode & 0x1F) == 0x10 &&
+            (uint16_t)(addr + (int8_t)d[-1].operand) == pc) {
+    d->opcode = BLOCK_IDLE;
+#if EM6502_JIT
+    b->no_jit = 1;
+#endif
+  } else {
+    d->opcode = BLOCK_END_OPCODE;
+  }
+  d->length  = 0;
+  d->handler = handlers ? handlers[d->opcode] : NULL;
+#if USE_COMPUTED_GOTO
+  super_apply(b->insn, i, handlers);
+#endif
+
+  b->start     = pc;
+  b->size      = addr - pc;
+  b->insns     = i;
+  b->last_page = (uint16_t)(addr-1) >> 8;
+  b->gen       = em->page_gen[pc>>8] + em->page_gen[b->last_page];
+  /* Blocks fetched from I/O are decoded again every time they run */
+  b->pc        = cached ? pc : -1;
+  return b;
+}
+
+/* Returns the block at 'pc', positioned to run its first instruction */
+static struct decoded *block_find(uint16_t pc, const void *const *handlers) {
+  struct block *b = &em->block_cache[pc & (BLOCK_CACHE-1)];
+  if(b->pc != pc || b->gen != em->page_gen[pc>>8] + em->page_gen[b->last_page])
+    b = block_decode(b, pc, handlers);
+  em->block_current = b;
+  return b->insn;
+}
+#endif
+
+#if USE_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+static int OPS(cpu_run_cycles)(uint32_t cycles) {
+  struct em6502 *const machine = em;
+#if !TRACING
+  uint8_t  reg_a     = machine->state.a;
+  uint8_t  reg_x     = machine->state.x;
+  uint8_t  reg_y     = machine->state.y;
+  uint8_t  reg_sp    = machine->state.sp;
+  uint8_t  reg_flags = machine->state.flags;
+  uint8_t  reg_n     = machine->state.n_res;
+  uint8_t  reg_z     = machine->state.z_res;
+  uint8_t  reg_c     = machine->state.carry;
+  uint8_t  reg_v     = machine->state.overflow;
+  uint16_t reg_pc    = machine->state.pc;
+  uint64_t reg_cycle = machine->state.cycle;
+  uint32_t reg_hist  = machine->history_next;
+  uint16_t ra;
+#endif
+  uint16_t ea;
+  uint16_t alu;
+  uint16_t ptr;
+  uint8_t  zp;
+#if TRACING
+  unsigned inst;
+#endif
+#if !TRACING
+  struct decoded *di;
+#endif
+
+#if USE_COMPUTED_GOTO
+  static const void *const jump[SUPER_BASE + SUPER_COUNT] = {
+    [0 ... 255] = &&op_unknown,
+#if !TRACING
+    [BLOCK_SENTINEL] = &&block_end,
+#if EM6502_JIT
+    [BLOCK_COUNTED]  = &&block_counted,
+#endif
+    [BLOCK_IDLE]     = &&block_idle,
+    [BLOCK_STOP]     = &&block_stop,
+#define SUPER2(c1,n1,m1,y1, c2,n2,m2,y2)  \
+    [SUPER_BASE + SUPER_##c1##_##c2] = &&super_##c1##_##c2,
+#define SUPER3(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3)  \
+    [SUPER_BASE + SUPER_##c1##_##c2##_##c3] = &&super_##c1##_##c2##_##c3,
+#define SUPER4(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3, c4,n4,m4,y4)  \
+    [SUPER_BASE + SUPER_##c1##_##c2##_##c3##_##c4] = &&super_##c1##_##c2##_##c3##_##c4,
+#include "em6502_super.def"
+#undef SUPER4
+#undef SUPER3
+#undef SUPER2
+#endif
+#define OP(code, name, mode, cycles)  [0x##code] = &&op_##code,
+#include "em6502_opcodes.def"
+#undef OP
+  };
+#endif
+
+  machine->cpu_deadline = CYCLES + cycles;
+
+  /* Interrupts are only taken here, between batches. An NMI is taken
+     once for each time VIA1's line goes active, an IRQ for as long as
+     VIA2's is active and I is clear. */
+  if(machine->nmi_pending || (machine->irq && !(FLAGS & FLAG_I))) {
+    uint16_t vector = machine->nmi_pending ? 0xFFFA : 0xFFFE;
+    machine->nmi_pending = 0;
+    HISTORY_PUT(PC, 0, 0, vector == 0xFFFA ? HISTORY_NMI : HISTORY_IRQ);
+#if TRACING
+    machine->trace_addr      = PC;
+    machine->trace_fetch_len = 0;
+    if(machine->tracefile)
+      tracefile_interrupt(vector == 0xFFFA);
+#endif
+    INTERRUPT(vector, (GET_FLAGS() & ~FLAG_B) | FLAG_U);
+    CYCLES += 7;
+    TRACE(vector == 0xFFFA ? "NMI" : "IRQ");
+  }
+
+#if !TRACING
+block_end:
+  di = block_find(PC, JUMP_TABLE);
+#if EM6502_JIT
+block_run:
+#endif
+  machine->state.instructions += machine->block_current->insns;
+  HISTORY_PUT(PC, machine->block_current->insns, 0, HISTORY_BLOCK);
+#endif
+#if USE_COMPUTED_GOTO
+  NEXT;
+#else
+  for(;;) {
+    if(CYCLES >= machine->cpu_deadline)
+      goto done;
+    BEGIN_INSTRUCTION()
+    switch(INST) {
+#endif
+
+/********************************************************************************/
+/*************** START OF ALL THE OPCODE IMPLEMENTATOINS ************************/
+/********************************************************************************/
+
+#define OP(code, name, mode, cycles)  \
+  OPCODE(code) {                      \
+    HISTORY(code);                    \
+    TRACE_FILE(code);                 \
+    EXEC(name##_OP, mode);            \
+    CYCLES += cycles;                 \
+    TRACE(#name FMT_##mode);          \
+  } NEXT;
+#include "em6502_opcodes.def"
+#undef OP
+
+#if !TRACING && USE_COMPUTED_GOTO
+/*
+ * The fused handlers. Each instruction but the last is followed by the
+ * deadline check that NEXT would have made, and the move on to the next
+ * decoded instruction, but not the dispatch.
+ */
+#define SUPER_INSN(code, name, mode, cycles)       \
+  EXEC(name##_OP, mode);                           \
+  CYCLES += cycles;
+#define SUPER_STEP                                 \
+  if(CYCLES >= machine->cpu_deadline)              \
+    goto done;                                     \
+  di++;                                            \
+  PC += di->length;
+#define SUPER2(c1,n1,m1,y1, c2,n2,m2,y2)            \
+  super_##c1##_##c2: {                             \
+    SUPER_INSN(c1,n1,m1,y1) SUPER_STEP             \
+    SUPER_INSN(c2,n2,m2,y2)                        \
+  } NEXT;
+#define SUPER3(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3)  \
+  super_##c1##_##c2##_##c3: {                      \
+    SUPER_INSN(c1,n1,m1,y1) SUPER_STEP             \
+    SUPER_INSN(c2,n2,m2,y2) SUPER_STEP             \
+    SUPER_INSN(c3,n3,m3,y3)                        \
+  } NEXT;
+#define SUPER4(c1,n1,m1,y1, c2,n2,m2,y2, c3,n3,m3,y3, c4,n4,m4,y4)  \
+  super_##c1##_##c2##_##c3##_##c4: {               \
+    SUPER_INSN(c1,n1,m1,y1) SUPER_STEP             \
+    SUPER_INSN(c2,n2,m2,y2) SUPER_STEP             \
+    SUPER_INSN(c3,n3,m3,y3) SUPER_STEP             \
+    SUPER_INSN(c4,n4,m4,y4)                        \
+  } NEXT;
+#include "em6502_super.def"
+#undef SUPER4
+#undef SUPER3
+#undef SUPER2
+#undef SUPER_STEP
+#undef SUPER_INSN
+#endif
+
+/********************************************************************************/
+/*************** END OF ALL THE OPCODE IMPLEMENTATOINS **************************/
+/********************************************************************************/
+
+#if USE_COMPUTED_GOTO
+op_unknown:
+#else
+#if !TRACING
+    case BLOCK_SENTINEL:
+      goto block_end;
+#if EM6502_JIT
+    case BLOCK_COUNTED:
+      goto block_counted;
+#endif
+    case BLOCK_IDLE:
+      goto block_idle;
+    case BLOCK_STOP:
+      goto block_stop;
+#endif
+    default:
+      goto op_unknown;
+    }
+  }
+op_unknown:
+#endif
+  /* The caller reports it, from the registers and the opcode at PC-1 */
+  SYNC();
+  cpu_stop("fault");
+  return 0;
+
+done:
+#if !TRACING
+  /* The whole block was counted when it started */
+  machine->state.instructions -= machine->block_current->insns -
+                                 (di - machine->block_current->insn);
+#endif
+  SYNC();
+  return !machine->cpu_stopped;
+
+#if !TRACING
+  /* A possible idle loop has just run. A trip round it that starts and
+     ends with the same registers will be the same every time, so the
+     whole trips that fit before the deadline are skipped, and before
+     anything the loop read from I/O changes */
+block_idle:
+  if(PC == machine->block_current->start) {
+    struct block *b = machine->block_current;
+    uint64_t regs   = PACK_REGS();
+    uint64_t period = CYCLES - b->idle_cycle;
+    uint64_t until  = machine->cpu_deadline < machine->io_until ? machine->cpu_deadline
+                                                                : machine->io_until;
+    uint64_t left   = until > CYCLES ? until - CYCLES : 0;
+    if(regs == b->idle_regs && period && left > period) {
+      uint64_t trips = (left-1) / period;
+      CYCLES      += trips * period;
+      machine->idle_cycles += trips * period;
+      machine->state.instructions += trips * (machine->state.instructions - b->idle_insns);
+    }
+    b->idle_regs  = regs;
+    b->idle_cycle = CYCLES;
+    b->idle_insns = machine->state.instructions;
+    machine->io_until = UINT64_MAX;
+  } else {
+    machine->block_current->idle_regs = ~(uint64_t)0;
+  }
+  goto block_end;
+
+  /* The block at run_exit_pc, which has nothing in it to run, so there
+     is no instruction to count for getting to its sentinel */
+block_stop:
+  di--;
+  cpu_stop("pc");
+  goto done;
+#endif
+
+#if EM6502_JIT && !TRACING
+  /* Blocks end here rather than at block_end with -j, which keeps the
+     JIT's bookkeeping out of the interpreter's path without it */
+block_counted:
+  di = block_find(PC, JUMP_TABLE);
+  if(jit_ready(machine->block_current)) {
+    SYNC();
+    di = jit_run(JUMP_TABLE);
+    RELOAD();
+  }
+  goto block_run;
+#endif
+}
+#if USE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#undef A
+#undef X
+#undef Y
+#undef SP
+#undef PC
+#undef FLAGS
+#undef N_RES
+#undef Z_RES
+#undef CARRY
+#undef OVERFLOW
+#undef CYCLES
+#undef SYNC
+#undef SYNC_CYCLES
+#undef RELOAD
+#undef PACK_REGS
+#undef HIST_NEXT
+#undef SET_NZ
+#undef GET_FLAGS
+#undef SET_FLAGS
+#undef SET_NVZC
+#undef ALU_BINARY
+#undef ALU_ADC
+#undef ALU_SBC
+#undef TRACE
+#undef TRACE_NUM
+#undef FETCH
+#undef READ
+#undef WRITE
+#undef PUSH
+#undef PULL
+#undef INTERRUPT
+#undef COMPARE
+#undef ABS_OPERAND
+#undef ZP_POINTER
+#undef ADDR_ZPG
+#undef ADDR_ZPX
+#undef ADDR_ZPY
+#undef ADDR_ABS
+#undef ADDR_ABX
+#undef ADDR_ABY
+#undef ADDR_IND
+#undef ADDR_IZX
+#undef ADDR_IZY
+#undef RELATIVE
+#undef PAGE_CROSS
+#undef LOAD_IMP
+#undef LOAD_IMM
+#undef LOAD_ZPG
+#undef LOAD_ZPX
+#undef LOAD_ZPY
+#undef LOAD_ABS
+#undef LOAD_ABX
+#undef LOAD_ABY
+#undef LOAD_IZX
+#undef LOAD_IZY
+#undef MODIFY_ACC
+#undef MODIFY_MEM
+#undef MODIFY_ZPG
+#undef MODIFY_ZPX
+#undef MODIFY_ABS
+#undef MODIFY_ABX
+#undef MODIFY_ABY
+#undef MODIFY_IZX
+#undef MODIFY_IZY
+#undef EXEC
+#undef EXEC_
+#undef EXEC_I
+#undef EXEC_P
+#undef EXEC_R
+#undef EXEC_W
+#undef EXEC_M
+#undef EXEC_J
+#undef EXEC_B
+#undef ADC_OP
+#undef AND_OP
+#undef ASL_OP
+#undef BCC_OP
+#undef BCS_OP
+#undef BEQ_OP
+#undef BIT_OP
+#undef BMI_OP
+#undef BNE_OP
+#undef BPL_OP
+#undef BRK_OP
+#undef BVC_OP
+#undef BVS_OP
+#undef CLC_OP
+#undef CLD_OP
+#undef CLI_OP
+#undef CLV_OP
+#undef CMP_OP
+#undef CPX_OP
+#undef CPY_OP
+#undef DEC_OP
+#undef DEX_OP
+#undef DEY_OP
+#undef EOR_OP
+#undef INC_OP
+#undef INX_OP
+#undef INY_OP
+#undef JMP_OP
+#undef JSR_OP
+#undef LDA_OP
+#undef LDX_OP
+#undef LDY_OP
+#undef LSR_OP
+#undef NOP_OP
+#undef ORA_OP
+#undef PHA_OP
+#undef PHP_OP
+#undef PLA_OP
+#undef PLP_OP
+#undef ROL_OP
+#undef ROR_OP
+#undef RTI_OP
+#undef RTS_OP
+#undef SBC_OP
+#undef SEC_OP
+#undef SED_OP
+#undef SEI_OP
+#undef STA_OP
+#undef STX_OP
+#undef STY_OP
+#undef TAX_OP
+#undef TAY_OP
+#undef TSX_OP
+#undef TXA_OP
+#undef TXS_OP
+#undef TYA_OP
+#undef ALR_OP
+#undef ANC_OP
+#undef AXS_OP
+#undef DCP_OP
+#undef ISC_OP
+#undef LAX_OP
+#undef RLA_OP
+#undef RRA_OP
+#undef SAX_OP
+#undef SLO_OP
+#undef SRE_OP
+#undef UOP
+#undef UOP
+#undef FMT_IMP
+#undef FMT_ACC
+#undef FMT_IMM
+#undef FMT_ZPG
+#undef FMT_ZPX
+#undef FMT_ZPY
+#undef FMT_ABS
+#undef FMT_ABX
+#undef FMT_ABY
+#undef FMT_IND
+#undef FMT_IZX
+#undef FMT_IZY
+#undef FMT_REL
+#undef BEGIN_INSTRUCTION
+#undef HANDLER
+#undef INST
+#undef JUMP_TABLE
+#undef BYTE_OPERAND
+#undef OPCODE
+#undef LENGTH_IMP
+#undef LENGTH_ACC
+#undef LENGTH_IMM
+#undef LENGTH_ZPG
+#undef LENGTH_ZPX
+#undef LENGTH_ZPY
+#undef LENGTH_ABS
+#undef LENGTH_ABX
+#undef LENGTH_ABY
+#undef LENGTH_IND
+#undef LENGTH_IZX
+#undef LENGTH_IZY
+#undef LENGTH_REL
+#undef HISTORY
+#undef HISTORY_PUT
+#undef TRACE_FILE
+#undef BLOCK_END_OPCODE
+#undef BLOCK_KIND
+#undef BLOCK_KIND_
+#undef BLOCK_KIND_I
+#undef BLOCK_KIND_P
+#undef BLOCK_KIND_R
+#undef BLOCK_KIND_W
+#undef BLOCK_KIND_M
+#undef BLOCK_KIND_F
+#undef BLOCK_KIND_J
+#undef BLOCK_KIND_B
+#undef NEXT
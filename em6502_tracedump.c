@@ -0,0 +1,26 @@
+/********************************************************************************
+* em6502_tracedump - prints part of a binary trace made with './em6502 -T'
+*
+*   ./em6502_tracedump <file> [cycle [count]]
+*
+* prints 'count' instructions, 100 by default, from 'cycle' on, by default
+* from the start.
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "em6502.h"
+
+int main(int argc, char *argv[]) {
+   uint64_t cycle = 0, count = 100;
+
+   if(argc < 2 || argc > 4) {
+      fprintf(stderr, "Usage: %s <file> [cycle [count]]\n", argv[0]);
+      return 1;
+   }
+   if(argc > 2)
+      cycle = strtoull(argv[2], NULL, 10);
+   if(argc > 3)
+      count = strtoull(argv[3], NULL, 10);
+   return em6502_print_trace(argv[1], cycle, count) ? 0 : 1;
+}
@@ -0,0 +1,835 @@
+/********************************************************************************
+* Binary traces
+*
+* With -T the diagnostic interpreter records what the CPU does into a file
+* rather than printing it. Each record is delta encoded against the ones
+* before it. An instruction is a tag, the cycles since the last record, the
+* PC only when it is not where the last instruction led, the opcode and
+* operand bytes, and only the registers that changed. A read or write is
+* the change in address and the data, and is put after the instruction
+* that made it. An interrupt is the cycles and the PC it was taken at.
+* Fetches are not recorded, as the instruction holds its own bytes.
+*
+* Records go into blocks of up to TRACEFILE_BLOCK bytes, each starting
+* from the state in its header, so that any block can be decoded on its
+* own. Full blocks are handed through a ring of TRACEFILE_QUEUE slots to a
+* writer thread, which packs them with a small LZ77 coder and writes them
+* out. If the ring is full the emulator waits for the writer, as a trace
+* with gaps would be no use. Finishing the trace writes an index of the
+* first cycle and offset of every block, so em6502_print_trace() can seek
+* straight to a cycle. A trace without one, from a run that crashed, is
+* read by walking the blocks. A reset or restore starts the cycles again,
+* and a trace across one is searched in the order it was recorded.
+*
+* The filter is applied as records are made. Instructions outside the PC
+* range are left out along with their accesses, and so are the kinds of
+* record not asked for. Without 'ops', an instruction only goes in ahead
+* of an access of it that is recorded, to place it.
+*
+* Like save states, trace files are in the host's byte order.
+********************************************************************************/
+#define TRACEFILE_MAGIC        "em6502t"
+#define TRACEFILE_VERSION      1
+#define TRACEFILE_BLOCK_MAGIC  0x4B4C4254    // "TBLK"
+#define TRACEFILE_INDEX_MAGIC  0x58444E49    // "INDX"
+#define TRACEFILE_BLOCK        65536         // bytes of records in a block, unpacked
+#define TRACEFILE_QUEUE        8             // blocks waiting for the writer
+#define TRACEFILE_RECORD       32            // more than the largest record
+#define TRACEFILE_PACKED       (TRACEFILE_BLOCK + TRACEFILE_BLOCK/255 + 16)
+#define TRACEFILE_HASH_BITS    12
+#define TRACEFILE_IRQ          16            // a kind, with TRACE_OP, TRACE_RD and TRACE_WR
+
+/* Record tags. The top two bits are the kind. Instructions and
+   interrupts have a bit for each of A, X, Y, SP and P that follows, from
+   bit 0 up. An instruction has TF_JUMP set when the PC follows, and an
+   interrupt TF_NMI for an NMI. */
+#define TF_KIND   0xC0
+#define TF_INSN   0x00
+#define TF_READ   0x40
+#define TF_WRITE  0x80
+#define TF_IRQ    0xC0
+#define TF_JUMP   0x20
+#define TF_NMI    0x20
+
+struct tracefile_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;       // STATE_BYTE_ORDER, as the host stores it
+  uint32_t kinds;            // of record, TRACE_OP, TRACE_RD, TRACE_WR and TRACEFILE_IRQ
+  uint16_t first;            // the PC range
+  uint16_t last;
+};
+
+struct tracefile_block {
+  uint32_t magic;
+  uint32_t size;             // of the data that follows
+  uint32_t raw_size;         // unpacked, the same as size when stored as it is
+  uint32_t records;
+  uint64_t cycle;            // the state the first record is relative to
+  uint64_t last_cycle;       // of the last instruction or interrupt
+  uint16_t pc;
+  uint16_t addr;
+  uint8_t  regs[5];          // A, X, Y, SP and P
+  uint8_t  unused[7];
+};
+
+struct tracefile_index {
+  uint64_t cycle;            // from the block's header
+  uint64_t offset;
+};
+
+/* The very end of the file, after the index */
+struct tracefile_trailer {
+  uint64_t offset;           // of the index
+  uint32_t blocks;
+  uint32_t magic;
+};
+
+struct tracefile_slot {
+  struct tracefile_block header;
+  uint8_t                data[TRACEFILE_BLOCK];
+};
+
+struct tracefile {
+  int       fd;
+  char     *filename;
+  uint32_t  kinds;
+  uint16_t  first;
+  uint16_t  last;
+
+  /* The recorder, on the emulator's thread */
+  struct tracefile_slot *slot;          // the block being filled
+  uint8_t  *put;                        // where its next record goes
+  uint32_t  records;                    // in it
+  uint64_t  total;                      // in the blocks before it
+  uint64_t  cycle;                      // the state the next record is relative to
+  uint16_t  pc;
+  uint16_t  addr;
+  uint8_t   regs[5];
+  uint32_t  in_range;                   // the kinds recorded for the current instruction
+  int       pending;                    // which is waiting to be put in ahead of an access
+  uint64_t  insn_cycle;
+  uint16_t  insn_pc;
+  uint8_t   insn[3];
+  uint8_t   insn_regs[5];
+
+  /* The writer thread */
+  struct tracefile_slot   slots[TRACEFILE_QUEUE];
+  atomic_uint             head;         // only written by the emulator
+  atomic_uint             tail;         // only written by the writer
+  sem_t                   slot_free;    // posted per block written out
+  sem_t                   slot_ready;   // posted per block handed over, and once to stop
+  pthread_t               thread;
+  uint8_t                 packed[TRACEFILE_PACKED];
+  uint32_t                hash[1 << TRACEFILE_HASH_BITS];
+  struct tracefile_index *index;
+  uint32_t                blocks;
+  uint32_t                index_size;
+  uint64_t                offset;       // where the next block goes
+  int                     failed;
+};
+
+static uint8_t *tracefile_varint(uint8_t *p, uint64_t v) {
+  while(v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+/* Small changes either way in a few bits */
+static unsigned tracefile_zigzag(uint16_t delta) {
+  int16_t d = delta;
+  return d >= 0 ? 2u*d : 2u*(unsigned)-(d+1) + 1;
+}
+
+static uint16_t tracefile_unzigzag(uint64_t z) {
+  return z & 1 ? ~(uint16_t)(z >> 1) : (uint16_t)(z >> 1);
+}
+
+/*
+ * Block packing. Each sequence is a token byte, whose top four bits are a
+ * count of literals and bottom four a match length less 4, the literals,
+ * then the match as a two byte offset back. A count of 15 goes on in the
+ * bytes after the token, or for a length after the offset, in bytes of
+ * 255 up to one that is less. The last sequence is only literals.
+ */
+static uint8_t *tracefile_length(uint8_t *out, size_t n) {
+  while(n >= 255) {
+    *out++ = 255;
+    n -= 255;
+  }
+  *out++ = n;
+  return out;
+}
+
+static uint8_t *tracefile_sequence(uint8_t *out, const uint8_t *literals, size_t n,
+                                   size_t length, size_t offset) {
+  size_t m = length ? length - 4 : 0;
+  *out++ = (n < 15 ? n : 15) << 4 | (m < 15 ? m : 15);
+  if(n >= 15)
+    out = tracefile_length(out, n - 15);
+  memcpy(out, literals, n);
+  out += n;
+  if(length == 0)
+    return out;
+  *out++ = offset;
+  *out++ = offset >> 8;
+  if(m >= 15)
+    out = tracefile_length(out, m - 15);
+  return out;
+}
+
+/* Returns the packed size, which is never more than TRACEFILE_PACKED */
+static size_t tracefile_pack(struct tracefile *tf, const uint8_t *src, size_t size, uint8_t *dst) {
+  const uint8_t *p = src, *literals = src, *end = src + size;
+  uint8_t *out = dst;
+
+  memset(tf->hash, 0, sizeof(tf->hash));
+  while(p + 4 <= end) {
+    const uint8_t *match;
+    uint32_t v, w, h;
+    size_t length;
+
+    memcpy(&v, p, 4);
+    h = (v * 2654435761u) >> (32 - TRACEFILE_HASH_BITS);
+    match = src + tf->hash[h];
+    tf->hash[h] = p - src;
+    memcpy(&w, match, 4);
+    if(match >= p || p - match > 0xFFFF || w != v) {
+      p++;
+      continue;
+    }
+    for(length = 4; p + length < end && p[length] == match[length]; length++)
+      ;
+    out = tracefile_sequence(out, literals, p - literals, length, p - match);
+    p += length;
+    literals = p;
+  }
+  return tracefile_sequence(out, literals, end - literals, 0, 0) - dst;
+}
+
+/* Returns 0 unless the data unpacks to exactly 'raw' bytes */
+static int tracefile_unpack(const uint8_t *src, size_t size, uint8_t *dst, size_t raw) {
+  const uint8_t *end = src + size;
+  uint8_t *out = dst, *out_end = dst + raw;
+
+  while(src < end) {
+    size_t n = *src >> 4, length = *src & 15, offset;
+    uint8_t more;
+
+    src++;
+    if(n == 15) {
+      do {
+        if(src == end)
+          return 0;
+        more = *src++;
+        n += more;
+      } while(more == 255);
+    }
+    if(n > (size_t)(end - src) || n > (size_t)(out_end - out))
+      return 0;
+    memcpy(out, src, n);
+    out += n;
+    src += n;
+    if(src == end)
+      break;
+    if(end - src < 2)
+      return 0;
+    offset = src[0] | src[1] << 8;
+    src += 2;
+    if(length == 15) {
+      do {
+        if(src == end)
+          return 0;
+        more = *src++;
+        length += more;
+      } while(more == 255);
+    }
+    length += 4;
+    if(offset == 0 || offset > (size_t)(out - dst) || length > (size_t)(out_end - out))
+      return 0;
+    /* The match can overlap what it makes */
+    while(length--) {
+      *out = out[-offset];
+      out++;
+    }
+  }
+  return out == out_end;
+}
+
+/*****************************************************************
+* Writing traces
+*****************************************************************/
+static void tracefile_write(struct tracefile *tf, const void *data, size_t size) {
+  const uint8_t *p = data;
+  while(size && !tf->failed) {
+    ssize_t done = write(tf->fd, p, size);
+    if(done < 0) {
+      fprintf(stderr, "Unable to write '%s'\n", tf->filename);
+      tf->failed = 1;
+      return;
+    }
+    p         += done;
+    size      -= done;
+    tf->offset += done;
+  }
+}
+
+static void *tracefile_writer(void *arg) {
+  struct tracefile *tf = arg;
+  for(;;) {
+    unsigned tail = atomic_load_explicit(&tf->tail, memory_order_relaxed);
+    struct tracefile_slot *s;
+    size_t size;
+
+    if(sem_wait(&tf->slot_ready) != 0)
+      continue;
+    /* A post with nothing handed over is the signal to stop */
+    if(tail == atomic_load_explicit(&tf->head, memory_order_acquire))
+      return NULL;
+    s    = &tf->slots[tail % TRACEFILE_QUEUE];
+    size = tracefile_pack(tf, s->data, s->header.raw_size, tf->packed);
+    s->header.size = size < s->header.raw_size ? size : s->header.raw_size;
+    if(tf->blocks == tf->index_size) {
+      uint32_t grown = tf->index_size ? 2*tf->index_size : 256;
+      struct tracefile_index *index = realloc(tf->index, grown * sizeof(*index));
+      if(index == NULL) {
+        fprintf(stderr, "Out of memory for the trace index\n");
+        tf->failed = 1;
+      } else {
+        tf->index      = index;
+        tf->index_size = grown;
+      }
+    }
+    if(!tf->failed) {
+      tf->index[tf->blocks].cycle  = s->header.cycle;
+      tf->index[tf->blocks].offset = tf->offset;
+      tf->blocks++;
+    }
+    tracefile_write(tf, &s->header, sizeof(s->header));
+    tracefile_write(tf, size < s->header.raw_size ? tf->packed : s->data, s->header.size);
+    atomic_store_explicit(&tf->tail, tail+1, memory_order_release);
+    sem_post(&tf->slot_free);
+  }
+}
+
+/* Starts filling the next slot, from the state as it is */
+static void tracefile_begin(struct tracefile *tf) {
+  unsigned head = atomic_load_explicit(&tf->head, memory_order_relaxed);
+  struct tracefile_block *b;
+
+  while(sem_wait(&tf->slot_free) != 0)
+    ;
+  tf->slot      = &tf->slots[head % TRACEFILE_QUEUE];
+  tf->put       = tf->slot->data;
+  tf->records   = 0;
+  b             = &tf->slot->header;
+  b->magic      = TRACEFILE_BLOCK_MAGIC;
+  b->cycle      = tf->cycle;
+  b->pc         = tf->pc;
+  b->addr       = tf->addr;
+  memcpy(b->regs, tf->regs, sizeof(b->regs));
+}
+
+/* Hands the slot over to the writer */
+static void tracefile_end(struct tracefile *tf) {
+  unsigned head = atomic_load_explicit(&tf->head, memory_order_relaxed);
+  tf->slot->header.raw_size   = tf->put - tf->slot->data;
+  tf->slot->header.records    = tf->records;
+  tf->slot->header.last_cycle = tf->cycle;
+  tf->total += tf->records;
+  atomic_store_explicit(&tf->head, head+1, memory_order_release);
+  sem_post(&tf->slot_ready);
+}
+
+/* Returns where a record at 'cycle' goes. A cycle count that has gone
+   back, after a reset or restore, starts a block of its own. */
+static uint8_t *tracefile_room(struct tracefile *tf, uint64_t cycle) {
+  if(cycle < tf->cycle || tf->put + TRACEFILE_RECORD > tf->slot->data + TRACEFILE_BLOCK) {
+    tracefile_end(tf);
+    if(cycle < tf->cycle)
+      tf->cycle = cycle;
+    tracefile_begin(tf);
+  }
+  return tf->put;
+}
+
+static void tracefile_get_regs(struct tracefile *tf) {
+  tf->insn_regs[0] = em->state.a;
+  tf->insn_regs[1] = em->state.x;
+  tf->insn_regs[2] = em->state.y;
+  tf->insn_regs[3] = em->state.sp;
+  tf->insn_regs[4] = cpu_flags();
+}
+
+/* Puts in the registers that changed, and returns the tag bits for them.
+   Kept short of branches, as it is done for every instruction. */
+static int tracefile_put_regs(struct tracefile *tf, uint8_t **p) {
+  int changed = 0, i;
+  for(i = 0; i < 5; i++) {
+    int differs = tf->insn_regs[i] != tf->regs[i];
+    **p = tf->regs[i] = tf->insn_regs[i];
+    *p += differs;
+    changed |= differs << i;
+  }
+  return changed;
+}
+
+static void tracefile_put_insn(struct tracefile *tf) {
+  uint8_t *p = tracefile_room(tf, tf->insn_cycle), *tag = p++;
+  uint64_t cycles = tf->insn_cycle - tf->cycle;
+  int length = block_info[tf->insn[0]] & BLOCK_LENGTH, changed = 0;
+
+  if(cycles < 0x80)
+    *p++ = cycles;
+  else
+    p = tracefile_varint(p, cycles);
+  if(tf->insn_pc != tf->pc) {
+    changed = TF_JUMP;
+    p = tracefile_varint(p, tracefile_zigzag(tf->insn_pc - tf->pc));
+  }
+  memcpy(p, tf->insn, 3);
+  p += length;
+  changed |= tracefile_put_regs(tf, &p);
+  *tag = TF_INSN | changed;
+  tf->cycle   = tf->insn_cycle;
+  tf->pc      = tf->insn_pc + length;
+  tf->put     = p;
+  tf->pending = 0;
+  tf->records++;
+}
+
+/* Called by the diagnostic interpreter as each instruction starts */
+static void tracefile_insn(uint8_t opcode) {
+  struct tracefile *tf = em->tracefile;
+  uint16_t pc = em->trace_addr;
+
+  tf->pending = 0;
+  if(pc < tf->first || pc > tf->last) {
+    tf->in_range = 0;
+    return;
+  }
+  tf->in_range     = tf->kinds;
+  tf->insn_cycle   = em->state.cycle;
+  tf->insn_pc      = pc;
+  tf->insn[0]      = opcode;
+  tf->insn[1]      = history_peek(pc+1);
+  tf->insn[2]      = history_peek(pc+2);
+  tracefile_get_regs(tf);
+  if(tf->kinds & TRACE_OP)
+    tracefile_put_insn(tf);
+  else
+    tf->pending = 1;
+}
+
+/* And for each read and write, with TRACE_RD or TRACE_WR */
+static void tracefile_access(int kind, uint16_t addr, uint8_t data) {
+  struct tracefile *tf = em->tracefile;
+  uint8_t *p;
+
+  if(!(tf->in_range & kind))
+    return;
+  if(tf->pending)
+    tracefile_put_insn(tf);
+  p    = tracefile_room(tf, tf->cycle);
+  *p++ = kind == TRACE_RD ? TF_READ : TF_WRITE;
+  p    = tracefile_varint(p, tracefile_zigzag(addr - tf->addr));
+  *p++ = data;
+  tf->addr = addr;
+  tf->put  = p;
+  tf->records++;
+}
+
+/* And as it takes an interrupt, whose pushes and vector reads follow */
+static void tracefile_interrupt(int nmi) {
+  struct tracefile *tf = em->tracefile;
+  uint8_t *p, *tag;
+
+  tf->pending  = 0;
+  tf->in_range = tf->kinds & TRACEFILE_IRQ ? tf->kinds : 0;
+  if(!tf->in_range)
+    return;
+  p    = tracefile_room(tf, em->state.cycle);
+  tag  = p++;
+  p    = tracefile_varint(p, em->state.cycle - tf->cycle);
+  *p++ = em->state.pc;
+  *p++ = em->state.pc >> 8;
+  tracefile_get_regs(tf);
+  *tag = TF_IRQ | (nmi ? TF_NMI : 0) | tracefile_put_regs(tf, &p);
+  tf->cycle = em->state.cycle;
+  tf->pc    = em->state.pc;
+  tf->put   = p;
+  tf->records++;
+}
+
+/* "[first-last] [kind,...]", either part optional */
+static int tracefile_filter(struct tracefile *tf, const char *filter) {
+  char copy[128], *word, *kind, *end, *save, *save_kind;
+
+  tf->kinds = TRACE_OP|TRACE_RD|TRACE_WR|TRACEFILE_IRQ;
+  tf->first = 0x0000;
+  tf->last  = 0xFFFF;
+  if(filter == NULL)
+    return 1;
+  if(strlen(filter) >= sizeof(copy)) {
+    fprintf(stderr, "Bad trace filter '%s'\n", filter);
+    return 0;
+  }
+  strcpy(copy, filter);
+  for(word = strtok_r(copy, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+    if(strspn(word, "0123456789ABCDEFabcdef-") == strlen(word)) {
+      unsigned long first = strtoul(word, &end, 16), last = first;
+      if(*end == '-')
+        last = strtoul(end+1, &end, 16);
+      if(*end != '\0' || first > last || last > 0xFFFF) {
+        fprintf(stderr, "Bad address range '%s'\n", word);
+        return 0;
+      }
+      tf->first = first;
+      tf->last  = last;
+      continue;
+    }
+    tf->kinds = 0;
+    for(kind = strtok_r(word, ",", &save_kind); kind; kind = strtok_r(NULL, ",", &save_kind)) {
+      if(strcmp(kind, "ops") == 0)         tf->kinds |= TRACE_OP;
+      else if(strcmp(kind, "reads") == 0)  tf->kinds |= TRACE_RD;
+      else if(strcmp(kind, "writes") == 0) tf->kinds |= TRACE_WR;
+      else if(strcmp(kind, "irqs") == 0)   tf->kinds |= TRACEFILE_IRQ;
+      else {
+        fprintf(stderr, "Unknown kind of trace record '%s'\n", kind);
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static void tracefile_free(struct tracefile *tf) {
+  free(tf->index);
+  free(tf->filename);
+  free(tf);
+}
+
+/* Finishes the trace with its index. Returns 0 if any of it could not be written. */
+static int tracefile_close(void) {
+  struct tracefile *tf = em->tracefile;
+  struct tracefile_trailer trailer;
+  int ok;
+
+  if(tf == NULL)
+    return 1;
+  em->tracefile = NULL;
+  cpu_select();
+  if(tf->records)
+    tracefile_end(tf);
+  sem_post(&tf->slot_ready);
+  pthread_join(tf->thread, NULL);
+  sem_destroy(&tf->slot_free);
+  sem_destroy(&tf->slot_ready);
+
+  trailer.offset = tf->offset;
+  trailer.blocks = tf->blocks;
+  trailer.magic  = TRACEFILE_INDEX_MAGIC;
+  tracefile_write(tf, tf->index, tf->blocks * sizeof(tf->index[0]));
+  tracefile_write(tf, &trailer, sizeof(trailer));
+  ok = close(tf->fd) == 0 && !tf->failed;
+  if(ok)
+    printf("Wrote %llu trace records to '%s', %llu bytes\n", (unsigned long long)tf->total,
+           tf->filename, (unsigned long long)tf->offset);
+  else
+    fprintf(stderr, "The trace in '%s' is incomplete\n", tf->filename);
+  tracefile_free(tf);
+  return ok;
+}
+
+static int tracefile_open(const char *filename, const char *filter) {
+  struct tracefile *tf = calloc(1, sizeof(*tf));
+  struct tracefile_header h;
+  sigset_t all, old;
+  int started;
+
+  if(tf == NULL || (tf->filename = strdup(filename)) == NULL) {
+    fprintf(stderr, "Out of memory for the trace\n");
+    free(tf);
+    return 0;
+  }
+  if(!tracefile_filter(tf, filter)) {
+    tracefile_free(tf);
+    return 0;
+  }
+  tf->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(tf->fd < 0) {
+    fprintf(stderr, "Unable to write '%s'\n", filename);
+    tracefile_free(tf);
+    return 0;
+  }
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACEFILE_MAGIC, sizeof(h.magic));
+  h.version    = TRACEFILE_VERSION;
+  h.byte_order = STATE_BYTE_ORDER;
+  h.kinds      = tf->kinds;
+  h.first      = tf->first;
+  h.last       = tf->last;
+  tracefile_write(tf, &h, sizeof(h));
+  if(tf->failed || sem_init(&tf->slot_free, 0, TRACEFILE_QUEUE) != 0) {
+    close(tf->fd);
+    tracefile_free(tf);
+    return 0;
+  }
+  sem_init(&tf->slot_ready, 0, 0);
+  /* Signals are for the emulator's thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  started = pthread_create(&tf->thread, NULL, tracefile_writer, tf) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if(!started) {
+    fprintf(stderr, "Unable to start the trace writer\n");
+    sem_destroy(&tf->slot_free);
+    sem_destroy(&tf->slot_ready);
+    close(tf->fd);
+    tracefile_free(tf);
+    return 0;
+  }
+
+  tf->cycle   = em->state.cycle;
+  tf->pc      = em->state.pc;
+  tf->regs[0] = em->state.a;
+  tf->regs[1] = em->state.x;
+  tf->regs[2] = em->state.y;
+  tf->regs[3] = em->state.sp;
+  tf->regs[4] = cpu_flags();
+  tracefile_begin(tf);
+  em->tracefile = tf;
+  cpu_select();
+  return 1;
+}
+
+/*****************************************************************
+* Reading traces
+*****************************************************************/
+static uint64_t tracefile_get_varint(const uint8_t **p) {
+  uint64_t v = 0;
+  int shift = 0;
+  uint8_t b;
+  do {
+    b = *(*p)++;
+    v |= (uint64_t)(b & 0x7F) << shift;
+    shift += 7;
+  } while((b & 0x80) && shift < 64);
+  return v;
+}
+
+/* Reads the index, or walks the blocks without one, or if the trailer
+   doesn't fit the file, as a crashed run's might not. Returns how many
+   blocks there are, or -1. */
+static long tracefile_load_index(FILE *f, struct tracefile_index **index) {
+  struct tracefile_trailer t;
+  struct tracefile_block b;
+  long n = 0, size = 0, offset = sizeof(struct tracefile_header);
+  long end;
+
+  *index = NULL;
+  if(fseek(f, -(long)sizeof(t), SEEK_END) == 0 && (end = ftell(f)) >= 0 &&
+     fread(&t, sizeof(t), 1, f) == 1 && t.magic == TRACEFILE_INDEX_MAGIC &&
+     t.offset <= (uint64_t)end &&
+     (uint64_t)end - t.offset == (uint64_t)t.blocks * sizeof(**index)) {
+    *index = malloc(((size_t)t.blocks + 1) * sizeof(**index));
+    if(*index == NULL)
+      return -1;
+    if(fseek(f, t.offset, SEEK_SET) == 0 && fread(*index, sizeof(**index), t.blocks, f) == t.blocks)
+      return t.blocks;
+    free(*index);
+    *index = NULL;
+  }
+  while(fseek(f, offset, SEEK_SET) == 0 && fread(&b, sizeof(b), 1, f) == 1 &&
+        b.magic == TRACEFILE_BLOCK_MAGIC) {
+    if(n == size) {
+      struct tracefile_index *grown;
+      size  = size ? 2*size : 256;
+      grown = realloc(*index, size * sizeof(**index));
+      if(grown == NULL)
+        return -1;
+      *index = grown;
+    }
+    (*index)[n].cycle  = b.cycle;
+    (*index)[n].offset = offset;
+    n++;
+    offset += sizeof(b) + b.size;
+  }
+  return n;
+}
+
+/* Prints a line as history_dump() does, with the registers in full */
+static void tracefile_line(uint64_t cycle, uint16_t pc, const uint8_t *insn, const char *what,
+                           const uint8_t *regs) {
+  struct history h;
+  uint8_t p = regs[4];
+  h.regs = (uint64_t)regs[0] | (uint64_t)regs[1] << 8 | (uint64_t)regs[2] << 16 |
+           (uint64_t)regs[3] << 24 | (uint64_t)p << 32 | (uint64_t)p << 40 |
+           (uint64_t)(p & FLAG_Z ? 0 : 1) << 48 |
+           (uint64_t)((p & FLAG_C) | (p & FLAG_V) << 1) << 56;
+  history_line(cycle, pc, insn[0], insn[1] | insn[2] << 8, what, &h);
+}
+
+/* Prints the records of a block from cycle 'from' on, counting down
+   'count' for each instruction and interrupt. Returns 1 to go on to the
+   next block, 0 when done and -1 if the block is damaged. */
+static int tracefile_decode(const struct tracefile_block *b, const uint8_t *data,
+                            const uint8_t *length, uint64_t from, uint64_t *count) {
+  const uint8_t *p = data, *end = data + b->raw_size;
+  uint64_t cycle = b->cycle;
+  uint16_t pc    = b->pc;
+  uint16_t addr  = b->addr;
+  uint8_t  regs[5], insn[3] = { 0, 0, 0 };
+  /* Accesses at the start belong to the last instruction of the block before */
+  int      shown = b->cycle >= from, i;
+
+  memcpy(regs, b->regs, sizeof(regs));
+  while(p < end) {
+    uint8_t tag = *p++;
+    switch(tag & TF_KIND) {
+      case TF_INSN:
+        cycle += tracefile_get_varint(&p);
+        if(tag & TF_JUMP)
+          pc += tracefile_unzigzag(tracefile_get_varint(&p));
+        insn[0] = *p++;
+        insn[1] = insn[2] = 0;
+        for(i = 1; i < length[insn[0]]; i++)
+          insn[i] = *p++;
+        for(i = 0; i < 5; i++)
+          if(tag & (1 << i))
+            regs[i] = *p++;
+        shown = cycle >= from;
+        if(shown) {
+          if(*count == 0)
+            return 0;
+          tracefile_line(cycle, pc, insn, NULL, regs);
+          (*count)--;
+        }
+        pc += length[insn[0]];
+        break;
+      case TF_READ:
+      case TF_WRITE:
+        addr += tracefile_unzigzag(tracefile_get_varint(&p));
+        if(shown)
+          printf("%16s %-5s $%04X: %02X\n", "", (tag & TF_KIND) == TF_READ ? "read" : "write",
+                 addr, *p);
+        p++;
+        break;
+      case TF_IRQ:
+        cycle += tracefile_get_varint(&p);
+        pc     = p[0] | p[1] << 8;
+        p     += 2;
+        for(i = 0; i < 5; i++)
+          if(tag & (1 << i))
+            regs[i] = *p++;
+        shown  = cycle >= from;
+        if(shown) {
+          if(*count == 0)
+            return 0;
+          tracefile_line(cycle, pc, insn, tag & TF_NMI ? "(NMI)" : "(IRQ)", regs);
+          (*count)--;
+        }
+        break;
+    }
+  }
+  return p == end ? 1 : -1;
+}
+
+/* Returns the block the records from 'from' on start in: the last one
+   that starts before it. After a reset or restore the cycles start again,
+   so that the index is not in order, and then it is the first block, in
+   the order they were recorded, that could hold 'from' or comes after
+   it. */
+static long tracefile_seek(const struct tracefile_index *index, long blocks, uint64_t from) {
+  long lo = 0, hi = blocks, i;
+
+  for(i = 1; i < blocks && index[i-1].cycle <= index[i].cycle; i++)
+    ;
+  if(i < blocks) {
+    for(i = 0; i < blocks; i++) {
+      if(index[i].cycle >= from)
+        return i;
+      if(i+1 == blocks || index[i+1].cycle > from || index[i+1].cycle < index[i].cycle)
+        return i;
+    }
+    return 0;
+  }
+  while(lo < hi) {
+    long mid = (lo + hi) / 2;
+    if(index[mid].cycle < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo ? lo - 1 : 0;
+}
+
+static int tracefile_print(const char *filename, uint64_t from, uint64_t count) {
+  struct tracefile_header h;
+  struct tracefile_block b;
+  struct tracefile_index *index = NULL;
+  uint8_t *packed = malloc(TRACEFILE_PACKED);
+  uint8_t *raw    = malloc(TRACEFILE_BLOCK + TRACEFILE_RECORD);
+  uint8_t  length[256];
+  long     blocks = 0, lo;
+  int      i, ok = 0, more = 1;
+  FILE    *f = fopen(filename, "rb");
+
+  if(f == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", filename);
+    goto out;
+  }
+  if(packed == NULL || raw == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    goto out;
+  }
+  if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TRACEFILE_MAGIC, sizeof(h.magic)) != 0) {
+    fprintf(stderr, "'%s' is not a trace\n", filename);
+    goto out;
+  }
+  if(h.byte_order != STATE_BYTE_ORDER || h.version != TRACEFILE_VERSION) {
+    fprintf(stderr, "Trace version %u is not supported\n", (unsigned)h.version);
+    goto out;
+  }
+  blocks = tracefile_load_index(f, &index);
+  if(blocks < 0) {
+    fprintf(stderr, "Out of memory\n");
+    goto out;
+  }
+  lo = tracefile_seek(index, blocks, from);
+  for(i = 0; i < 256; i++)
+    length[i] = opcode_info[i].name ? history_modes[history_mode(i)].length : 1;
+
+  printf("Trace of PC %04X-%04X, with the registers before each instruction:\n", h.first, h.last);
+  printf("     cycle   PC  bytes     instruction         A  X  Y  SP flags\n");
+  for(; lo < blocks && more > 0; lo++) {
+    if(fseek(f, index[lo].offset, SEEK_SET) != 0 || fread(&b, sizeof(b), 1, f) != 1 ||
+       b.magic != TRACEFILE_BLOCK_MAGIC || b.raw_size > TRACEFILE_BLOCK ||
+       b.size > b.raw_size || fread(packed, 1, b.size, f) != b.size) {
+      more = -1;
+      break;
+    }
+    if(b.size == b.raw_size)
+      memcpy(raw, packed, b.size);
+    else if(!tracefile_unpack(packed, b.size, raw, b.raw_size)) {
+      more = -1;
+      break;
+    }
+    /* Room for a damaged last record to run over without harm */
+    memset(raw + b.raw_size, 0, TRACEFILE_RECORD);
+    more = tracefile_decode(&b, raw, length, from, &count);
+  }
+  if(more < 0)
+    fprintf(stderr, "Block %ld of '%s' is damaged\n", lo, filename);
+  ok = more >= 0;
+out:
+  if(f)
+    fclose(f);
+  free(index);
+  free(packed);
+  free(raw);
+  return ok;
+}